@@ -0,0 +1,833 @@
+// Benchmarks over loopback, run by `make bench`. Each one prints a line per
+// case, numbers of the same benchmark are comparable between builds.
+//
+//   $ ./rdpbench [benchmark...]
+
+#include "rdp.h"
+#include "rdp.hpp"
+#include "rdp_coro.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+int64_t nanotime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Sleep until one of the sockets, or fd unless -1, has something to do.
+void waitSockets(rdpSocket *const *s, int n, int fd = -1) {
+  struct pollfd fds[16];
+  int timeout = 1000;
+
+  for (int i = 0; i < n; i++) {
+    fds[i].fd = rdpSocketGetProp(s[i], RDP_PROP_FD);
+    fds[i].events = POLLIN;
+    timeout = std::min(timeout, rdpSocketIntervalAction(s[i]));
+  }
+  fds[n].fd = fd;
+  fds[n].events = POLLIN;
+  poll(fds, n + 1, timeout);
+}
+
+constexpr int echoRounds = 20000;
+constexpr size_t echoSize = 64;
+
+// Ping-pong echoSize bytes between two sockets, returning ns per round trip.
+// The client side goes through rdp.h directly.
+double echoC() {
+  rdpSocket *s[2] = {rdpSocketCreate(1, "127.0.0.1", "9788"),
+                     rdpSocketCreate(1, "127.0.0.1", "9789")};
+  rdpConn *c = rdpNetConnect(s[0], "127.0.0.1", "9789");
+  char msg[echoSize] = {0}, buf[2048];
+  size_t got = 0;
+  int rounds = 0;
+  int64_t start = 0;
+
+  while (rounds < echoRounds) {
+    waitSockets(s, 2);
+    for (;;) {
+      rdpConn *conn;
+      int events;
+      ssize_t n = rdpReadPoll(s[0], buf, sizeof(buf), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+      if (events & RDP_CONNECTED) {
+        start = nanotime();
+        rdpWrite(c, msg, sizeof(msg));
+      }
+      if ((events & RDP_DATA) && n > 0 && (got += n) == sizeof(msg)) {
+        got = 0;
+        if (++rounds < echoRounds)
+          rdpWrite(c, msg, sizeof(msg));
+      }
+    }
+    for (;;) {
+      rdpConn *conn;
+      int events;
+      ssize_t n = rdpReadPoll(s[1], buf, sizeof(buf), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+      if ((events & RDP_DATA) && n > 0)
+        rdpWrite(conn, buf, n);
+    }
+  }
+
+  double ns = (double)(nanotime() - start) / echoRounds;
+  rdpSocketDestroy(s[0]);
+  rdpSocketDestroy(s[1]);
+  return ns;
+}
+
+// echoC() with the client side going through rdp.hpp.
+double echoHpp() {
+  rdp::Socket client("127.0.0.1", "9788");
+  rdpSocket *s[2] = {client.get(), rdpSocketCreate(1, "127.0.0.1", "9789")};
+  rdp::Conn c = client.connect("127.0.0.1", "9789");
+  std::byte msg[echoSize] = {}, buf[2048];
+  size_t got = 0;
+  int rounds = 0;
+  int64_t start = 0;
+
+  while (rounds < echoRounds) {
+    waitSockets(s, 2);
+    for (;;) {
+      rdp::ReadResult r = client.read(buf);
+      if (r.has(rdp::Event::Again))
+        break;
+      if (r.has(rdp::Event::Connected)) {
+        start = nanotime();
+        c.write(msg);
+      }
+      if (r.has(rdp::Event::Data) && r.n > 0 && (got += r.n) == sizeof(msg)) {
+        got = 0;
+        if (++rounds < echoRounds)
+          c.write(msg);
+      }
+    }
+    for (;;) {
+      rdpConn *conn;
+      int events;
+      ssize_t n = rdpReadPoll(s[1], buf, sizeof(buf), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+      if ((events & RDP_DATA) && n > 0)
+        rdpWrite(conn, buf, n);
+    }
+  }
+
+  double ns = (double)(nanotime() - start) / echoRounds;
+  rdpSocketDestroy(s[1]);
+  return ns;
+}
+
+// Coroutines of echoCoro(), those done are counted.
+int coroDone;
+
+rdp::coro::task coroEcho(rdp::coro::conn c) {
+  std::byte buf[2048];
+  ssize_t n;
+
+  while ((n = co_await c.read(buf)) > 0)
+    if (co_await c.write(std::span(buf, n)) == -1)
+      break;
+  coroDone++;
+}
+
+rdp::coro::task coroServe(rdp::coro::socket &s) {
+  while (rdp::coro::conn c = co_await s.accept())
+    coroEcho(std::move(c));
+  coroDone++;
+}
+
+rdp::coro::task coroClient(rdp::coro::conn &c, int &rounds, int64_t &start) {
+  std::byte msg[echoSize] = {}, buf[2048];
+
+  if (co_await c.connect("127.0.0.1", "9789")) {
+    start = nanotime();
+    for (; rounds < echoRounds; rounds++) {
+      if (co_await c.write(msg) == -1)
+        break;
+      size_t got = 0;
+      while (got < sizeof(msg)) {
+        ssize_t n = co_await c.read(buf);
+        if (n <= 0)
+          break;
+        got += n;
+      }
+      if (got < sizeof(msg))
+        break;
+    }
+  }
+  coroDone++;
+}
+
+// echoC() with both ends coroutines of rdp_coro.hpp. The server socket is
+// destroyed with its coroutines still awaiting, they have to finish by then.
+double echoCoro() {
+  int rounds = 0;
+  int64_t start = 0;
+  double ns;
+
+  coroDone = 0;
+  {
+    rdp::coro::socket client("127.0.0.1", "9788");
+    rdp::coro::socket server("127.0.0.1", "9789");
+    rdpSocket *s[2] = {client.native_handle(), server.native_handle()};
+    rdp::coro::conn c(client);
+
+    coroServe(server);
+    coroClient(c, rounds, start);
+    while (rounds < echoRounds) {
+      waitSockets(s, 2);
+      client.poll_once(0);
+      server.poll_once(0);
+    }
+    ns = (double)(nanotime() - start) / echoRounds;
+  }
+
+  if (coroDone != 3) {
+    printf("echo: %d of 3 coroutines left awaiting a destroyed socket\n",
+           3 - coroDone);
+    exit(1);
+  }
+  return ns;
+}
+
+// rdp.hpp should cost nothing over rdp.h, the best of a few alternating runs
+// of each is printed. rdp_coro.hpp runs both ends.
+void benchEcho() {
+  double c = 1e18, hpp = 1e18, coro = 1e18;
+
+  for (int i = 0; i < 3; i++) {
+    c = std::min(c, echoC());
+    hpp = std::min(hpp, echoHpp());
+    coro = std::min(coro, echoCoro());
+  }
+  printf("echo %zu bytes, rdp.h:        %8.0f ns/round trip\n", echoSize, c);
+  printf("echo %zu bytes, rdp.hpp:      %8.0f ns/round trip\n", echoSize, hpp);
+  printf("echo %zu bytes, rdp_coro.hpp: %8.0f ns/round trip\n", echoSize,
+         coro);
+}
+
+constexpr size_t bulkSize = 256 << 20;
+
+int64_t cputime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Stream bulkSize bytes one way. The CPU time of both ends per KB, kernel
+// included, is what a build with other constants, see PROFILE in Makefile,
+// changes.
+void benchBulk() {
+  rdpSocket *s[2] = {rdpSocketCreate(1, "127.0.0.1", "9788"),
+                     rdpSocketCreate(1, "127.0.0.1", "9789")};
+  rdpConn *c = rdpNetConnect(s[0], "127.0.0.1", "9789");
+  static char out[64 * 1024], in[64 * 1024];
+  size_t sent = 0, got = 0;
+  int64_t start = 0, cpuStart = 0;
+
+  while (got < bulkSize) {
+    waitSockets(s, 2);
+    for (;;) {
+      rdpConn *conn;
+      int events;
+      rdpReadPoll(s[0], in, sizeof(in), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+      if ((events & RDP_CONNECTED) && !start) {
+        start = nanotime();
+        cpuStart = cputime();
+      }
+    }
+    // A chunk at a time, both ends share the thread and more would overflow
+    // the receive buffer of the other.
+    ssize_t n;
+    if (start && sent < bulkSize &&
+        (n = rdpWrite(c, out, std::min(sizeof(out), bulkSize - sent))) > 0)
+      sent += n;
+    for (;;) {
+      rdpConn *conn;
+      int events;
+      ssize_t n = rdpReadPoll(s[1], in, sizeof(in), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+      if ((events & RDP_DATA) && n > 0)
+        got += n;
+    }
+  }
+
+  double seconds = (double)(nanotime() - start) / 1e9;
+  double cpu = (double)(cputime() - cpuStart) / (bulkSize / 1024);
+  printf("bulk %zu MB: %8.0f MB/s, %6.0f ns CPU/KB\n", bulkSize >> 20,
+         (bulkSize >> 20) / seconds, cpu);
+  rdpSocketDestroy(s[0]);
+  rdpSocketDestroy(s[1]);
+}
+
+// Each shard of a runtime connects scaleConns times to the runtime's own
+// address and streams to the accepting ends over loopback, for a second after
+// a warm up. Throughput should grow nearly linearly from 1 shard up to one per
+// CPU, 32 at most.
+constexpr int scaleConns = 4;
+constexpr int scaleShardsMax = 32;
+
+struct alignas(64) ScaleCount {
+  std::atomic<uint64_t> bytes;
+};
+ScaleCount scaleGot[scaleShardsMax];
+
+void scaleEvent(void *ctx, int shard, rdpConn *c, int events, void *buf,
+                ssize_t n) {
+  static char out[64 * 1024];
+
+  if (!c)
+    return;
+  // Keep what's in flight within the receive buffer of the other end.
+  if (events & RDP_CONNECTED) {
+    rdpConnSetProp(c, RDP_CONN_PROP_SNDHIWAT, 64 * 1024);
+    rdpConnSetProp(c, RDP_CONN_PROP_SNDLOWAT, 32 * 1024);
+  }
+  if (rdpConnGetUserData(c) && (events & (RDP_CONNECTED | RDP_POLLOUT)))
+    while (rdpWrite(c, out, sizeof(out)) > 0)
+      ;
+  if (!rdpConnGetUserData(c) && (events & RDP_DATA) && n > 0)
+    scaleGot[shard].bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+void scaleMessage(void *ctx, int shard, void *msg) {}
+
+uint64_t scaleTotal(int shards) {
+  uint64_t total = 0;
+  for (int i = 0; i < shards; i++)
+    total += scaleGot[i].bytes.load(std::memory_order_relaxed);
+  return total;
+}
+
+void benchScale() {
+  int cpus = std::min((int)sysconf(_SC_NPROCESSORS_ONLN), scaleShardsMax);
+  rdpRuntimeHandler h = {scaleEvent, scaleMessage, nullptr};
+  double single = 0;
+
+  for (int shards = 1; shards <= cpus; shards *= 2) {
+    rdpRuntime *rt = rdpRuntimeCreate(shards, "127.0.0.1", "9790", &h);
+    for (int i = 0; i < shards * scaleConns; i++)
+      rdpRuntimeConnect(rt, "127.0.0.1", "9790", rt);
+
+    usleep(500000);
+    uint64_t before = scaleTotal(shards);
+    int64_t start = nanotime();
+    usleep(1000000);
+    double mbs = (double)(scaleTotal(shards) - before) / (1 << 20) /
+                 ((double)(nanotime() - start) / 1e9);
+    rdpRuntimeDestroy(rt);
+
+    if (shards == 1)
+      single = mbs;
+    printf("scale %2d shards of %d CPUs: %8.0f MB/s, %5.2fx 1 shard\n", shards,
+           cpus, mbs, mbs / single);
+  }
+}
+
+// Datagrams sent by this network namespace, from /proc/net/snmp.
+uint64_t udpOutDatagrams() {
+  FILE *f = fopen("/proc/net/snmp", "r");
+  char names[512], values[512];
+  uint64_t n = 0;
+
+  while (f && fgets(names, sizeof(names), f) &&
+         fgets(values, sizeof(values), f)) {
+    if (strncmp(names, "Udp:", 4))
+      continue;
+    // OutDatagrams is the fourth counter.
+    sscanf(values, "Udp: %*u %*u %*u %lu", &n);
+    break;
+  }
+  if (f)
+    fclose(f);
+  return n;
+}
+
+constexpr size_t groupSize = 16 << 20;
+constexpr int groupMembersMax = 8;
+
+// Send groupSize bytes to 1 to groupMembersMax members of a multicast group
+// over loopback. Datagrams sent per MB, NAKs of members included, shouldn't
+// grow with the members.
+void benchGroup() {
+  static char out[64 * 1024], in[64 * 1024];
+
+  for (int members = 1; members <= groupMembersMax; members *= 2) {
+    rdpSocket *s[1 + groupMembersMax];
+    size_t got[1 + groupMembersMax] = {0};
+
+    s[0] = rdpSocketCreate(1, "0.0.0.0", "9791");
+    for (int i = 1; i <= members; i++)
+      s[i] = rdpGroupSocketCreate(1, "239.1.2.3", "9792");
+    rdpConn *g = rdpGroupOpen(s[0], "239.1.2.3", "9792");
+    if (!g) {
+      printf("group: rdpGroupOpen() failed, no route for 239.1.2.3?\n");
+      return;
+    }
+
+    uint64_t datagrams = udpOutDatagrams();
+    int64_t start = nanotime();
+    size_t sent = 0;
+    bool done = false;
+
+    while (!done) {
+      ssize_t n;
+      // A chunk at a time, like benchBulk().
+      if (sent < groupSize &&
+          (n = rdpWrite(g, out, std::min(sizeof(out), groupSize - sent))) > 0)
+        sent += n;
+
+      waitSockets(s, 1 + members);
+      done = true;
+      for (int i = 0; i <= members; i++) {
+        for (;;) {
+          rdpConn *conn;
+          int events;
+          n = rdpReadPoll(s[i], in, sizeof(in), &conn, &events);
+          if (events & RDP_AGAIN)
+            break;
+          if ((events & RDP_DATA) && n > 0)
+            got[i] += n;
+        }
+        done &= i == 0 || got[i] == groupSize;
+      }
+    }
+
+    double seconds = (double)(nanotime() - start) / 1e9;
+    printf("group %d members: %6.0f datagrams/MB, %6.0f MB/s each\n", members,
+           (double)(udpOutDatagrams() - datagrams) / (groupSize >> 20),
+           (groupSize >> 20) / seconds);
+    for (int i = 0; i <= members; i++)
+      rdpSocketDestroy(s[i]);
+  }
+}
+
+int64_t threadCputime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+constexpr size_t relaySize = 64 << 20;
+
+enum RelayMode { RelaySplice, RelayCopy, RelayForward };
+
+// Forward datagrams between the one end sending to fd and the server.
+void forwardPackets(int fd, const struct sockaddr_in &server,
+                    struct sockaddr_in &client) {
+  char packet[65536];
+  struct sockaddr_in from;
+  socklen_t fromLen = sizeof(from);
+  ssize_t n;
+
+  while ((n = recvfrom(fd, packet, sizeof(packet), MSG_DONTWAIT,
+                       (struct sockaddr *)&from, &fromLen)) >= 0) {
+    bool fromServer = from.sin_port == server.sin_port;
+    if (!fromServer)
+      client = from;
+    sendto(fd, packet, n, 0,
+           (const struct sockaddr *)(fromServer ? &client : &server),
+           sizeof(server));
+    fromLen = sizeof(from);
+  }
+}
+
+// Stream relaySize bytes from a client through a relay to a server, returning
+// the CPU time of the relay per KB, kernel included.
+double relay(RelayMode mode) {
+  static char out[64 * 1024], in[64 * 1024];
+  rdpSocket *s[3] = {rdpSocketCreate(1, "127.0.0.1", "9793"),
+                     rdpSocketCreate(1, "127.0.0.1", "9795"),
+                     mode == RelayForward
+                         ? nullptr
+                         : rdpSocketCreate(1, "127.0.0.1", "9794")};
+  struct sockaddr_in server = {}, client = {};
+  int fd = -1;
+
+  if (mode == RelayForward) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = server.sin_family = AF_INET;
+    addr.sin_addr.s_addr = server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(9794);
+    server.sin_port = htons(9795);
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  }
+
+  rdpConn *c = rdpNetConnect(s[0], "127.0.0.1", "9794"), *back = nullptr;
+  size_t sent = 0, got = 0, early = 0;
+  bool ready = mode == RelayForward;
+  int64_t cpu = 0;
+
+  while (got < relaySize) {
+    ssize_t n;
+    if (ready && sent < relaySize &&
+        (n = rdpWrite(c, out, std::min(sizeof(out), relaySize - sent))) > 0)
+      sent += n;
+
+    waitSockets(s, mode == RelayForward ? 2 : 3, fd);
+    for (int i = 0; i < 3; i++) {
+      int64_t start = threadCputime();
+
+      if (i == 2 && mode == RelayForward)
+        forwardPackets(fd, server, client);
+      for (;;) {
+        if (i == 2 && mode == RelayForward)
+          break;
+
+        rdpConn *conn;
+        int events;
+        n = rdpReadPoll(s[i], in, sizeof(in), &conn, &events);
+        if (events & RDP_AGAIN)
+          break;
+        // RDP_ACCEPT comes with the first data, the rest waits for the relay
+        // to connect on.
+        if (i == 0 && (events & RDP_CONNECTED))
+          sent += rdpWrite(c, out, 1024);
+        if (i == 1 && (events & RDP_DATA) && n > 0)
+          got += n;
+        if (i != 2)
+          continue;
+
+        // The relay connects on to the server for each client it accepts, and
+        // holds what comes meanwhile.
+        if (events & RDP_ACCEPT)
+          rdpConnSetUserData(rdpNetConnect(s[2], "127.0.0.1", "9795"), conn);
+        if ((events & RDP_DATA) && n > 0 && !back) {
+          early += n;
+          continue;
+        }
+        if (events & RDP_CONNECTED) {
+          back = conn;
+          ready = true;
+          rdpWrite(back, out, early);
+          if (mode == RelaySplice)
+            rdpConnSplice((rdpConn *)rdpConnGetUserData(back), back);
+        }
+        if (mode == RelayCopy && (events & RDP_DATA) && n > 0 &&
+            conn != back)
+          while (rdpWrite(back, in, n) == -1)
+            rdpSocketIntervalAction(s[2]);
+      }
+
+      if (i == 2)
+        cpu += threadCputime() - start;
+    }
+  }
+
+  for (rdpSocket *x : s)
+    if (x)
+      rdpSocketDestroy(x);
+  if (fd != -1)
+    close(fd);
+  return (double)cpu / (relaySize / 1024);
+}
+
+// A relay splicing connections should take about the CPU a plain UDP
+// forwarder does, a relay copying through the user more.
+void benchRelay() {
+  printf("relay %zu MB, splice:  %6.0f ns CPU/KB\n", relaySize >> 20,
+         relay(RelaySplice));
+  printf("relay %zu MB, copy:    %6.0f ns CPU/KB\n", relaySize >> 20,
+         relay(RelayCopy));
+  printf("relay %zu MB, forward: %6.0f ns CPU/KB\n", relaySize >> 20,
+         relay(RelayForward));
+}
+
+// The library's heap in use and its peak, counting only what the threads
+// with heapCounted set allocate.
+thread_local bool heapCounted;
+size_t heapInUse, heapPeak;
+
+struct HeapHeader {
+  size_t size;
+  bool counted;
+  alignas(std::max_align_t) char data[];
+};
+
+void *heapAllocate(void *ctx, size_t size) {
+  auto *h = (HeapHeader *)malloc(sizeof(HeapHeader) + size);
+  if (!h)
+    return nullptr;
+  h->size = size;
+  h->counted = heapCounted;
+  if (h->counted)
+    heapPeak = std::max(heapPeak, heapInUse += size);
+  return h->data;
+}
+
+void heapDeallocate(void *ctx, void *ptr) {
+  if (!ptr)
+    return;
+  auto *h = (HeapHeader *)((char *)ptr - offsetof(HeapHeader, data));
+  if (h->counted)
+    heapInUse -= h->size;
+  free(h);
+}
+
+void *heapReallocate(void *ctx, void *ptr, size_t size) {
+  void *p = heapAllocate(ctx, size);
+  if (p && ptr) {
+    auto *h = (HeapHeader *)((char *)ptr - offsetof(HeapHeader, data));
+    memcpy(p, ptr, std::min(h->size, size));
+    heapDeallocate(ctx, ptr);
+  }
+  return p;
+}
+
+// Read everything coming to s on a thread of its own, until got reaches want.
+std::atomic<bool> received;
+
+void receive(rdpSocket *s, size_t want) {
+  static char in[64 * 1024];
+  size_t got = 0;
+
+  while (got < want) {
+    waitSockets(&s, 1);
+    for (;;) {
+      rdpConn *conn;
+      int events;
+      ssize_t n = rdpReadPoll(s, in, sizeof(in), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+      if ((events & RDP_DATA) && n > 0)
+        got += n;
+    }
+  }
+  received = true;
+}
+
+constexpr size_t fileSize = 16 << 20;
+
+// Send fileSize bytes of fd with a flight window fixed at window, from a copy
+// in memory by rdpWrite() or from the file by rdpSendFile(), and return the
+// peak heap of the sending end.
+size_t sendPeak(int fd, const char *data, uint32_t window, bool file) {
+  rdpSocket *s = rdpSocketCreate(1, "127.0.0.1", "9796");
+  rdpSocket *r = rdpSocketCreate(1, "127.0.0.1", "9797");
+  int rcvbuf = 4 << 20;
+  rdpTunables t;
+
+  // Within net.core.rmem_max, less loss at large windows.
+  setsockopt(rdpSocketGetProp(r, RDP_PROP_FD), SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+             sizeof(rcvbuf));
+  received = false;
+  std::thread receiver(receive, r, fileSize);
+
+  heapCounted = true;
+  heapInUse = heapPeak = 0;
+  rdpConn *c = rdpNetConnect(s, "127.0.0.1", "9797");
+  rdpConnGetTunables(c, &t);
+  t.windowDefault = window;
+  t.windowShrinkFactor = t.windowExpandFactor = 1;
+  rdpConnSetTunables(c, &t);
+  // Writes take no more than the window, rather than all the send buffer.
+  rdpConnSetProp(c, RDP_CONN_PROP_SNDHIWAT, window);
+  rdpConnSetProp(c, RDP_CONN_PROP_SNDLOWAT, window / 2);
+
+  size_t sent = 0;
+  while (!received) {
+    waitSockets(&s, 1);
+    for (;;) {
+      char in[2048];
+      rdpConn *conn;
+      int events;
+      rdpReadPoll(s, in, sizeof(in), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+    }
+    ssize_t n;
+    while (sent < fileSize &&
+           (n = file ? rdpSendFile(c, fd, sent, fileSize - sent)
+                     : rdpWrite(c, data + sent, fileSize - sent)) > 0)
+      sent += n;
+  }
+
+  receiver.join();
+  size_t peak = heapPeak;
+  rdpSocketDestroy(s);
+  rdpSocketDestroy(r);
+  heapCounted = false;
+  return peak;
+}
+
+// Sending from a file, the heap of the sending end shouldn't grow with the
+// flight window, sending from memory it holds the window.
+void benchSendFile() {
+  char path[] = "/tmp/rdpbenchXXXXXX";
+  int fd = mkstemp(path);
+  char *data = (char *)malloc(fileSize);
+  rdpAllocator a = {heapAllocate, heapReallocate, heapDeallocate, nullptr};
+
+  memset(data, 'x', fileSize);
+  if (fd == -1 || write(fd, data, fileSize) != (ssize_t)fileSize) {
+    printf("sendfile: can't write %s\n", path);
+    return;
+  }
+  unlink(path);
+  rdpSetAllocator(&a);
+
+  for (uint32_t window = 256 << 10; window <= 4 << 20; window *= 4)
+    printf("sendfile window %5u KB: rdpWrite %6zu KB heap, "
+           "rdpSendFile %6zu KB heap\n",
+           window >> 10, sendPeak(fd, data, window, false) >> 10,
+           sendPeak(fd, data, window, true) >> 10);
+
+  rdpSetAllocator(nullptr);
+  free(data);
+  close(fd);
+}
+
+// Serve fd to the first connection asking on s, until the receiver is done.
+void serveFile(rdpSocket *s, int fd, size_t len) {
+  rdpConn *c = nullptr;
+  size_t sent = 0;
+
+  while (!received) {
+    waitSockets(&s, 1);
+    for (;;) {
+      char in[2048];
+      rdpConn *conn;
+      int events;
+      rdpReadPoll(s, in, sizeof(in), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+      if (events & RDP_ACCEPT)
+        c = conn;
+    }
+
+    ssize_t n;
+    while (c && sent < len && (n = rdpSendFile(c, fd, sent, len - sent)) > 0)
+      sent += n;
+  }
+}
+
+constexpr size_t sinkSize = 64 << 20;
+
+// Download sinkSize bytes of fd into a sink on file, or through rdpReadPoll()
+// if file is -1, and return the peak heap of the receiving end. The socket
+// buffer is left as it is, so the 4 MB window overflows it and packets come
+// out of order. Retransmit timeouts of the datacenter profile keep it quick.
+size_t receivePeak(int fd, int file) {
+  rdpSocket *s = rdpSocketCreate(1, "127.0.0.1", "9798");
+  rdpSocket *r = rdpSocketCreate(1, "127.0.0.1", "9799");
+  static char in[64 * 1024];
+  rdpTunables t;
+
+  rdpTunablesProfile(&t, RDP_PROFILE_DATACENTER);
+  t.windowDefault = 4 << 20;
+  t.windowShrinkFactor = t.windowExpandFactor = 1;
+  rdpSocketSetTunables(s, &t);
+  received = false;
+  std::thread sender(serveFile, s, fd, sinkSize);
+
+  heapCounted = true;
+  heapInUse = heapPeak = 0;
+  rdpConn *c = rdpNetConnect(r, "127.0.0.1", "9798");
+  if (file != -1)
+    rdpConnSetSink(c, file, 0, sinkSize);
+
+  size_t got = 0;
+  while (got < sinkSize) {
+    waitSockets(&r, 1);
+    for (;;) {
+      rdpConn *conn;
+      int events;
+      ssize_t n = rdpReadPoll(r, in, sizeof(in), &conn, &events);
+      if (events & RDP_AGAIN)
+        break;
+      // The sender starts on the first data.
+      if (events & RDP_CONNECTED)
+        rdpWrite(c, "get", 3);
+      if ((events & RDP_DATA) && n > 0)
+        got += n;
+      if (events & RDP_SINK)
+        got = rdpConnGetSinkProgress(c);
+    }
+  }
+
+  received = true;
+  sender.join();
+  size_t peak = heapPeak;
+  rdpSocketDestroy(s);
+  rdpSocketDestroy(r);
+  heapCounted = false;
+  return peak;
+}
+
+// Receiving into a sink, the heap of the receiving end should stay the fixed
+// size of the sink whatever is held out of order. Through rdpReadPoll() out of
+// order packets are buffered on the heap.
+void benchSink() {
+  char path[] = "/tmp/rdpbenchXXXXXX", sinkPath[] = "/tmp/rdpbenchXXXXXX";
+  int fd = mkstemp(path), file = mkstemp(sinkPath);
+  rdpAllocator a = {heapAllocate, heapReallocate, heapDeallocate, nullptr};
+
+  if (fd == -1 || file == -1 || ftruncate(fd, sinkSize) == -1 ||
+      ftruncate(file, sinkSize) == -1) {
+    printf("sink: can't create files in /tmp\n");
+    return;
+  }
+  unlink(path);
+  unlink(sinkPath);
+  rdpSetAllocator(&a);
+
+  printf("sink %zu MB, rdpReadPoll: %6zu KB heap\n", sinkSize >> 20,
+         receivePeak(fd, -1) >> 10);
+  printf("sink %zu MB, sink:        %6zu KB heap\n", sinkSize >> 20,
+         receivePeak(fd, file) >> 10);
+
+  rdpSetAllocator(nullptr);
+  close(fd);
+  close(file);
+}
+
+struct Benchmark {
+  const char *name;
+  void (*run)();
+};
+
+const Benchmark benchmarks[] = {
+    {"echo", benchEcho},
+    {"bulk", benchBulk},
+    {"scale", benchScale},
+    {"group", benchGroup},
+    {"relay", benchRelay},
+    {"sendfile", benchSendFile},
+    {"sink", benchSink},
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  for (const Benchmark &b : benchmarks) {
+    bool selected = argc == 1;
+    for (int i = 1; i < argc; i++)
+      selected |= strcmp(argv[i], b.name) == 0;
+    if (selected)
+      b.run();
+  }
+  return 0;
+}
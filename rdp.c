@@ -1,17 +1,24 @@
-#ifndef _DEFAULT_SOURCE
-#define _DEFAULT_SOURCE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
 #endif
 
 #include <assert.h>
 #include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -30,13 +37,23 @@
 
 #endif
 
+// The constants below in #ifndef can be overridden at build time, e.g.
+// -DRDP_UDP_MTU=8972, see PROFILE in Makefile. They're plain build constants,
+// nothing is specialized on them beyond what the compiler folds. Those of the
+// path are only the defaults of RDP_PROFILE_DEFAULT, see
+// rdpSocketSetTunables().
+
 // Queue size is the capacity of the ring buffer, in elements.
 // Set it to 16 * 1024 cause of the number of selective ack bits is limited to
 // the max UDP payload 1390(bytes) * 8(bits) = 11120(bits).
+#ifndef RDP_QUEUE_SIZE_MAX
 #define RDP_QUEUE_SIZE_MAX (16 * 1024)
+#endif
 
 // Shouldn't exceed the ring queue capacity.
+#ifndef RDP_BUFFER_SIZE_MAX
 #define RDP_BUFFER_SIZE_MAX (16 * 1024 * 1024)
+#endif
 
 // Default buffer size, in bytes.
 #define RDP_SEND_BUFFER_SIZE_MAX RDP_BUFFER_SIZE_MAX
@@ -44,27 +61,99 @@
 
 // Window size.
 #define RDP_WINDOW_SIZE_MAX RDP_BUFFER_SIZE_MAX
+#ifndef RDP_WINDOW_SIZE_DEFAULT
 #define RDP_WINDOW_SIZE_DEFAULT (RDP_BUFFER_SIZE_MAX / 4)
+#endif
 
 // Minium Interval between resize flight window. In milliseconds.
 // Don't need the maxinum part because resize is triggered by packets arrival.
 // It's no need to resize if no packets.
+#ifndef RDP_RESIZE_WINDOW_INTERVAL_MIN
 #define RDP_RESIZE_WINDOW_INTERVAL_MIN 1000
+#endif
 
 // See resizeWindow() implemention.
+#ifndef RDP_WINDOW_SHRINK_FACTOR
 #define RDP_WINDOW_SHRINK_FACTOR 2
+#endif
+#ifndef RDP_WINDOW_EXPAND_FACTOR
 #define RDP_WINDOW_EXPAND_FACTOR 2
+#endif
 
 // Max rdpConns per rdpSocket.
+#ifndef RDP_MAX_CONNS_PER_RDPSOCKET
 #define RDP_MAX_CONNS_PER_RDPSOCKET 1024
+#endif
 
 // In milliseconds.
+#ifndef RDP_RETRANSMIT_TIMEOUT_MIN
 #define RDP_RETRANSMIT_TIMEOUT_MIN 200
+#endif
+#ifndef RDP_RETRANSMIT_TIMEOUT_MAX
 #define RDP_RETRANSMIT_TIMEOUT_MAX 1000
+#endif
+#ifndef RDP_RETRANSMIT_TIMEOUT_DEFAULT
 #define RDP_RETRANSMIT_TIMEOUT_DEFAULT 500
+#endif
+// Lowest retransmit timeout scaled to the RTT, see retransmitTimeoutMinRtts of
+// rdpTunables. In microseconds.
+#ifndef RDP_RETRANSMIT_TIMEOUT_FLOOR
+#define RDP_RETRANSMIT_TIMEOUT_FLOOR 100
+#endif
+
+// Max time corked data waits for more to fill a packet, see rdpConnCork().
+#ifndef RDP_CORK_DELAY_DEFAULT
+#define RDP_CORK_DELAY_DEFAULT 200
+#endif
+
+// Resumption tickets are issued this often, in milliseconds.
+#define RDP_TICKET_INTERVAL 30000
+// Path parameters in a ticket older than this are stale, in seconds.
+#define RDP_TICKET_LIFETIME 3600
 
 // Keep alive probes interval.
+#ifndef RDP_KEEPALIVE_INTERVAL
 #define RDP_KEEPALIVE_INTERVAL 29000
+#endif
+
+// Writes rdpSocketSubmit() and data rdpSocketComplete() can hold, power of
+// two.
+#ifndef RDP_SUBMIT_RING_SIZE
+#define RDP_SUBMIT_RING_SIZE 1024
+#endif
+#ifndef RDP_COMPLETION_RING_SIZE
+#define RDP_COMPLETION_RING_SIZE 1024
+#endif
+// Events of a connection waiting for its worker, see rdpConnReadyFd(). Power of
+// two.
+#ifndef RDP_READY_RING_SIZE
+#define RDP_READY_RING_SIZE 256
+#endif
+
+// Messages waiting for a shard of rdpRuntime, and the buffer its rdpReadPoll()
+// is given, in bytes.
+#ifndef RDP_RUNTIME_MAILBOX_SIZE
+#define RDP_RUNTIME_MAILBOX_SIZE 1024
+#endif
+#ifndef RDP_RUNTIME_BUFFER_SIZE
+#define RDP_RUNTIME_BUFFER_SIZE (64 * 1024)
+#endif
+
+// Group senders keep data for repairs this long and announce their sequence
+// this often. Members missing data wait a random delay up to the backoff
+// before asking for it, and ask again every interval. In milliseconds.
+#ifndef RDP_GROUP_RETAIN
+#define RDP_GROUP_RETAIN 1000
+#endif
+#ifndef RDP_GROUP_HEARTBEAT
+#define RDP_GROUP_HEARTBEAT 100
+#endif
+#ifndef RDP_GROUP_NAK_BACKOFF
+#define RDP_GROUP_NAK_BACKOFF 10
+#endif
+#ifndef RDP_GROUP_NAK_INTERVAL
+#define RDP_GROUP_NAK_INTERVAL 100
+#endif
 
 // rdpConn can wait up to seconds in these states.
 #define RDP_WAIT_SYN_RECV 10000
@@ -75,6 +164,30 @@
 
 #define RDP_ACK_NR_RECV_BEHIND_ALLOWED 10
 
+// Largest message rdpSendMsg() accepts and the other end reassembles, in
+// bytes.
+#ifndef RDP_MESSAGE_SIZE_MAX
+#define RDP_MESSAGE_SIZE_MAX (4 * 1024 * 1024)
+#endif
+
+// Max streams per rdpConn, see rdpStreamWrite(). Streams live as long as their
+// connection.
+#ifndef RDP_MAX_STREAMS_PER_CONN
+#define RDP_MAX_STREAMS_PER_CONN 1024
+#endif
+
+// Calls made by rdpCall() are spread over this many streams from
+// RDP_STREAM_ID_RESERVED on, a lost packet only holds back calls sharing its
+// stream.
+#ifndef RDP_RPC_LANES
+#define RDP_RPC_LANES 64
+#endif
+
+// rdpConnSetSink() reports its progress every this many bytes.
+#ifndef RDP_SINK_WATERMARK
+#define RDP_SINK_WATERMARK (1024 * 1024)
+#endif
+
 #define SIXTEEN_MASK 0xFFFF
 #define RDP_SEQ_NR_MASK SIXTEEN_MASK
 #define RDP_ACK_NR_MASK SIXTEEN_MASK
@@ -95,6 +208,12 @@
   (ETHERNET_MTU - IPV6_HEADER_SIZE - UDP_HEADER_SIZE - GRE_HEADER_SIZE -       \
    PPPOE_HEADER_SIZE - MPPE_HEADER_SIZE - FUDGE_HEADER_SIZE)
 
+// Largest UDP payload sent, the rdp header included. Every end of a connection
+// should agree on it.
+#ifndef RDP_UDP_MTU
+#define RDP_UDP_MTU UDP_IPV4_MTU
+#endif
+
 // Log levels.
 #define LL_DEBUG 0
 #define LL_VERBOSE 1
@@ -115,6 +234,7 @@ enum connState {
   CS_SYN_RECV, // User shouldn't get a connection handle in this state.
   CS_CONNECTED,
   CS_CONNECTED_FULL,
+  CS_HALF_CLOSED, // Sent ST_FIN by rdpConnShutdown(), still receiving.
   CS_FIN_SENT, // Only the invocation of rdpConnClose() can trigger this.
   CS_RESET, // Connection get a ST_RESET packet, change it's state to CS_RESET
             // not CS_DESTROY for getting user a chance to be notified and do
@@ -125,8 +245,9 @@ enum connState {
 
 #ifdef RDP_DEBUG
 static const char *connStateNames[] = {
-    "CS_UNINTIALIZED",   "CS_SYN_SENT", "CS_SYN_RECV", "CS_CONNECTED",
-    "CS_CONNECTED_FULL", "CS_FIN_SENT", "CS_RESET",    "CS_DESTROY"};
+    "CS_UNINTIALIZED",   "CS_SYN_SENT",    "CS_SYN_RECV",
+    "CS_CONNECTED",      "CS_CONNECTED_FULL", "CS_HALF_CLOSED",
+    "CS_FIN_SENT",       "CS_RESET",       "CS_DESTROY"};
 #endif
 
 // Packet types. See: http://bittorrent.org/beps/bep_0029.html
@@ -135,6 +256,12 @@ static const char *connStateNames[] = {
 #define ST_STATE 2
 #define ST_RESET 3
 #define ST_SYN 4
+#define ST_DATAGRAM 5 // Unreliable, never queued in outbuf nor acked.
+// Group packets, see rdpGroupOpen(). ST_DATA and ST_STATE of a group sender go
+// out as ST_GROUP and ST_GROUP_STATE, members never ack but send ST_NAK.
+#define ST_GROUP 6
+#define ST_GROUP_STATE 7
+#define ST_NAK 8 // EXT_SACK of packets received after acknr, up to seqnr.
 
 /*
   Data type print abbreviations:
@@ -143,30 +270,58 @@ static const char *connStateNames[] = {
     S: ST_SYN.
     A: ST_STATE, Ack.
     E: ST_STATE, Eack.
+    W: ST_STATE, forward ack.
+    K: ST_STATE, resumption ticket.
     D: ST_DATA.
     F: FIN.
     R: ST_RESET.
+    G: ST_DATAGRAM.
+    M: ST_GROUP, resent for a NAK.
+    N: ST_NAK.
     !: Connection is full, can't retransmit now.
 
   Receive:
     s: ST_SYN.
     t: ST_STATE.
+    ~: Holes the other end gave up, skipped.
     #: Out of date packets, aka packets with acknr are't bigger than our
   connection's acknr.
     .: The right next ST_DATA, aka packets with acknr are equal to our
   connection's acknr plus 1.
+    >: The right next ST_DATA, relayed to the splice.
     -: First arrived out of order ST_DATA.
     +: Duplicated out of order ST_DATA.
     f: FIN.
     r: ST_RESET.
+    g: ST_DATAGRAM.
+    m: ST_GROUP.
+    h: ST_GROUP_STATE.
+    n: ST_NAK.
 */
 
+// Extension types, chained through packet.reserve. Every extension starts with
+// two bytes: the type of the next extension and the length of its own data.
+#define EXT_NONE 0
+#define EXT_SACK 1
+#define EXT_MESSAGE 2
+#define EXT_FORWARD_ACK 3 // Sender gave up packets up to the carried seqnr.
+#define EXT_STREAM 4      // Packet belongs to a stream, see struct streamExt.
+#define EXT_TICKET 5      // Resumption ticket, see struct ticket.
+
+// Flags carried by EXT_MESSAGE.
+#define MSG_FRAGMENT (1 << 0) // Always set, packet is part of a message.
+#define MSG_FIRST (1 << 1)
+#define MSG_LAST (1 << 2)
+
 #ifdef RDP_DEBUG
 
-static const char *packetStateNames[] = {"ST_DATA", "ST_FIN", "ST_STATE",
-                                         "ST_RESET", "ST_SYN"};
-static const char *packetStateAbbrNames[] = {"D", "F", "T", "R", "S"};
-static const char *packetStateAbbrNamesLower[] = {"", "f", "t", "r", "s"};
+static const char *packetStateNames[] = {
+    "ST_DATA",     "ST_FIN",   "ST_STATE",       "ST_RESET", "ST_SYN",
+    "ST_DATAGRAM", "ST_GROUP", "ST_GROUP_STATE", "ST_NAK"};
+static const char *packetStateAbbrNames[] = {"D", "F", "T", "R", "S",
+                                             "G", "M", "H", "N"};
+static const char *packetStateAbbrNamesLower[] = {"",  "f", "t", "r", "s",
+                                                  "g", "m", "h", "n"};
 
 #endif
 
@@ -187,26 +342,219 @@ struct __attribute__((packed)) packetWithSAck {
   uint8_t mask[1];
 };
 
+struct __attribute__((packed)) streamExt {
+  uint16_t id; // Never zero.
+  uint16_t seqnr; // Sequence number within the stream.
+};
+
+// Path parameters measured by the accepting end, handed to the initial end in
+// ST_STATE packets and presented back in the syn of a later connection. Only
+// the accepting end can verify mac, keyed by rdpSocket->ticketKey.
+struct __attribute__((packed)) ticket {
+  uint32_t id;
+  uint32_t issueTime; // UNIX time in seconds.
+  uint32_t rtt;       // In milliseconds.
+  uint32_t rttVar;
+  uint32_t minRtt;
+  uint32_t window; // flightWindowLimit, over rtt it estimates the bandwidth.
+  uint64_t mac;    // Covers the fields above.
+};
+
+_Static_assert(sizeof(struct ticket) == RDP_TICKET_SIZE, "ticket size");
+
+#define CALL_REQUEST 0
+#define CALL_REPLY 1
+
+// Leads every message sent by rdpCall() and rdpReply().
+struct __attribute__((packed)) callHeader {
+  uint32_t id;
+  uint8_t kind; // CALL_REQUEST or CALL_REPLY.
+};
+
+_Static_assert(RDP_STREAM_ID_RESERVED + RDP_RPC_LANES - 1 <= UINT16_MAX,
+               "rdpCall() streams out of range");
+
+// Overridden tunables are checked here.
+_Static_assert(RDP_QUEUE_SIZE_MAX <= (RDP_SEQ_NR_MASK + 1) / 2,
+               "sequence numbers in flight should tell old from new");
+// 576 bytes every IPv4 host reassembles, less the IPv4 and UDP headers.
+_Static_assert(RDP_UDP_MTU >= 548 && RDP_UDP_MTU <= 65507,
+               "RDP_UDP_MTU out of range");
+_Static_assert(RDP_RETRANSMIT_TIMEOUT_MIN <= RDP_RETRANSMIT_TIMEOUT_DEFAULT &&
+                   RDP_RETRANSMIT_TIMEOUT_DEFAULT <= RDP_RETRANSMIT_TIMEOUT_MAX,
+               "retransmit timeouts out of order");
+_Static_assert(RDP_WINDOW_SIZE_DEFAULT <= RDP_WINDOW_SIZE_MAX,
+               "default window over the max");
+_Static_assert(RDP_WINDOW_SHRINK_FACTOR > 0 && RDP_WINDOW_EXPAND_FACTOR > 0,
+               "window factors should be positive");
+_Static_assert(RDP_GROUP_NAK_BACKOFF < RDP_GROUP_NAK_INTERVAL &&
+                   RDP_GROUP_HEARTBEAT < RDP_GROUP_RETAIN,
+               "group timers out of order");
+_Static_assert((RDP_SUBMIT_RING_SIZE & (RDP_SUBMIT_RING_SIZE - 1)) == 0 &&
+                   (RDP_COMPLETION_RING_SIZE &
+                    (RDP_COMPLETION_RING_SIZE - 1)) == 0 &&
+                   (RDP_READY_RING_SIZE & (RDP_READY_RING_SIZE - 1)) == 0 &&
+                   (RDP_RUNTIME_MAILBOX_SIZE &
+                    (RDP_RUNTIME_MAILBOX_SIZE - 1)) == 0,
+               "ring sizes should be powers of two");
+
+// One extension to be written into an outgoing packet.
+struct packetExt {
+  uint8_t type;
+  uint8_t len;
+  const void *data;
+};
+
+// Extensions found in a received packet.
+struct packetExts {
+  const uint8_t *sackMask;
+  uint8_t sackLen;
+  uint8_t msgFlags; // Zero if the packet isn't part of a message.
+  uint8_t hasForwardAck : 1;
+  uint16_t forwardAcknr;
+  uint16_t streamId; // Zero if the packet doesn't belong to a stream.
+  uint16_t streamSeqnr;
+  const uint8_t *ticket; // Unaligned struct ticket, NULL if none.
+};
+
+// File range mapped by rdpSendFile(), unmapped along with the last packet
+// referencing it.
+struct fileMap {
+  void *addr;
+  size_t len;
+  size_t refs;
+};
+
 struct packetWrap {
   size_t payload;    // Payload size does't include packet header size.
   uint64_t sentTime; // In microseconds.
-  uint32_t transmissions : 31;
+  uint64_t deadline; // In milliseconds. Zero means retransmit until acked.
+  uint32_t transmissions : 30;
   uint32_t needResend : 1;
+  uint32_t abandoned : 1; // Passed deadline, never sent again.
+  // Set if the payload is read from a file mapping at ref, data is then the
+  // header only.
+  struct fileMap *map;
+  const unsigned char *ref;
   unsigned char data[1]; // Packet bytes.
 };
 
+struct handoffCell {
+  _Atomic size_t seq; // Position pushed to it plus one once it's filled.
+  void *p;
+};
+
+// Bounded lock free ring passing pointers from producer threads to one
+// consumer thread. A cell's seq tells whose turn it is, so neither side takes a
+// lock. The consumer is woken by efd.
+struct handoff {
+  _Atomic size_t tail; // Next position producers claim.
+  char pad[64 - sizeof(size_t)]; // Keeps producers off the consumer's line.
+  size_t head;                   // Next position the consumer takes.
+  size_t mask;
+  struct handoffCell *cells;
+  _Atomic int notified; // efd written since the consumer last read it.
+  int efd;
+};
+
+// Write handed over by rdpSocketSubmit(), queued in rdpConn->submitHead once
+// the owning thread took it. Zero len closes the connection. c might be
+// destroyed by then, so it's looked up by its key and serial first.
+struct submission {
+  struct submission *next;
+  rdpConn *c;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint16_t recvId;
+  uint32_t serial;
+  size_t len;
+  size_t off; // Bytes rdpWrite() took so far.
+  uint8_t reply; // Sent by rdpReply() to callId instead.
+  uint32_t callId;
+  unsigned char data[1];
+};
+
+// Data handed over by rdpSocketComplete(), or by rdpReadPoll() to the worker
+// of a connection, see rdpConnReadyFd().
+struct completion {
+  struct completion *next; // Waiting in rdpConn->readyHead.
+  rdpConn *c;
+  int events;
+  rdpEventInfo info; // Of rdpConn at the time, see rdpConnReap().
+  size_t len;
+  unsigned char data[1];
+};
+
 struct rdpSocket {
   void *userData;          // User data variable.
   dict *conns;             // Record rdpConns.
   dictIterator *connsIter; // Iterator of the conns dict.
   uint64_t mstime;         // Updated before used, in milliseconds.
+  uint64_t ustime;         // Updated along with mstime, in microseconds.
   uint64_t lastCheck;      // Updated after every invoke on rdpConnCheck(), in
-                           // milliseconds.
+                           // microseconds.
   uint32_t sendBufferSize; // In bytes.
   uint32_t recvBufferSize; // In bytes.
-  int nextCheckTimeout;
+  rdpTunables tunables;    // Of conns created from now on.
+  uint64_t nextCheckTimeout; // In microseconds.
   int fd;
   int8_t verbosity; // Log level.
+  uint8_t ticketKey[16]; // Signs resumption tickets.
+  struct handoff submits;     // From rdpSocketSubmit().
+  struct handoff completions; // From rdpSocketComplete().
+  rdpConn *submitConns; // Having submissions to write, linked by submitNext.
+  uint32_t nextSerial;  // Of the next conn created.
+  rdpConn *readyConns;  // Having events to hand over, linked by readyNext.
+  // Group joined by rdpGroupSocketCreate(), NAKs are sent to it too. Zero
+  // groupLen if none.
+  struct sockaddr_storage group;
+  socklen_t groupLen;
+  uint32_t splices; // Spliced conns, see rdpConnSplice().
+  // Receives packets while there are splices, so one relayed is moved to the
+  // other conn's outbuf as it is. NULL until needed.
+  struct packetWrap *spare;
+};
+
+// Out of order packet held in rdpConn->inbuf.
+struct inPacket {
+  uint32_t payload;
+  uint16_t streamId; // Zero for data not written to a stream.
+  uint16_t streamSeqnr;
+  uint8_t msgFlags; // See MSG_FIRST. Zero for data written by rdpWrite().
+  uint8_t delivered : 1; // Already handed to the user, only keeps the slot.
+  unsigned char data[1];
+};
+
+// File range plain data is received into, see rdpConnSetSink(). A packet held
+// out of order is written where it goes if every packet before it is full,
+// held ones are moved down once a shorter packet shows up.
+struct rdpSink {
+  unsigned char *map; // Page aligned start of the mapping.
+  size_t mapLen;
+  unsigned char *base; // The range in the mapping.
+  size_t len;
+  size_t pos;      // Bytes written contiguously.
+  size_t reported; // pos last reported by RDP_SINK.
+  uint32_t held;   // Slots in use.
+  uint16_t top;    // Highest seqnr held, if any.
+  // Stand for held packets in rdpConn->inbuf, indexed by seqnr. Their data is
+  // in the range already.
+  struct inPacket slots[RDP_QUEUE_SIZE_MAX];
+};
+
+// Call made by rdpCall() waiting for its reply.
+struct pendingCall {
+  uint32_t id;
+  void *cookie;
+  uint64_t deadline; // In milliseconds, zero if it never times out.
+};
+
+// Reassembly state of a message sent by rdpSendMsg().
+struct msgAssembly {
+  unsigned char *buf;
+  size_t len; // Bytes assembled so far.
+  size_t cap;
+  uint8_t active : 1; // Got MSG_FIRST, waiting for MSG_LAST.
 };
 
 // Ring buffer.
@@ -217,22 +565,51 @@ struct rbuffer {
   void **elements;
 };
 
+// Stream multiplexed in a rdpConn. Packets of different streams share the
+// connection's sequence, acks and windows, but each stream is delivered in its
+// own order, so a lost packet only holds back its own stream.
+struct rdpStream {
+  uint16_t id;
+  uint16_t sendSeqnr; // Next seqnr to send.
+  uint16_t recvSeqnr; // Next seqnr to deliver to the user.
+  // Out of order packets indexed by stream seqnr. They are owned by
+  // rdpConn->inbuf.
+  struct rbuffer held;
+  struct msgAssembly msg;
+};
+
 struct rdpConn {
   struct rbuffer inbuf;
   struct rbuffer outbuf;
+  struct msgAssembly msg;
+  dict *streams;            // Created on first use.
+  dictIterator *streamsIter;
+  uint16_t lastStreamId; // Stream of the data last reported by RDP_STREAM.
+  dict *calls; // Pending calls made by rdpCall(), created on first use.
+  dictIterator *callsIter;
+  uint32_t nextCallId;
+  uint32_t lastCallId; // Call last reported by RDP_CALL.
+  void *lastCookie;    // Call last reported by RDP_REPLY or RDP_CALL_TIMEOUT.
+  uint64_t callDeadline; // Earliest deadline of pending calls, zero if none.
   rdpSocket *rdpSocket;
   void *userData; // User data variable.
+  rdpTunables tunables;
   uint64_t lastReceivePacketTime;
   uint64_t lastSendPacketTime;
-  uint32_t rtt;
+  uint64_t finAckedTime; // CS_FIN_SENT acked, waiting for the other end's.
+  uint32_t rtt; // In microseconds, as are the retransmit timeouts.
   uint32_t rttVar;
+  uint32_t minRtt;
   int32_t
       nextRetransmitTimeout; // Calculated from RTT when ACK packets arrived.
   int32_t retransmitTimeout;
-  uint64_t retransmitTicker;
+  uint64_t retransmitTicker; // In microseconds.
   enum connState state;
-  uint32_t flightWindow; // In bytes. Within a retransmitTimeout packets sent
-                         // but not ACKed.
+  size_t queuedBytes;     // Payload in outbuf, sent or not.
+  uint32_t sendLowWater;  // See RDP_CONN_PROP_SNDLOWAT.
+  uint32_t sendHighWater; // See RDP_CONN_PROP_SNDHIWAT, zero if unset.
+  uint32_t flightWindow;  // In bytes. Within a retransmitTimeout packets
+                          // sent but not ACKed.
   uint32_t flightWindowLimit; // In bytes.
   uint32_t recvWindowPeer; // This is the window size we received from packets
                            // the other end sent.
@@ -240,6 +617,9 @@ struct rdpConn {
   uint32_t lastResizeWindowTime;
   uint32_t sentBytesSinceResizeWindow;
   uint32_t ackedBytesSinceResizeWindow;
+  // Of rdpSendDatagram() since datagramEpoch, up to flightWindowLimit per RTT.
+  uint32_t datagramBytes;
+  uint64_t datagramEpoch; // In microseconds.
 
   uint16_t idSeed;
   // On the connection initial end, sendId = recvId + 1, the other end, sendId =
@@ -251,9 +631,24 @@ struct rdpConn {
   uint16_t seqnr;
   uint16_t acknr; // Record the packets we have sent to user on this connection.
   uint16_t eofseqnr;
+  uint16_t expiringCnt; // Packets in outbuf having a deadline.
+  uint16_t skipnr; // The other end gave up packets up to this seqnr.
+  uint8_t skipPending : 1;
+  uint8_t streamPending : 1; // Some stream can deliver a held packet.
+  uint8_t unordered : 1;     // See RDP_CONN_PROP_UNORDERED.
+  uint8_t corked : 1;        // See rdpConnCork().
+  uint32_t corkDelay;        // In milliseconds.
+  uint32_t coalesceDelay;    // In microseconds, see RDP_CONN_PROP_COALESCE.
+  // Held trailing packet is sent by then, in microseconds. Zero if none.
+  uint64_t flushTicker;
+  // Next ticket is issued by then, in milliseconds. Zero on the initial end.
+  uint64_t ticketTicker;
+  struct ticket ticket; // Latest ticket got, valid if hasTicket.
+  uint8_t hasTicket : 1;
   uint8_t receivedFinCompleted : 1;
   uint8_t receivedFin : 1;
   uint8_t needSendAck : 1;
+  uint8_t resumed : 1; // Imported, reported by RDP_ACCEPT once.
   socklen_t addrlen;
   struct sockaddr_storage addr; // The address bound to this connection.
 
@@ -261,6 +656,34 @@ struct rdpConn {
   uint32_t outOfDateSum;
   uint32_t outOfOrderDuplicatedSum;
   uint32_t outOfOrderSum;
+
+  // Tells it from an earlier conn of the same key, see submit().
+  uint32_t serial;
+  // Submissions taken from rdpSocket->submits, not yet written.
+  struct submission *submitHead;
+  struct submission *submitTail;
+  rdpConn *submitNext;
+
+  // Events handed to a worker thread, see rdpConnReadyFd(). Those ready has no
+  // room for wait in readyHead.
+  struct handoff *ready;
+  struct completion *readyHead;
+  struct completion *readyTail;
+  rdpConn *readyNext;
+  _Atomic int readyBacklog; // readyHead is set, the worker wakes the owner.
+
+  // See rdpGroupOpen(), group conns are never acked nor retransmitted.
+  uint8_t groupSender : 1;
+  uint8_t groupMember : 1;
+  uint16_t groupHighest; // Highest seqnr the sender is known to have sent.
+  // Sender: next heartbeat. Member: next NAK, zero if nothing is missing. In
+  // milliseconds.
+  uint64_t groupTicker;
+
+  rdpConn *splice; // Relaying to and from it, see rdpConnSplice().
+
+  struct rdpSink *sink; // See rdpConnSetSink(), NULL if none.
+  size_t sinkProgress;  // See rdpConnGetSinkProgress().
 };
 
 static inline size_t max(size_t a, size_t b) {
@@ -275,6 +698,10 @@ static inline size_t min(size_t a, size_t b) {
   return b;
 }
 
+static inline int sixteenAfter(uint16_t a, uint16_t b) {
+  return ((int16_t)((int16_t)a - (int16_t)b) < 0);
+}
+
 static inline uint8_t packetGetVersion(const struct packet *p) {
   return p->versionAndType & 0x0f;
 }
@@ -291,10 +718,66 @@ static inline void packetSetType(struct packet *p, uint8_t t) {
   p->versionAndType = (p->versionAndType & 0x0f) | (t << 4);
 }
 
+// The library's own memory comes from here, see rdpSetAllocator().
+static rdpAllocator allocator = {NULL, NULL, NULL, NULL};
+
+static inline void *rdpMalloc(size_t size) {
+  if (allocator.allocate)
+    return allocator.allocate(allocator.ctx, size);
+  return malloc(size);
+}
+
+static inline void *rdpCalloc(size_t n, size_t size) {
+  void *p = rdpMalloc(n * size);
+  if (p)
+    memset(p, 0, n * size);
+  return p;
+}
+
+static inline void *rdpRealloc(void *p, size_t size) {
+  if (allocator.reallocate)
+    return allocator.reallocate(allocator.ctx, p, size);
+  return realloc(p, size);
+}
+
+static inline void rdpFree(void *p) {
+  if (!p)
+    return;
+
+  if (allocator.deallocate) {
+    allocator.deallocate(allocator.ctx, p);
+    return;
+  }
+  free(p);
+}
+
+// Free a packet of outbuf, the file mapping too if it was the last one on it.
+static inline void packetWrapFree(struct packetWrap *pw) {
+  if (pw && pw->map && --pw->map->refs == 0) {
+    munmap(pw->map->addr, pw->map->len);
+    rdpFree(pw->map);
+  }
+  rdpFree(pw);
+}
+
+int rdpSetAllocator(const rdpAllocator *a) {
+  if (a && (!a->allocate || !a->reallocate || !a->deallocate)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (a)
+    allocator = *a;
+  else
+    memset(&allocator, 0, sizeof(allocator));
+
+  return 0;
+}
+
 // buf shall already be allocated as a two fields struct.
 static inline void rbufferInit(struct rbuffer *buf) {
   buf->mask = 63;
-  buf->elements = (void **)calloc(64, sizeof(void *));
+  buf->elements = (void **)rdpCalloc(64, sizeof(void *));
 }
 
 static inline void *rbufferGet(struct rbuffer *buf, size_t i) {
@@ -320,10 +803,10 @@ static inline size_t rbufferGetFilled(struct rbuffer *buf) {
 // Free the element items and the elements field, not buf itself.
 static inline void rbufferFree(struct rbuffer *buf) {
   for (size_t i = 0; i <= buf->mask; i++) {
-    free(rbufferGet(buf, i));
+    rdpFree(rbufferGet(buf, i));
   }
 
-  free(buf->elements);
+  rdpFree(buf->elements);
 }
 
 static inline void rbufferPut(struct rbuffer *buf, size_t i, void *data) {
@@ -340,7 +823,7 @@ static inline void rbufferGrow(struct rbuffer *buf, size_t item, size_t index) {
     size *= 2;
   while (index >= size);
 
-  void **newElements = (void **)calloc(size, sizeof(void *));
+  void **newElements = (void **)rdpCalloc(size, sizeof(void *));
 
   // Size is new mask now.
   size--;
@@ -349,7 +832,7 @@ static inline void rbufferGrow(struct rbuffer *buf, size_t item, size_t index) {
     newElements[(item - index + i) & size] = rbufferGet(buf, item - index + i);
   }
 
-  free(buf->elements);
+  rdpFree(buf->elements);
   buf->elements = newElements;
   buf->mask = size;
 }
@@ -361,19 +844,127 @@ static inline void rbufferEnsureSize(struct rbuffer *buf, size_t item,
     rbufferGrow(buf, item, index);
 }
 
-// Return the UNIX time in millisecond.
-static inline uint64_t mstime(void) {
+static int handoffInit(struct handoff *h, size_t size) {
+  h->cells = rdpMalloc(size * sizeof(*h->cells));
+  if (!h->cells)
+    return -1;
+
+  h->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (h->efd == -1) {
+    rdpFree(h->cells);
+    return -1;
+  }
+
+  for (size_t i = 0; i < size; i++)
+    atomic_init(&h->cells[i].seq, i);
+  atomic_init(&h->tail, 0);
+  atomic_init(&h->notified, 0);
+  h->head = 0;
+  h->mask = size - 1;
+
+  return 0;
+}
+
+// Any thread, wake the consumer. Only the first since the consumer last woke up
+// pays the syscall.
+static void handoffNotify(struct handoff *h) {
+  if (!atomic_exchange(&h->notified, 1)) {
+    uint64_t one = 1;
+    if (write(h->efd, &one, sizeof(one)) == -1)
+      assert(errno == EAGAIN);
+  }
+}
+
+// Any thread. Fails with EAGAIN if the ring is full.
+static int handoffPush(struct handoff *h, void *p) {
+  size_t pos = atomic_load_explicit(&h->tail, memory_order_relaxed);
+  struct handoffCell *cell;
+
+  for (;;) {
+    cell = &h->cells[pos & h->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&h->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // The consumer hasn't taken the cell a lap ago yet.
+      errno = EAGAIN;
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&h->tail, memory_order_relaxed);
+    }
+  }
+
+  cell->p = p;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+  handoffNotify(h);
+
+  return 0;
+}
+
+// Consumer thread only. NULL if the ring is empty.
+static void *handoffPeek(struct handoff *h) {
+  struct handoffCell *cell = &h->cells[h->head & h->mask];
+
+  if (atomic_load_explicit(&cell->seq, memory_order_acquire) != h->head + 1)
+    return NULL;
+  return cell->p;
+}
+
+static void *handoffPop(struct handoff *h) {
+  void *p = handoffPeek(h);
+  if (!p)
+    return NULL;
+
+  struct handoffCell *cell = &h->cells[h->head & h->mask];
+  // Free for the push a lap later.
+  atomic_store_explicit(&cell->seq, h->head + h->mask + 1,
+                        memory_order_release);
+  h->head++;
+
+  return p;
+}
+
+// Consumer thread, before draining the ring. Pushes after it write efd again.
+static void handoffRearm(struct handoff *h) {
+  if (atomic_exchange(&h->notified, 0)) {
+    uint64_t cnt;
+    if (read(h->efd, &cnt, sizeof(cnt)) == -1)
+      assert(errno == EAGAIN);
+  }
+}
+
+// Free the pointers left, no thread uses the ring anymore.
+static void handoffFree(struct handoff *h) {
+  void *p;
+  while ((p = handoffPop(h)))
+    rdpFree(p);
+
+  rdpFree(h->cells);
+  close(h->efd);
+}
+
+// Return the UNIX time in microseconds.
+static inline uint64_t ustime(void) {
   struct timeval tv;
-  uint64_t mst;
 
   gettimeofday(&tv, NULL);
-  mst = ((uint64_t)tv.tv_sec) * 1000;
-  mst += tv.tv_usec / 1000;
-  return mst;
+  return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// Update mstime and ustime of s.
+static inline void rdpSocketTick(rdpSocket *s) {
+  s->ustime = ustime();
+  s->mstime = s->ustime / 1000;
 }
 
 // This MTU limits the size of rdp header and payload, in bytes.
-static inline size_t getUdpMtu() { return UDP_IPV4_MTU; }
+static inline size_t getUdpMtu() { return RDP_UDP_MTU; }
 
 static inline size_t getPacketHeaderSize() { return sizeof(struct packet); }
 
@@ -387,22 +978,133 @@ static inline size_t getMaxPacketPayloadSize() {
   return getUdpMtu() - getPacketHeaderSize();
 }
 
-// Return a valid retransmit timeout.
+// Bytes taken by exts on the wire, including their two bytes headers.
+static inline size_t getExtsSize(const struct packetExt *exts, size_t extCnt) {
+  size_t size = 0;
+  for (size_t i = 0; i < extCnt; i++)
+    size += 2 + exts[i].len;
+
+  return size;
+}
+
+// Walk the extension chain starting at packet.reserve.
+// Return the start of payload, or NULL if the chain is malformed.
+static inline const uint8_t *parseExtensions(const struct packet *p,
+                                             const uint8_t *end,
+                                             struct packetExts *exts) {
+  const uint8_t *cur = (const uint8_t *)p + getPacketHeaderSize();
+  uint8_t extension = p->reserve;
+
+  memset(exts, 0, sizeof(*exts));
+
+  while (extension != EXT_NONE) {
+    if (end - cur < 2 || end - cur - 2 < cur[1])
+      return NULL;
+
+    const uint8_t *data = cur + 2;
+    uint8_t len = cur[1];
+
+    switch (extension) {
+    case EXT_SACK:
+      exts->sackMask = data;
+      exts->sackLen = len;
+      break;
+    case EXT_MESSAGE:
+      if (len < 1)
+        return NULL;
+      exts->msgFlags = data[0] | MSG_FRAGMENT;
+      break;
+    case EXT_FORWARD_ACK:
+      if (len < sizeof(uint16_t))
+        return NULL;
+      exts->hasForwardAck = 1;
+      memcpy(&exts->forwardAcknr, data, sizeof(uint16_t));
+      break;
+    case EXT_STREAM: {
+      struct streamExt se;
+      if (len < sizeof(se))
+        return NULL;
+      memcpy(&se, data, sizeof(se));
+      if (se.id == 0)
+        return NULL;
+      exts->streamId = se.id;
+      exts->streamSeqnr = se.seqnr;
+      break;
+    }
+    case EXT_TICKET:
+      if (len != sizeof(struct ticket))
+        return NULL;
+      exts->ticket = data;
+      break;
+    default:
+      // Unknown extensions are skipped.
+      break;
+    }
+
+    extension = cur[0];
+    cur = data + len;
+  }
+
+  return cur;
+}
+
+// Return a valid retransmit timeout, in microseconds.
 // Return default timeout if t equals zero.
-static inline uint32_t boundedRetransmitTimeout(uint32_t t) {
+static inline uint32_t boundedRetransmitTimeout(const rdpConn *c, uint32_t t) {
+  const rdpTunables *tun = &c->tunables;
+
   if (t > 0) {
-    return min(RDP_RETRANSMIT_TIMEOUT_MAX, max(RDP_RETRANSMIT_TIMEOUT_MIN, t));
+    uint32_t lower = tun->retransmitTimeoutMin * 1000;
+
+    // Down to a few RTTs of a fast path, once it's measured.
+    if (tun->retransmitTimeoutMinRtts && c->minRtt)
+      lower = min(lower, max(RDP_RETRANSMIT_TIMEOUT_FLOOR,
+                             tun->retransmitTimeoutMinRtts * c->minRtt));
+
+    return min(tun->retransmitTimeoutMax * 1000, max(lower, t));
   }
-  return RDP_RETRANSMIT_TIMEOUT_DEFAULT;
+  return tun->retransmitTimeoutDefault * 1000;
 }
 
 // Return a valid window size.
 // Return default window size if t equals zero.
-static inline uint32_t limitedWindow(uint32_t t) {
+static inline uint32_t limitedWindow(const rdpConn *c, uint32_t t) {
   if (t > 0) {
     return min(RDP_WINDOW_SIZE_MAX, max(getMaxPacketPayloadSize(), t));
   }
-  return RDP_WINDOW_SIZE_DEFAULT;
+  return c->tunables.windowDefault;
+}
+
+// Indexed by RDP_PROFILE_*.
+static const rdpTunables profiles[] = {
+    {RDP_RETRANSMIT_TIMEOUT_MIN, RDP_RETRANSMIT_TIMEOUT_MAX,
+     RDP_RETRANSMIT_TIMEOUT_DEFAULT, 0, RDP_KEEPALIVE_INTERVAL,
+     RDP_WINDOW_SIZE_DEFAULT, RDP_WINDOW_SHRINK_FACTOR,
+     RDP_WINDOW_EXPAND_FACTOR, RDP_RESIZE_WINDOW_INTERVAL_MIN,
+     RDP_ACK_NR_RECV_BEHIND_ALLOWED},
+    // Datacenter.
+    {10, 200, 50, 4, 5000, RDP_WINDOW_SIZE_MAX / 4, 2, 2, 100, 10},
+    // WAN.
+    {200, 2000, 500, 0, 25000, RDP_WINDOW_SIZE_MAX / 8, 2, 2, 1000, 16},
+    // Satellite, RTT of geostationary hops is 600 milliseconds and more.
+    {1000, 8000, 1500, 0, 25000, RDP_WINDOW_SIZE_MAX, 2, 4, 2000, 64},
+    // Mobile, carrier NATs drop bindings idle for 30 seconds or less.
+    {300, 4000, 1000, 0, 15000, RDP_WINDOW_SIZE_MAX / 16, 2, 2, 1000, 32},
+};
+
+// Whether t fits together and with the build.
+static int tunablesValid(const rdpTunables *t) {
+  return t->retransmitTimeoutMin > 0 &&
+         t->retransmitTimeoutMin <= t->retransmitTimeoutDefault &&
+         t->retransmitTimeoutDefault <= t->retransmitTimeoutMax &&
+         t->retransmitTimeoutMax <= INT32_MAX / 1000 &&
+         t->retransmitTimeoutMinRtts <= 64 &&
+         t->keepAliveInterval > 0 &&
+         t->windowDefault >= getMaxPacketPayloadSize() &&
+         t->windowDefault <= RDP_WINDOW_SIZE_MAX &&
+         t->windowShrinkFactor > 0 && t->windowExpandFactor > 0 &&
+         t->resizeWindowInterval > 0 &&
+         t->ackBehindAllowed < RDP_QUEUE_SIZE_MAX;
 }
 
 #ifdef RDP_DEBUG
@@ -527,6 +1229,7 @@ static inline void connStateSwitch(rdpConn *c, uint8_t targetState) {
     switch (targetState) {
     case CS_SYN_SENT:
     case CS_SYN_RECV:
+    case CS_CONNECTED: // Group conns have no handshake.
       goto validSwitch;
     default:
       goto invalidSwitch;
@@ -556,6 +1259,7 @@ static inline void connStateSwitch(rdpConn *c, uint8_t targetState) {
   case CS_CONNECTED:
     switch (targetState) {
     case CS_CONNECTED_FULL:
+    case CS_HALF_CLOSED:
     case CS_FIN_SENT:
     case CS_RESET:
     case CS_DESTROY:
@@ -567,6 +1271,17 @@ static inline void connStateSwitch(rdpConn *c, uint8_t targetState) {
   case CS_CONNECTED_FULL:
     switch (targetState) {
     case CS_CONNECTED:
+    case CS_HALF_CLOSED:
+    case CS_FIN_SENT:
+    case CS_RESET:
+    case CS_DESTROY:
+      goto validSwitch;
+    default:
+      goto invalidSwitch;
+    }
+
+  case CS_HALF_CLOSED:
+    switch (targetState) {
     case CS_FIN_SENT:
     case CS_RESET:
     case CS_DESTROY:
@@ -622,84 +1337,323 @@ static inline uint64_t rdpConnHashCallback(const void *key) {
   return dictHashFnDefault((unsigned char *)&c->recvId, 1);
 }
 
-// Dict node deletion callback.
-static inline void rdpConnDestructor(void *val) {
-  rdpConn *c = (rdpConn *)val;
+static inline uint64_t rdpStreamHashCallback(const void *key) {
+  struct rdpStream *st = (struct rdpStream *)key;
 
-  rbufferFree(&c->inbuf);
-  rbufferFree(&c->outbuf);
+  return dictHashFnDefault((unsigned char *)&st->id, sizeof(st->id));
+}
 
-  free(val);
+static inline int rdpStreamCmp(const void *key1, const void *key2) {
+  return ((struct rdpStream *)key1)->id == ((struct rdpStream *)key2)->id;
 }
 
-// rdpConn node compare callback.
-// Using three fields of rdpConn: recvId, addr, addrlen to determine
-// equlity.
-// Return 1 if equal, otherwise 0.
-static inline int rdpConnCmp(const void *key1, const void *key2) {
-  rdpConn *c1, *c2;
+// Held packets belong to rdpConn->inbuf, only the ring itself is freed.
+static inline void rdpStreamDestructor(void *val) {
+  struct rdpStream *st = (struct rdpStream *)val;
 
-  c1 = (rdpConn *)key1;
-  c2 = (rdpConn *)key2;
+  rdpFree(st->held.elements);
+  rdpFree(st->msg.buf);
+  rdpFree(st);
+}
 
-  if (c1->recvId != c2->recvId)
-    return 0;
+static dictType rdpStreamDictType = {rdpStreamHashCallback, rdpStreamCmp, NULL,
+                                     NULL, rdpStreamDestructor, NULL};
 
-  if (c1->addrlen != c2->addrlen)
-    return 0;
+static inline uint64_t pendingCallHashCallback(const void *key) {
+  struct pendingCall *pc = (struct pendingCall *)key;
 
-  return memcmp(&c1->addr, &c2->addr, c1->addrlen) == 0;
+  return dictHashFnDefault((unsigned char *)&pc->id, sizeof(pc->id));
 }
 
-// Just Invoke listNodeDestroy() is enough, actions free internal struct is
-// registerd in list.
-static inline int rdpConnDestroy(rdpConn *c) {
-  // Not registered in rdpSocket->conns.
-  if (!(c->addrlen || c->idSeed)) {
-    rdpConnDestructor((void *)c);
-    return 0;
-  }
+static inline int pendingCallCmp(const void *key1, const void *key2) {
+  return ((struct pendingCall *)key1)->id == ((struct pendingCall *)key2)->id;
+}
 
-  dictEntry *e = dictEntryDelete(c->rdpSocket->conns, c, 0);
+static inline void pendingCallDestructor(void *val) { rdpFree(val); }
 
-  assert(e);
-  return 0;
+static dictType pendingCallDictType = {pendingCallHashCallback,
+                                       pendingCallCmp,
+                                       NULL,
+                                       NULL,
+                                       pendingCallDestructor,
+                                       NULL};
+
+// Undo rdpConnSplice() on both ends.
+static inline void rdpConnUnsplice(rdpConn *c) {
+  rdpConn *peer = c->splice;
+
+  if (!peer)
+    return;
+
+  c->splice = peer->splice = NULL;
+  c->rdpSocket->splices--;
+  peer->rdpSocket->splices--;
+  c->recvWindowSelf = peer->recvWindowSelf =
+      limitedWindow(c, RDP_WINDOW_SIZE_MAX);
 }
 
-// Create a UDP socket, bound to address "node:service".
-static inline int inetSocket(const char *node, const char *service,
-                             socklen_t *addrlen) {
-  struct addrinfo hints;
-  struct addrinfo *result, *rp;
-  int sfd, optval, s;
+static inline int isSinkSlot(rdpConn *c, const struct inPacket *ip) {
+  return c->sink && ip >= c->sink->slots &&
+         ip < c->sink->slots + RDP_QUEUE_SIZE_MAX;
+}
 
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_canonname = NULL;
-  hints.ai_addr = NULL;
-  hints.ai_next = NULL;
-  hints.ai_socktype = SOCK_DGRAM;
-  // AF_UNSPEC allows IPv4 or IPv6
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_flags = AI_PASSIVE;
+// Where payload of the packet after the next k goes in the sink, NULL if it
+// doesn't fit.
+static inline unsigned char *rdpConnSinkPlace(rdpConn *c, uint16_t k,
+                                              size_t payload) {
+  struct rdpSink *sk = c->sink;
+  size_t at = sk->pos + (size_t)k * getMaxPacketPayloadSize();
 
-  s = getaddrinfo(node, service, &hints, &result);
-  if (s != 0) {
+  if (at + payload > sk->len)
+    return NULL;
 
-#ifdef RDP_DEBUG
-    write(STDOUT_FILENO, gai_strerror(s), strlen(gai_strerror(s)));
-#endif
+  return sk->base + at;
+}
 
-    return -1;
-  }
+// Mark seqnr held, its payload is written by rdpConnSinkPlace() already.
+static inline struct inPacket *rdpConnSinkHold(rdpConn *c, uint16_t seqnr,
+                                               size_t payload) {
+  struct rdpSink *sk = c->sink;
+  struct inPacket *ip = &sk->slots[seqnr % RDP_QUEUE_SIZE_MAX];
 
-  optval = 1;
-  for (rp = result; rp != NULL; rp = rp->ai_next) {
-    sfd =
-        socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK, rp->ai_protocol);
-    if (sfd == -1)
-      continue;
+  memset(ip, 0, sizeof(*ip));
+  ip->payload = (uint32_t)payload;
 
-    if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
+  if (!sk->held || sixteenAfter(sk->top, seqnr))
+    sk->top = seqnr;
+  sk->held++;
+
+  return ip;
+}
+
+// Stop writing into the sink. If keep, packets held in it are copied back to
+// inbuf to be delivered as usual, otherwise they're dropped.
+static inline void rdpConnSinkClose(rdpConn *c, int keep) {
+  struct rdpSink *sk = c->sink;
+  const size_t maxPacketPayloadSize = getMaxPacketPayloadSize();
+
+  if (!sk)
+    return;
+
+  for (uint16_t i = c->acknr + 1; keep && sk->held; i++) {
+    struct inPacket *slot = rbufferGet(&c->inbuf, i);
+    if (!isSinkSlot(c, slot))
+      continue;
+
+    struct inPacket *ip = (struct inPacket *)rdpMalloc(
+        offsetof(struct inPacket, data) + slot->payload);
+    assert(ip);
+    memcpy(ip, slot, offsetof(struct inPacket, data));
+    memcpy(ip->data,
+           sk->base + sk->pos + (uint16_t)(i - c->acknr - 1) *
+                                    maxPacketPayloadSize,
+           slot->payload);
+
+    rbufferPut(&c->inbuf, i, ip);
+    sk->held--;
+  }
+
+  for (size_t i = 0; c->inbuf.elements && i <= c->inbuf.mask; i++) {
+    if (isSinkSlot(c, rbufferGet(&c->inbuf, i)))
+      rbufferPut(&c->inbuf, i, NULL);
+  }
+
+  munmap(sk->map, sk->mapLen);
+  rdpFree(sk);
+  c->sink = NULL;
+}
+
+// Payload of the next packet, if plain data, is written into the sink. Return
+// bytes written, -1 if it's for the user. Plain data not fitting in what's
+// left ends the sink, reported by RDP_SINK.
+static inline ssize_t rdpConnSinkWrite(rdpConn *c, int plain,
+                                       const uint8_t *data, size_t payload,
+                                       int *events) {
+  if (!plain)
+    return -1;
+
+  unsigned char *at = rdpConnSinkPlace(c, 0, payload);
+  if (!at) {
+    rdpConnSinkClose(c, 1);
+    *events |= RDP_SINK;
+    return -1;
+  }
+
+  memcpy(at, data, payload);
+  return payload;
+}
+
+// acknr moves past the next packet, which wrote n bytes into the sink. Those
+// held after it were placed as if it were full, they're moved down by what
+// it's short of. Return 1 if the progress should be reported.
+static inline int rdpConnSinkPass(rdpConn *c, size_t n) {
+  struct rdpSink *sk = c->sink;
+  const size_t maxPacketPayloadSize = getMaxPacketPayloadSize();
+  uint16_t next = c->acknr + 1;
+
+  if (isSinkSlot(c, rbufferGet(&c->inbuf, next)))
+    sk->held--;
+
+  if (sk->held && n < maxPacketPayloadSize) {
+    size_t from = sk->pos + maxPacketPayloadSize;
+    size_t to = min(sk->len, sk->pos + (uint16_t)(sk->top - c->acknr) *
+                                           maxPacketPayloadSize);
+
+    memmove(sk->base + sk->pos + n, sk->base + from, to - from);
+  }
+
+  sk->pos += n;
+  c->sinkProgress = sk->pos;
+
+  if (sk->pos == sk->len) {
+    assert(sk->held == 0);
+    rdpConnSinkClose(c, 0);
+    return 1;
+  }
+
+  if (sk->pos - sk->reported >= RDP_SINK_WATERMARK) {
+    sk->reported = sk->pos;
+    return 1;
+  }
+
+  return 0;
+}
+
+// Dict node deletion callback.
+static inline void rdpConnDestructor(void *val) {
+  rdpConn *c = (rdpConn *)val;
+
+  rdpConnUnsplice(c);
+  rdpConnSinkClose(c, 0);
+
+  rbufferFree(&c->inbuf);
+  // Packets of rdpSendFile() hold their mapping.
+  for (uint16_t i = c->seqnr - c->queue; i != c->seqnr; i++) {
+    packetWrapFree(rbufferGet(&c->outbuf, i));
+    rbufferPut(&c->outbuf, i, NULL);
+  }
+  rbufferFree(&c->outbuf);
+  rdpFree(c->msg.buf);
+
+  if (c->streams) {
+    dictIteratorDestroy(c->streamsIter);
+    dictDestroy(c->streams);
+  }
+
+  if (c->calls) {
+    dictIteratorDestroy(c->callsIter);
+    dictDestroy(c->calls);
+  }
+
+  if (c->submitHead) {
+    rdpConn **pc = &c->rdpSocket->submitConns;
+    while (*pc != c)
+      pc = &(*pc)->submitNext;
+    *pc = c->submitNext;
+
+    struct submission *sub;
+    while ((sub = c->submitHead)) {
+      c->submitHead = sub->next;
+      rdpFree(sub);
+    }
+  }
+
+  if (c->readyHead) {
+    rdpConn **pc = &c->rdpSocket->readyConns;
+    while (*pc != c)
+      pc = &(*pc)->readyNext;
+    *pc = c->readyNext;
+
+    struct completion *cp;
+    while ((cp = c->readyHead)) {
+      c->readyHead = cp->next;
+      rdpFree(cp);
+    }
+  }
+
+  if (c->ready) {
+    handoffFree(c->ready);
+    rdpFree(c->ready);
+  }
+
+  rdpFree(val);
+}
+
+// rdpConn node compare callback.
+// Using three fields of rdpConn: recvId, addr, addrlen to determine
+// equlity.
+// Return 1 if equal, otherwise 0.
+static inline int rdpConnCmp(const void *key1, const void *key2) {
+  rdpConn *c1, *c2;
+
+  c1 = (rdpConn *)key1;
+  c2 = (rdpConn *)key2;
+
+  if (c1->recvId != c2->recvId)
+    return 0;
+
+  if (c1->addrlen != c2->addrlen)
+    return 0;
+
+  return memcmp(&c1->addr, &c2->addr, c1->addrlen) == 0;
+}
+
+// Just Invoke listNodeDestroy() is enough, actions free internal struct is
+// registerd in list.
+static inline int rdpConnDestroy(rdpConn *c) {
+  // Not registered in rdpSocket->conns.
+  if (!(c->addrlen || c->idSeed)) {
+    rdpConnDestructor((void *)c);
+    return 0;
+  }
+
+  dictEntry *e = dictEntryDelete(c->rdpSocket->conns, c, 0);
+
+  assert(e);
+  return 0;
+}
+
+// Create a UDP socket, bound to address "node:service". Sockets with reusePort
+// set share the address, see rdpRuntimeCreate().
+static inline int inetSocket(const char *node, const char *service,
+                             socklen_t *addrlen, int reusePort) {
+  struct addrinfo hints;
+  struct addrinfo *result, *rp;
+  int sfd, optval, s;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_canonname = NULL;
+  hints.ai_addr = NULL;
+  hints.ai_next = NULL;
+  hints.ai_socktype = SOCK_DGRAM;
+  // AF_UNSPEC allows IPv4 or IPv6
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = AI_PASSIVE;
+
+  s = getaddrinfo(node, service, &hints, &result);
+  if (s != 0) {
+
+#ifdef RDP_DEBUG
+    write(STDOUT_FILENO, gai_strerror(s), strlen(gai_strerror(s)));
+#endif
+
+    return -1;
+  }
+
+  optval = 1;
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    sfd =
+        socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK, rp->ai_protocol);
+    if (sfd == -1)
+      continue;
+
+    if (reusePort && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                                sizeof(optval)) == -1) {
+      close(sfd);
+      continue;
+    }
+
+    if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
       // Success.
       break;
 
@@ -714,13 +1668,10 @@ static inline int inetSocket(const char *node, const char *service,
   return (rp == NULL) ? -1 : sfd;
 }
 
-// Create a rdpSocket.
-rdpSocket *rdpSocketCreate(int version, const char *node, const char *service) {
-  if (version != 1)
-    return NULL;
-
+// Wrap fd, a bound nonblocking UDP socket, in a rdpSocket.
+static rdpSocket *socketOpen(int fd) {
   rdpSocket *s;
-  s = malloc(sizeof(*s));
+  s = rdpMalloc(sizeof(*s));
   assert(s);
   if (s == NULL) {
     perror("malloc");
@@ -728,11 +1679,7 @@ rdpSocket *rdpSocketCreate(int version, const char *node, const char *service) {
   }
 
   s->userData = NULL;
-  s->fd = inetSocket(node, service, NULL);
-  if (s->fd == -1) {
-    perror("inetSocket");
-    exit(EXIT_FAILURE);
-  }
+  s->fd = fd;
 
   dictType rdpConnDictType = {rdpConnHashCallback, rdpConnCmp, NULL, NULL,
                               rdpConnDestructor,   NULL};
@@ -742,18 +1689,58 @@ rdpSocket *rdpSocketCreate(int version, const char *node, const char *service) {
   s->connsIter = dictIteratorCreate(s->conns);
   assert(s->connsIter);
 
-  s->mstime = mstime();
-  s->lastCheck = s->mstime;
-  s->nextCheckTimeout = RDP_SOCKET_CHECK_TIMEOUT_DEFAULT;
+  rdpSocketTick(s);
+  s->lastCheck = s->ustime;
+  s->nextCheckTimeout = RDP_SOCKET_CHECK_TIMEOUT_DEFAULT * 1000;
   s->sendBufferSize = RDP_SEND_BUFFER_SIZE_MAX;
   s->recvBufferSize = RDP_RECV_BUFFER_SIZE_MAX;
+  s->tunables = profiles[RDP_PROFILE_DEFAULT];
   s->verbosity = LL_DEBUG;
 
   srand((unsigned int)s->mstime);
 
+  FILE *f = fopen("/dev/urandom", "r");
+  if (!f || fread(s->ticketKey, sizeof(s->ticketKey), 1, f) != 1) {
+    for (size_t i = 0; i < sizeof(s->ticketKey); i++)
+      s->ticketKey[i] = rand();
+  }
+  if (f)
+    fclose(f);
+
+  s->submitConns = NULL;
+  s->nextSerial = 0;
+  s->readyConns = NULL;
+  s->groupLen = 0;
+  s->splices = 0;
+  s->spare = NULL;
+  if (handoffInit(&s->submits, RDP_SUBMIT_RING_SIZE) == -1 ||
+      handoffInit(&s->completions, RDP_COMPLETION_RING_SIZE) == -1) {
+    perror("eventfd");
+    exit(EXIT_FAILURE);
+  }
+
   return s;
 }
 
+static rdpSocket *socketCreate(int version, const char *node,
+                               const char *service, int reusePort) {
+  if (version != 1)
+    return NULL;
+
+  int fd = inetSocket(node, service, NULL, reusePort);
+  if (fd == -1) {
+    perror("inetSocket");
+    exit(EXIT_FAILURE);
+  }
+
+  return socketOpen(fd);
+}
+
+// Create a rdpSocket.
+rdpSocket *rdpSocketCreate(int version, const char *node, const char *service) {
+  return socketCreate(version, node, service, 0);
+}
+
 // Close fd, free conns dict.
 int rdpSocketDestroy(rdpSocket *s) {
   if (!s)
@@ -769,7 +1756,11 @@ int rdpSocketDestroy(rdpSocket *s) {
     assert(0);
   }
 
-  free(s);
+  handoffFree(&s->submits);
+  handoffFree(&s->completions);
+  rdpFree(s->spare);
+
+  rdpFree(s);
 
   return 0;
 }
@@ -830,18 +1821,21 @@ rdpConn *rdpConnCreate(rdpSocket *s) {
     return NULL;
 
   rdpConn *c;
-  c = malloc(sizeof(*c));
+  c = rdpMalloc(sizeof(*c));
   if (c == NULL) {
     return NULL;
   }
   c->rdpSocket = s;
   c->userData = NULL;
+  c->tunables = s->tunables;
+  c->serial = s->nextSerial++;
   connStateInit(c);
 
   memset(&c->addr, 0, sizeof(c->addr));
   c->addrlen = 0;
   c->lastReceivePacketTime = 0;
   c->lastSendPacketTime = 0;
+  c->finAckedTime = 0;
   c->idSeed = 0;
   c->recvId = 0;
   c->sendId = 0;
@@ -849,24 +1843,67 @@ rdpConn *rdpConnCreate(rdpSocket *s) {
   c->seqnr = rand();
   c->acknr = 0;
   c->eofseqnr = 0;
+  c->expiringCnt = 0;
+  c->skipnr = 0;
+  c->skipPending = 0;
   c->receivedFinCompleted = 0;
   c->receivedFin = 0;
   c->needSendAck = 0;
+  c->resumed = 0;
   c->queue = 0;
+  c->queuedBytes = 0;
+  c->sendLowWater = 0;
+  c->sendHighWater = 0;
   c->flightWindow = 0;
-  c->flightWindowLimit = limitedWindow(0);
-  c->recvWindowPeer = limitedWindow(RDP_WINDOW_SIZE_MAX);
-  c->recvWindowSelf = limitedWindow(RDP_WINDOW_SIZE_MAX);
+  c->flightWindowLimit = limitedWindow(c, 0);
+  c->recvWindowPeer = limitedWindow(c, RDP_WINDOW_SIZE_MAX);
+  c->recvWindowSelf = limitedWindow(c, RDP_WINDOW_SIZE_MAX);
   c->lastResizeWindowTime = 0;
   c->sentBytesSinceResizeWindow = 0;
   c->ackedBytesSinceResizeWindow = 0;
+  c->datagramBytes = 0;
+  c->datagramEpoch = 0;
   c->rtt = 0;
   c->rttVar = 0;
-  c->nextRetransmitTimeout = boundedRetransmitTimeout(0);
+  c->minRtt = 0;
+  c->nextRetransmitTimeout = boundedRetransmitTimeout(c, 0);
   c->retransmitTimeout = 0;
   c->retransmitTicker = 0;
   rbufferInit(&c->inbuf);
   rbufferInit(&c->outbuf);
+  memset(&c->msg, 0, sizeof(c->msg));
+  c->streams = NULL;
+  c->streamsIter = NULL;
+  c->lastStreamId = 0;
+  c->calls = NULL;
+  c->callsIter = NULL;
+  c->nextCallId = 0;
+  c->lastCallId = 0;
+  c->lastCookie = NULL;
+  c->callDeadline = 0;
+  c->streamPending = 0;
+  c->unordered = 0;
+  c->corked = 0;
+  c->corkDelay = RDP_CORK_DELAY_DEFAULT;
+  c->coalesceDelay = 0;
+  c->flushTicker = 0;
+  c->ticketTicker = 0;
+  c->hasTicket = 0;
+  c->submitHead = NULL;
+  c->submitTail = NULL;
+  c->submitNext = NULL;
+  c->ready = NULL;
+  c->readyHead = NULL;
+  c->readyTail = NULL;
+  c->readyNext = NULL;
+  atomic_init(&c->readyBacklog, 0);
+  c->groupSender = 0;
+  c->groupMember = 0;
+  c->groupHighest = 0;
+  c->groupTicker = 0;
+  c->splice = NULL;
+  c->sink = NULL;
+  c->sinkProgress = 0;
 
   memset(c->errInfo, 0, LOG_MAX_LEN);
 
@@ -877,6 +1914,49 @@ rdpConn *rdpConnCreate(rdpSocket *s) {
   return c;
 }
 
+// Find the stream by id, create it if asked to.
+// Return NULL if not found, or RDP_MAX_STREAMS_PER_CONN is reached.
+static inline struct rdpStream *rdpConnGetStream(rdpConn *c, uint16_t id,
+                                                 int create) {
+  struct rdpStream comparedValue;
+
+  if (c->streams) {
+    comparedValue.id = id;
+
+    dictEntry *e = dictFind(c->streams, &comparedValue);
+    if (e) {
+      return (struct rdpStream *)dictKeyGet(e);
+    }
+  }
+
+  if (!create)
+    return NULL;
+
+  if (!c->streams) {
+    c->streams = dictCreate(&rdpStreamDictType);
+    assert(c->streams);
+
+    c->streamsIter = dictIteratorCreate(c->streams);
+    assert(c->streamsIter);
+  }
+
+  if (dictFilled(c->streams) >= RDP_MAX_STREAMS_PER_CONN)
+    return NULL;
+
+  struct rdpStream *st = (struct rdpStream *)rdpMalloc(sizeof(*st));
+  assert(st);
+  st->id = id;
+  st->sendSeqnr = 0;
+  st->recvSeqnr = 0;
+  rbufferInit(&st->held);
+  memset(&st->msg, 0, sizeof(st->msg));
+
+  int n = dictAdd(c->streams, st, NULL);
+  assert(n == 0);
+
+  return st;
+}
+
 static inline ssize_t sendToAddr(rdpConn *c, const unsigned char *buf,
                                  size_t len) {
   ssize_t n;
@@ -887,16 +1967,55 @@ static inline ssize_t sendToAddr(rdpConn *c, const unsigned char *buf,
   return n;
 }
 
-static inline ssize_t sendData(rdpConn *c, unsigned char *buf, size_t len) {
+// Bookkeeping of every packet c sends, p is about to go out.
+static inline void sendPrepare(rdpConn *c, struct packet *p) {
   c->lastSendPacketTime = c->rdpSocket->mstime;
 
+  if (c->groupSender) {
+    if (packetGetType(p) == ST_DATA)
+      packetSetType(p, ST_GROUP);
+    else if (packetGetType(p) == ST_STATE)
+      packetSetType(p, ST_GROUP_STATE);
+  }
+}
+
+static inline ssize_t sendData(rdpConn *c, unsigned char *buf, size_t len) {
+  sendPrepare(c, (struct packet *)buf);
+
   return sendToAddr(c, buf, len);
 }
 
+// Send pw's header and the file pages it references, without copying them.
+static inline ssize_t sendMapped(rdpConn *c, struct packetWrap *pw) {
+  struct iovec iov[2] = {{pw->data, getPacketHeaderSize()},
+                         {(void *)pw->ref, pw->payload}};
+  struct msghdr msg = {0};
+
+  msg.msg_name = &c->addr;
+  msg.msg_namelen = c->addrlen;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  sendPrepare(c, (struct packet *)pw->data);
+
+  return sendmsg(c->rdpSocket->fd, &msg, 0);
+}
+
+// Make rdpSocketIntervalAction() do its job again no later than deadline, in
+// microseconds.
+static inline void rdpSocketWakeAt(rdpSocket *s, uint64_t deadline) {
+  uint64_t timeout = deadline > s->lastCheck ? deadline - s->lastCheck : 0;
+
+  if (timeout < (uint64_t)s->nextCheckTimeout)
+    s->nextCheckTimeout = timeout;
+}
+
 static inline ssize_t sendPacketWrap(rdpConn *c, struct packetWrap *pw) {
   assert(pw->transmissions == 0 || pw->needResend);
 
-  c->flightWindow += pw->payload;
+  // Never acked, released by rdpConnGroupSenderCheck() instead.
+  if (!c->groupSender)
+    c->flightWindow += pw->payload;
 
   c->sentBytesSinceResizeWindow += pw->payload;
 
@@ -904,20 +2023,119 @@ static inline ssize_t sendPacketWrap(rdpConn *c, struct packetWrap *pw) {
 
   struct packet *p = (struct packet *)pw->data;
   p->acknr = c->acknr;
-  pw->sentTime = c->rdpSocket->mstime;
+  pw->sentTime = c->rdpSocket->ustime;
   pw->transmissions++;
 
+  // Fast paths can't wait for the next regular check to retransmit.
+  if (c->tunables.retransmitTimeoutMinRtts)
+    rdpSocketWakeAt(c->rdpSocket, pw->sentTime + c->nextRetransmitTimeout);
+
   tlog(c->rdpSocket, LL_RAW | LL_DEBUG, "%s",
        packetStateAbbrNames[packetGetType(p)]);
 
+  if (pw->map)
+    return sendMapped(c, pw);
+
   return sendData(c, (void *)pw->data, pw->payload + getPacketHeaderSize());
 }
 
+#define SIPROUND                                                               \
+  do {                                                                         \
+    v0 += v1;                                                                  \
+    v1 = rotl64(v1, 13) ^ v0;                                                  \
+    v0 = rotl64(v0, 32);                                                       \
+    v2 += v3;                                                                  \
+    v3 = rotl64(v3, 16) ^ v2;                                                  \
+    v0 += v3;                                                                  \
+    v3 = rotl64(v3, 21) ^ v0;                                                  \
+    v2 += v1;                                                                  \
+    v1 = rotl64(v1, 17) ^ v2;                                                  \
+    v2 = rotl64(v2, 32);                                                       \
+  } while (0)
+
+static inline uint64_t rotl64(uint64_t x, int b) {
+  return (x << b) | (x >> (64 - b));
+}
+
+// SipHash-2-4 of in, keyed by key.
+static uint64_t siphash(const uint8_t *in, size_t len, const uint8_t key[16]) {
+  uint64_t k0, k1;
+  memcpy(&k0, key, 8);
+  memcpy(&k1, key + 8, 8);
+
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  uint64_t m;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&m, in + i, 8);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+
+  m = (uint64_t)len << 56;
+  for (size_t j = 0; i + j < len; j++)
+    m |= (uint64_t)in[i + j] << (8 * j);
+
+  v3 ^= m;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= m;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
+static inline uint64_t ticketMac(rdpSocket *s, const struct ticket *t) {
+  return siphash((const uint8_t *)t, offsetof(struct ticket, mac),
+                 s->ticketKey);
+}
+
+static inline int ticketExpired(const struct ticket *t) {
+  int64_t age = (int64_t)time(NULL) - t->issueTime;
+
+  return age > RDP_TICKET_LIFETIME || age < -RDP_TICKET_LIFETIME;
+}
+
+// Start from the path parameters in t instead of learning them again.
+static inline void rdpConnApplyTicket(rdpConn *c, const struct ticket *t) {
+  c->rtt = t->rtt * 1000;
+  c->rttVar = t->rttVar * 1000;
+  c->minRtt = t->minRtt * 1000;
+  c->nextRetransmitTimeout =
+      boundedRetransmitTimeout(c, c->rtt + c->rttVar * 4);
+  c->flightWindowLimit = limitedWindow(c, t->window);
+}
+
 // Initialize rdpConn, send a syn packet to the other end.
 int rdpConnect(rdpConn *c, const struct sockaddr *addr, socklen_t addrlen) {
+  return rdpConnectData(c, addr, addrlen, NULL, 0);
+}
+
+// Like rdpConnect(), the syn packet carries buf as its payload.
+int rdpConnectData(rdpConn *c, const struct sockaddr *addr, socklen_t addrlen,
+                   const void *buf, size_t len) {
   if (!c)
     return -1;
 
+  size_t extLen = c->hasTicket ? 2 + sizeof(struct ticket) : 0;
+  if (len + extLen > getMaxPacketPayloadSize() || (len && !buf)) {
+    errno = len ? EMSGSIZE : EINVAL;
+    return -1;
+  }
+
   if (c->state != CS_UNINITIALIZED) {
     tlog(c->rdpSocket, LL_DEBUG, "rdpConnect not expected state: %s",
          connStateNames[c->state]);
@@ -925,45 +2143,57 @@ int rdpConnect(rdpConn *c, const struct sockaddr *addr, socklen_t addrlen) {
     return -1;
   }
 
-  c->rdpSocket->mstime = mstime();
+  rdpSocketTick(c->rdpSocket);
 
   rdpConnInit(c, addr, addrlen, 1, 0, 0, 1);
   connStateSwitch(c, CS_SYN_SENT);
 
+  if (c->hasTicket)
+    rdpConnApplyTicket(c, &c->ticket);
+
   c->retransmitTimeout = c->nextRetransmitTimeout;
-  c->retransmitTicker = c->rdpSocket->mstime + c->retransmitTimeout;
+  c->retransmitTicker = c->rdpSocket->ustime + c->retransmitTimeout;
 
-  struct packetWrap *pw = (struct packetWrap *)malloc(getPacketWrapSize() - 1 +
-                                                      getPacketHeaderSize());
+  struct packetWrap *pw = (struct packetWrap *)rdpMalloc(
+      getPacketWrapSize() - 1 + getPacketHeaderSize() + extLen + len);
   assert(pw);
   pw->transmissions = 0;
-  pw->payload = 0;
+  pw->needResend = 0;
+  pw->abandoned = 0;
+  pw->deadline = 0;
+  pw->map = NULL;
+  pw->payload = extLen + len;
 
   struct packet *p = (struct packet *)pw->data;
   memset(p, 0, getPacketHeaderSize());
   packetSetVersion(p, 1);
   packetSetType(p, ST_SYN);
-  p->reserve = 0;
+  p->reserve = c->hasTicket ? EXT_TICKET : EXT_NONE;
   // ST_SYN is a special packet, it's connId is recvId, all subsequent packets'
   // connId is sendId.
   p->connId = c->recvId;
   p->window = c->recvWindowSelf;
   p->seqnr = c->seqnr;
+  if (c->hasTicket) {
+    uint8_t *ext = (uint8_t *)pw->data + getPacketHeaderSize();
+    ext[0] = EXT_NONE;
+    ext[1] = sizeof(struct ticket);
+    memcpy(ext + 2, &c->ticket, sizeof(struct ticket));
+  }
+  if (len)
+    memcpy(pw->data + getPacketHeaderSize() + extLen, buf, len);
 
   rbufferEnsureSize(&c->outbuf, c->seqnr, c->queue);
   rbufferPut(&c->outbuf, c->seqnr, pw);
 
   c->seqnr++;
   c->queue++;
+  c->queuedBytes += pw->payload;
   sendPacketWrap(c, pw);
 
   return 0;
 }
 
-static inline int sixteenAfter(uint16_t a, uint16_t b) {
-  return ((int16_t)((int16_t)a - (int16_t)b) < 0);
-}
-
 // demand -1 means max packet payload size for parameter more.
 // Return 1 if full, otherwise 0.
 //
@@ -977,6 +2207,29 @@ static inline int rdpConnFlightWindowFull(rdpConn *c) {
   return 0;
 }
 
+// Whether c takes no more writes. Up to the high watermark if set, regardless
+// of the flight window, otherwise until the window has no room for a packet.
+// A slot is kept for ST_FIN.
+static inline int rdpConnSendFull(rdpConn *c) {
+  if (c->queue >= RDP_QUEUE_SIZE_MAX - 1)
+    return 1;
+
+  if (c->sendHighWater)
+    return c->queuedBytes >= c->sendHighWater;
+
+  return rdpConnFlightWindowFull(c);
+}
+
+// Whether CS_CONNECTED_FULL c is to report RDP_POLLOUT, for a high watermark
+// once drained down to the low one.
+static inline int rdpConnSendDrained(rdpConn *c) {
+  if (c->sendHighWater)
+    return c->queuedBytes <= c->sendLowWater &&
+           c->queue < RDP_QUEUE_SIZE_MAX - 1;
+
+  return !rdpConnSendFull(c);
+}
+
 // Ack the packet registered in rdpConn->outbuf.
 static inline int ackPacket(rdpConn *c, uint16_t i) {
   struct packetWrap *pw = (struct packetWrap *)rbufferGet(&c->outbuf, i);
@@ -984,24 +2237,43 @@ static inline int ackPacket(rdpConn *c, uint16_t i) {
   if (!pw)
     return -1;
 
+  if (pw->deadline)
+    c->expiringCnt--;
+
+  // Already taken out of flightWindow, might never have been sent.
+  if (pw->abandoned) {
+    rbufferPut(&c->outbuf, i, NULL);
+    c->queuedBytes -= pw->payload;
+    packetWrapFree(pw);
+    return 0;
+  }
+
   if (pw->transmissions == 0) {
     tlog(c->rdpSocket, LL_DEBUG, "packet not sent been acked.");
     return -1;
   }
 
   rbufferPut(&c->outbuf, i, NULL);
+  c->queuedBytes -= pw->payload;
 
   if (pw->transmissions == 1) {
-    uint32_t packetRtt = (uint32_t)(c->rdpSocket->mstime - pw->sentTime);
+    uint32_t packetRtt = (uint32_t)(c->rdpSocket->ustime - pw->sentTime);
     if (c->rtt == 0) {
       c->rtt = packetRtt;
       c->rttVar = packetRtt / 2;
+      c->minRtt = packetRtt;
+
+      // Worth a ticket right away.
+      if (c->ticketTicker)
+        c->ticketTicker = c->rdpSocket->mstime;
     } else {
       c->rttVar += (abs((int)c->rtt - (int)packetRtt) - (int)c->rttVar) / 4;
       c->rtt += ((int)packetRtt - (int)c->rtt) / 8;
+      c->minRtt = min(c->minRtt, packetRtt);
     }
 
-    c->nextRetransmitTimeout = boundedRetransmitTimeout(c->rtt + c->rttVar * 4);
+    c->nextRetransmitTimeout =
+        boundedRetransmitTimeout(c, c->rtt + c->rttVar * 4);
   }
 
   // Resent packet didn't contribute to flightWindow.
@@ -1013,16 +2285,44 @@ static inline int ackPacket(rdpConn *c, uint16_t i) {
 
   c->ackedBytesSinceResizeWindow += pw->payload;
 
-  free(pw);
+  packetWrapFree(pw);
 
   return 0;
 }
 
+// Advertise the room c's splice has to send on, so the slower side holds back
+// the faster one. At least a packet, its retransmissions probe for more room.
+static inline void rdpConnSpliceWindow(rdpConn *c) {
+  rdpConn *peer = c->splice;
+
+  if (peer->state == CS_CONNECTED) {
+    uint32_t limit = min(peer->flightWindowLimit, peer->recvWindowPeer);
+    uint32_t room = limit > peer->flightWindow ? limit - peer->flightWindow : 0;
+
+    c->recvWindowSelf = max(room, getMaxPacketPayloadSize());
+  } else if (peer->state == CS_CONNECTED_FULL) {
+    c->recvWindowSelf = getMaxPacketPayloadSize();
+  } else {
+    // Not relaying, see rdpConnRelaying().
+    c->recvWindowSelf = limitedWindow(c, RDP_WINDOW_SIZE_MAX);
+  }
+}
+
 // Send an ack packet.
 static inline ssize_t sendAck(rdpConn *c) {
   size_t packetLen;
   struct packet *p;
 
+  if (c->splice)
+    rdpConnSpliceWindow(c);
+
+  // Members only speak up for missing data, see sendNak().
+  if (c->groupMember) {
+    c->needSendAck = 0;
+    c->outOfDateSum = c->outOfOrderDuplicatedSum = c->outOfOrderSum = 0;
+    return 0;
+  }
+
   if (c->outOfOrderCnt != 0 && !c->receivedFinCompleted) {
     // Out of order state check, send an EACK if it is.
 
@@ -1033,11 +2333,11 @@ static inline ssize_t sendAck(rdpConn *c) {
         c->outOfOrderCnt / 8 + 1 + 3 - ((c->outOfOrderCnt / 8 + 1 + 3) % 4);
 
     packetLen = getPacketWithSAckHeaderSize() - 1 + sackByteSize;
-    p = (struct packet *)malloc(packetLen);
+    p = (struct packet *)rdpMalloc(packetLen);
     assert(p);
     struct packetWithSAck *ps = (struct packetWithSAck *)p;
 
-    ps->p.reserve = 1;
+    ps->p.reserve = EXT_SACK;
     ps->next = 0;
     ps->len = sackByteSize;
 
@@ -1069,11 +2369,11 @@ static inline ssize_t sendAck(rdpConn *c) {
   } else {
     // Send an Ack.
     packetLen = getPacketHeaderSize();
-    p = (struct packet *)malloc(packetLen);
+    p = (struct packet *)rdpMalloc(packetLen);
     assert(p);
     memset(p, 0, packetLen);
 
-    p->reserve = 0;
+    p->reserve = EXT_NONE;
 
     // Print every ACK as "A".
     tlog(c->rdpSocket, LL_RAW | LL_DEBUG, "A");
@@ -1091,32 +2391,138 @@ static inline ssize_t sendAck(rdpConn *c) {
   c->needSendAck = 0;
   c->outOfDateSum = c->outOfOrderDuplicatedSum = c->outOfOrderSum = 0;
 
-  free(p);
+  rdpFree(p);
 
   return n;
 }
 
-// ST_RESET packet's connection id should be the sendId of the other end.
-static inline ssize_t sendReset(int fd, const struct sockaddr *dest_addr,
-                                socklen_t addrlen, uint16_t connId) {
-  size_t packetLen;
-  struct packet *p;
-  int n;
-
-  packetLen = getPacketHeaderSize();
-  p = (struct packet *)malloc(packetLen);
+// Send an ST_STATE telling the other end to stop waiting for packets up to
+// seqnr.
+// Send a ST_STATE packet carrying a single extension.
+static inline ssize_t sendStateExt(rdpConn *c, uint8_t type, const void *data,
+                                   uint8_t len) {
+  size_t packetLen = getPacketHeaderSize() + 2 + len;
+  struct packet *p = (struct packet *)rdpMalloc(packetLen);
   assert(p);
   memset(p, 0, packetLen);
 
-  p->reserve = 0;
-  p->connId = connId;
-
+  packetSetVersion(p, 1);
+  packetSetType(p, ST_STATE);
+  p->reserve = type;
+  p->connId = c->sendId;
+  p->acknr = c->acknr;
+  p->seqnr = c->seqnr;
+  p->window = c->recvWindowSelf;
+
+  uint8_t *ext = (uint8_t *)p + getPacketHeaderSize();
+  ext[0] = EXT_NONE;
+  ext[1] = len;
+  memcpy(ext + 2, data, len);
+
+  ssize_t n = sendData(c, (void *)p, packetLen);
+
+  rdpFree(p);
+
+  return n;
+}
+
+static inline ssize_t sendForwardAck(rdpConn *c, uint16_t seqnr) {
+  // Print every forward ack as "W".
+  tlog(c->rdpSocket, LL_RAW | LL_DEBUG, "W");
+
+  return sendStateExt(c, EXT_FORWARD_ACK, &seqnr, sizeof(seqnr));
+}
+
+// Ask the group sender for the packets missing after acknr, up to
+// groupHighest. It goes to the group as well, so members missing the same
+// packets hold back their own NAKs.
+static inline ssize_t sendNak(rdpConn *c) {
+  rdpSocket *s = c->rdpSocket;
+
+  // Mask of acknr + 2 onwards like sendAck(), a multiple of 4 bytes fitting in
+  // an extension.
+  size_t bits = (uint16_t)(c->groupHighest - c->acknr - 1);
+  size_t sackByteSize = min((bits / 8 + 1 + 3) & ~(size_t)3, 252);
+  bits = min(min(bits, sackByteSize * 8), c->inbuf.mask);
+
+  size_t packetLen = getPacketWithSAckHeaderSize() - 1 + sackByteSize;
+  struct packetWithSAck *ps = (struct packetWithSAck *)rdpCalloc(1, packetLen);
+  assert(ps);
+
+  packetSetVersion(&ps->p, 1);
+  packetSetType(&ps->p, ST_NAK);
+  ps->p.reserve = EXT_SACK;
+  ps->p.connId = c->sendId;
+  ps->p.acknr = c->acknr;
+  ps->p.seqnr = c->groupHighest;
+  ps->p.window = c->recvWindowSelf;
+  ps->next = EXT_NONE;
+  ps->len = sackByteSize;
+
+  for (size_t i = 0; i < bits; i++) {
+    if (rbufferGet(&c->inbuf, c->acknr + 2 + i) != NULL)
+      ((uint8_t *)ps->mask)[i / 8] |= 1 << (i % 8);
+  }
+
+  // Print every NAK as "N".
+  tlog(s, LL_RAW | LL_DEBUG, "N");
+
+  ssize_t n = sendData(c, (void *)ps, packetLen);
+  if (s->groupLen)
+    sendto(s->fd, ps, packetLen, 0, (const struct sockaddr *)&s->group,
+           s->groupLen);
+
+  rdpFree(ps);
+
+  return n;
+}
+
+// Hand the other end a fresh ticket when it's due, accepting end only.
+static inline void rdpConnIssueTicket(rdpConn *c) {
+  if (!c->ticketTicker || c->rdpSocket->mstime < c->ticketTicker ||
+      (c->state != CS_CONNECTED && c->state != CS_CONNECTED_FULL &&
+       c->state != CS_HALF_CLOSED))
+    return;
+
+  struct ticket t;
+  t.id = rand();
+  t.issueTime = (uint32_t)time(NULL);
+  // Rounded up, zero would read as not measured.
+  t.rtt = (c->rtt + 999) / 1000;
+  t.rttVar = (c->rttVar + 999) / 1000;
+  t.minRtt = (c->minRtt + 999) / 1000;
+  t.window = c->flightWindowLimit;
+  t.mac = ticketMac(c->rdpSocket, &t);
+
+  // Print every ticket issued as "K".
+  tlog(c->rdpSocket, LL_RAW | LL_DEBUG, "K");
+
+  sendStateExt(c, EXT_TICKET, &t, sizeof(t));
+
+  c->ticketTicker = c->rdpSocket->mstime + RDP_TICKET_INTERVAL;
+}
+
+// ST_RESET packet's connection id should be the sendId of the other end.
+static inline ssize_t sendReset(int fd, const struct sockaddr *dest_addr,
+                                socklen_t addrlen, uint16_t connId) {
+  size_t packetLen;
+  struct packet *p;
+  int n;
+
+  packetLen = getPacketHeaderSize();
+  p = (struct packet *)rdpMalloc(packetLen);
+  assert(p);
+  memset(p, 0, packetLen);
+
+  p->reserve = 0;
+  p->connId = connId;
+
   packetSetVersion(p, 1);
   packetSetType(p, ST_RESET);
 
   n = sendto(fd, p, packetLen, 0, dest_addr, addrlen);
 
-  free(p);
+  rdpFree(p);
 
   return n;
 }
@@ -1156,15 +2562,43 @@ static inline int rdpContextAck(rdpSocket *s) {
   return 0;
 }
 
-// Return -1 if the sending path is full.
+// Whether the trailing fresh packet pw should wait for more data to fill it.
+static inline int rdpConnHoldTail(rdpConn *c, struct packetWrap *pw) {
+  if (pw->payload >= getMaxPacketPayloadSize())
+    return 0;
+
+  if (packetGetType((struct packet *)pw->data) != ST_DATA)
+    return 0;
+
+  // Waited long enough.
+  if (c->flushTicker && c->rdpSocket->ustime >= c->flushTicker)
+    return 0;
+
+  if (c->corked)
+    return 1;
+
+  // Automatic coalescing, only while earlier data is still in flight.
+  return c->coalesceDelay && c->flightWindow > 0;
+}
+
+// Return -1 if the sending path is full. Callers tick the socket clock.
 static inline int rdpConnFlushPackets(rdpConn *c) {
+  int held = 0;
+
   for (uint16_t i = c->seqnr - c->queue; i != c->seqnr; i++) {
     struct packetWrap *pw = rbufferGet(&c->outbuf, i);
     // Fresh packets, and stale packets reached retransmit timeoout will be
     // sent.
-    if (pw == NULL || (pw->transmissions > 0 && pw->needResend == 0))
+    if (pw == NULL || pw->abandoned ||
+        (pw->transmissions > 0 && pw->needResend == 0))
       continue;
 
+    if (i == (uint16_t)(c->seqnr - 1) && pw->transmissions == 0 &&
+        rdpConnHoldTail(c, pw)) {
+      held = 1;
+      break;
+    }
+
     if (rdpConnFlightWindowFull(c)) {
       return -1;
     }
@@ -1172,11 +2606,23 @@ static inline int rdpConnFlushPackets(rdpConn *c) {
     sendPacketWrap(c, pw);
   }
 
+  if (!held) {
+    c->flushTicker = 0;
+  } else if (!c->flushTicker) {
+    c->flushTicker =
+        c->rdpSocket->ustime +
+        (c->corked ? (uint64_t)c->corkDelay * 1000 : c->coalesceDelay);
+    rdpSocketWakeAt(c->rdpSocket, c->flushTicker);
+  }
+
   return 0;
 }
 
+// Packets built with a non zero deadline, in milliseconds, are given up once
+// it's passed.
 static inline void buildSendPacket(rdpConn *c, size_t payload, uint type,
-                                   struct rdpVec *vec, size_t vecCnt) {
+                                   struct rdpVec *vec, size_t vecCnt,
+                                   uint64_t deadline) {
   assert(c->queue > 0 || (c->queue == 0 && c->flightWindow == 0));
 
   size_t maxPacketPayloadSize = getMaxPacketPayloadSize();
@@ -1196,12 +2642,14 @@ static inline void buildSendPacket(rdpConn *c, size_t payload, uint type,
     size_t roundPayload = 0;
     int appendQueue;
 
-    if (payload && pw && !pw->transmissions &&
-        pw->payload < maxPacketPayloadSize) {
+    // Packets carrying extensions are never appended to.
+    if (payload && pw && !pw->transmissions && !pw->map &&
+        ((struct packet *)pw->data)->reserve == EXT_NONE &&
+        pw->deadline == deadline && pw->payload < maxPacketPayloadSize) {
       roundPayload =
           min(payload + pw->payload, maxPacketPayloadSize) - pw->payload;
 
-      pw = (struct packetWrap *)realloc(pw, (packetWrapSize - 1) +
+      pw = (struct packetWrap *)rdpRealloc(pw, (packetWrapSize - 1) +
                                                 packetHeaderSize + pw->payload +
                                                 roundPayload);
       assert(pw);
@@ -1211,12 +2659,18 @@ static inline void buildSendPacket(rdpConn *c, size_t payload, uint type,
       appendQueue = 0;
     } else {
       roundPayload = payload;
-      pw = (struct packetWrap *)malloc((packetWrapSize - 1) + packetHeaderSize +
+      pw = (struct packetWrap *)rdpMalloc((packetWrapSize - 1) + packetHeaderSize +
                                        roundPayload);
       assert(pw);
       pw->payload = 0;
       pw->transmissions = 0;
       pw->needResend = 0;
+      pw->abandoned = 0;
+      pw->deadline = deadline;
+      pw->map = NULL;
+
+      if (deadline)
+        c->expiringCnt++;
 
       appendQueue = 1;
     }
@@ -1244,6 +2698,7 @@ static inline void buildSendPacket(rdpConn *c, size_t payload, uint type,
       assert(needed == 0);
     }
     pw->payload += roundPayload;
+    c->queuedBytes += roundPayload;
 
     struct packet *p = (struct packet *)pw->data;
     packetSetVersion(p, 1);
@@ -1265,28 +2720,62 @@ static inline void buildSendPacket(rdpConn *c, size_t payload, uint type,
   } while (payload);
 }
 
-// CS_CONNECTED -> CS_CONNECTED_FULL can happen in this function only.
-static inline ssize_t rdpWriteVec(rdpConn *c, struct rdpVec *vec,
-                                  size_t vecCnt) {
-  if (!c) {
-    errno = EINVAL;
-    return -1;
-  }
+// Queue a fresh ST_DATA packet carrying exts in front of its payload.
+static inline struct packetWrap *buildExtPacket(rdpConn *c,
+                                                const struct packetExt *exts,
+                                                size_t extCnt,
+                                                const void *data, size_t len) {
+  assert(c->queue < RDP_QUEUE_SIZE_MAX);
+  assert(extCnt > 0);
 
-  if (!vec) {
-    errno = EINVAL;
-    return -1;
-  }
+  const size_t packetHeaderSize = getPacketHeaderSize();
+  const size_t payload = getExtsSize(exts, extCnt) + len;
 
-  if (!vecCnt) {
-    errno = EINVAL;
-    return -1;
+  assert(payload <= getMaxPacketPayloadSize());
+
+  struct packetWrap *pw = (struct packetWrap *)rdpMalloc(
+      (getPacketWrapSize() - 1) + packetHeaderSize + payload);
+  assert(pw);
+  pw->payload = payload;
+  pw->transmissions = 0;
+  pw->needResend = 0;
+  pw->abandoned = 0;
+  pw->deadline = 0;
+  pw->map = NULL;
+
+  struct packet *p = (struct packet *)pw->data;
+  memset(p, 0, packetHeaderSize);
+  packetSetVersion(p, 1);
+  packetSetType(p, ST_DATA);
+  p->reserve = exts[0].type;
+  p->connId = c->sendId;
+  p->window = c->recvWindowSelf;
+  p->acknr = c->acknr;
+  p->seqnr = c->seqnr;
+
+  uint8_t *cur = pw->data + packetHeaderSize;
+  for (size_t i = 0; i < extCnt; i++) {
+    cur[0] = i + 1 < extCnt ? exts[i + 1].type : EXT_NONE;
+    cur[1] = exts[i].len;
+    memcpy(cur + 2, exts[i].data, exts[i].len);
+    cur += 2 + exts[i].len;
   }
+  memcpy(cur, data, len);
 
-  if (vecCnt > RDP_MAX_VEC) {
-    tlog(c->rdpSocket, LL_DEBUG, "vecCnt: %d exceeded RDP_MAX_VEC: %d", vecCnt,
-         RDP_MAX_VEC);
+  rbufferEnsureSize(&c->outbuf, c->seqnr, c->queue);
+  rbufferPut(&c->outbuf, c->seqnr, pw);
+  c->seqnr++;
+  c->queue++;
+  c->queuedBytes += pw->payload;
 
+  return pw;
+}
+
+// Return 0 if user data can be queued on this connection, otherwise -1 with
+// errno set.
+static inline int rdpConnCheckWritable(rdpConn *c) {
+  // Members only receive.
+  if (c->groupMember) {
     errno = EINVAL;
     return -1;
   }
@@ -1302,6 +2791,13 @@ static inline ssize_t rdpWriteVec(rdpConn *c, struct rdpVec *vec,
 
     errno = EINVAL;
     return -1;
+  case CS_HALF_CLOSED:
+    errno = EPIPE;
+    return -1;
+  case CS_RESET:
+    // Submissions might still come for it.
+    errno = ECONNRESET;
+    return -1;
   case CS_SYN_SENT:
   case CS_CONNECTED_FULL:
 
@@ -1316,20 +2812,67 @@ static inline ssize_t rdpWriteVec(rdpConn *c, struct rdpVec *vec,
     assert(0);
   }
 
-  size_t total = 0;
-  size_t sent = 0;
-  for (size_t i = 0; i < vecCnt; i++)
-    total += vec[i].len;
-
-  if (rdpConnFlightWindowFull(c)) {
+  if (rdpConnSendFull(c)) {
     connStateSwitch(c, CS_CONNECTED_FULL);
 
     errno = EAGAIN;
     return -1;
   }
 
-  c->rdpSocket->mstime = mstime();
+  return 0;
+}
+
+// Send what the flight window lets out, then hold back writes by
+// CS_CONNECTED_FULL if c takes no more.
+static inline void rdpConnFlushWrites(rdpConn *c) {
+  rdpConnFlushPackets(c);
+
+  if (c->state == CS_CONNECTED && rdpConnSendFull(c))
+    connStateSwitch(c, CS_CONNECTED_FULL);
+}
+
+// CS_CONNECTED -> CS_CONNECTED_FULL can happen in this function only.
+// ttl is in milliseconds, zero means the data is never given up.
+static inline ssize_t rdpWriteVec(rdpConn *c, struct rdpVec *vec,
+                                  size_t vecCnt, uint32_t ttl) {
+  if (!c) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!vec) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!vecCnt) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (vecCnt > RDP_MAX_VEC) {
+    tlog(c->rdpSocket, LL_DEBUG, "vecCnt: %d exceeded RDP_MAX_VEC: %d", vecCnt,
+         RDP_MAX_VEC);
+
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (rdpConnCheckWritable(c) == -1)
+    return -1;
+
+  size_t total = 0;
+  size_t sent = 0;
+  for (size_t i = 0; i < vecCnt; i++)
+    total += vec[i].len;
+
+  // Up to the high watermark only.
+  if (c->sendHighWater)
+    total = min(total, c->sendHighWater - c->queuedBytes);
+
+  rdpSocketTick(c->rdpSocket);
 
+  uint64_t deadline = ttl ? c->rdpSocket->mstime + ttl : 0;
   size_t maxPacketPayloadSize = getMaxPacketPayloadSize();
   size_t validSend = min(total, maxPacketPayloadSize);
   // Reserve a slot for ST_FIN.
@@ -1337,7 +2880,7 @@ static inline ssize_t rdpWriteVec(rdpConn *c, struct rdpVec *vec,
     total -= validSend;
     sent += validSend;
 
-    buildSendPacket(c, validSend, ST_DATA, vec, vecCnt);
+    buildSendPacket(c, validSend, ST_DATA, vec, vecCnt, deadline);
 
     validSend = min(total, maxPacketPayloadSize);
 
@@ -1347,9 +2890,7 @@ static inline ssize_t rdpWriteVec(rdpConn *c, struct rdpVec *vec,
     }
   }
 
-  if (rdpConnFlushPackets(c) == -1) {
-    connStateSwitch(c, CS_CONNECTED_FULL);
-  }
+  rdpConnFlushWrites(c);
 
   if (sent == 0) {
     if (total == 0) {
@@ -1365,334 +2906,1896 @@ static inline ssize_t rdpWriteVec(rdpConn *c, struct rdpVec *vec,
 
 ssize_t rdpWrite(rdpConn *c, const void *buf, size_t len) {
   struct rdpVec vec = {buf, len};
-  return rdpWriteVec(c, &vec, 1);
+  return rdpWriteVec(c, &vec, 1, 0);
 }
 
-// Change rdpConn state accordingly, the actual free is done by
-// rdpConnDestroy() in rdpIntervalAction() later.
-int rdpConnClose(rdpConn *c) {
-  if (!c) {
+ssize_t rdpWriteTtl(rdpConn *c, const void *buf, size_t len, uint32_t ttl) {
+  struct rdpVec vec = {buf, len};
+  return rdpWriteVec(c, &vec, 1, ttl);
+}
+
+// Packets only hold the header, their payload stays in the page cache and is
+// read from the mapping again on every transmission.
+ssize_t rdpSendFile(rdpConn *c, int fd, off_t offset, size_t len) {
+  if (!c || fd < 0 || offset < 0) {
     errno = EINVAL;
     return -1;
   }
 
-  switch (c->state) {
-  case CS_UNINITIALIZED:
-  // Haven't return the connection the user, can't be called here.
-  case CS_SYN_RECV:
-  // Haven't return the connection the user, can't be called here.
-  case CS_DESTROY:
-  // todo after received ST_RESET, call this function.
-  case CS_FIN_SENT:
-    // Already called this function.
-    tlog(c->rdpSocket, LL_DEBUG, "not expected conn state. errInfo: %s",
-         connStateNames[c->state]);
-    errno = EINVAL;
+  if (rdpConnCheckWritable(c) == -1)
     return -1;
-  case CS_CONNECTED:
-  case CS_CONNECTED_FULL:
 
-    // Passive close.
-    if (c->receivedFin) {
-      connStateSwitch(c, CS_DESTROY);
+  // Pages mapped past the end of the file can't be sent, up to it only.
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return -1;
+  if ((uint64_t)offset > (uint64_t)st.st_size) {
+    errno = EINVAL;
+    return -1;
+  }
+  len = min(len, (uint64_t)st.st_size - (uint64_t)offset);
 
-      tlog(c->rdpSocket, LL_DEBUG,
-           "change state to CS_DESTROY, passive close receivedFin.");
+  if (len == 0)
+    return 0;
 
-      return 0;
-    }
+  const size_t maxPacketPayloadSize = getMaxPacketPayloadSize();
+  const size_t packetHeaderSize = getPacketHeaderSize();
 
-    // One slot is reserved for ST_FIN, see rdpWriteVec().
-    assert(c->queue < RDP_QUEUE_SIZE_MAX);
-    buildSendPacket(c, 0, ST_FIN, NULL, 0);
-    rdpConnFlushPackets(c);
+  // Reserve a slot for ST_FIN.
+  size_t room = RDP_QUEUE_SIZE_MAX - 1 - c->queue;
+  if (room == 0) {
+    rdpConnFlushWrites(c);
 
-    connStateSwitch(c, CS_FIN_SENT);
+    errno = EAGAIN;
+    return -1;
+  }
+  len = min(len, room * maxPacketPayloadSize);
+  if (c->sendHighWater)
+    len = min(len, c->sendHighWater - c->queuedBytes);
+
+  // mmap() wants a page aligned offset.
+  size_t skip = offset % sysconf(_SC_PAGESIZE);
+  struct fileMap *map = rdpMalloc(sizeof(struct fileMap));
+  if (!map) {
+    errno = ENOMEM;
+    return -1;
+  }
 
-    return 0;
-  case CS_SYN_SENT:
-    connStateSwitch(c, CS_DESTROY);
-    tlog(c->rdpSocket, LL_DEBUG,
-         "change state to CS_DESTROY, invoked rdpConnClose() on CS_SYN_SENT.");
-    return 0;
-  case CS_RESET:
-    connStateSwitch(c, CS_DESTROY);
-    return 0;
-  default:
-    dprintf(2, "state: %s", c->state);
-    assert(0);
+  map->len = skip + len;
+  map->refs = 0;
+  map->addr =
+      mmap(NULL, map->len, PROT_READ, MAP_SHARED, fd, offset - (off_t)skip);
+  if (map->addr == MAP_FAILED) {
+    int err = errno;
+    rdpFree(map);
+    errno = err;
+    return -1;
   }
 
-  return 0;
-}
+  rdpSocketTick(c->rdpSocket);
 
-static inline int selectiveAck(rdpConn *c, uint32_t startSeqnr,
-                               const uint8_t *mask, uint8_t len) {
-  int offset = len * 8 - 1;
+  const unsigned char *ref = (const unsigned char *)map->addr + skip;
+  size_t sent = 0;
+  while (sent < len) {
+    struct packetWrap *pw = (struct packetWrap *)rdpMalloc(
+        (getPacketWrapSize() - 1) + packetHeaderSize);
+    assert(pw);
+    pw->payload = min(len - sent, maxPacketPayloadSize);
+    pw->transmissions = 0;
+    pw->needResend = 0;
+    pw->abandoned = 0;
+    pw->deadline = 0;
+    pw->map = map;
+    pw->ref = ref + sent;
+    map->refs++;
 
-  do {
-    uint16_t curSeqnr = startSeqnr + offset;
+    struct packet *p = (struct packet *)pw->data;
+    memset(p, 0, packetHeaderSize);
+    packetSetVersion(p, 1);
+    packetSetType(p, ST_DATA);
+    p->reserve = EXT_NONE;
+    p->connId = c->sendId;
+    p->window = c->recvWindowSelf;
+    p->acknr = c->acknr;
+    p->seqnr = c->seqnr;
 
-    if (((c->seqnr - curSeqnr - 1) & RDP_ACK_NR_MASK) >=
-        (uint16_t)(c->queue - 1))
-      continue;
+    rbufferEnsureSize(&c->outbuf, c->seqnr, c->queue);
+    rbufferPut(&c->outbuf, c->seqnr, pw);
+    c->seqnr++;
+    c->queue++;
+    c->queuedBytes += pw->payload;
 
-    int b = mask[offset >> 3] & (1 << (offset & 7));
-    if (!b)
-      continue;
+    sent += pw->payload;
+  }
 
-    struct packetWrap *pw =
-        (struct packetWrap *)rbufferGet(&c->outbuf, curSeqnr);
-    if (!pw) {
-      continue;
-    }
+  rdpConnFlushWrites(c);
 
-    if (pw->transmissions == 0) {
+  return sent;
+}
 
-#ifdef RDP_DEBUG
-      char bitmask[4096] = {0};
-      int counter = offset;
-      for (int i = 0; i <= offset; ++i) {
-        uint8_t b = counter >= 0 && mask[counter >> 3] & (1 << (counter & 7));
-        bitmask[i] = b ? '1' : '0';
-        --counter;
-      }
+// Stream data goes into EXT_STREAM packets, each taking the next stream seqnr.
+// The last one is topped up instead while it's unsent.
+ssize_t rdpStreamWrite(rdpConn *c, uint16_t streamId, const void *buf,
+                       size_t len) {
+  if (!c || !buf || !streamId || streamId >= RDP_STREAM_ID_RESERVED) {
+    errno = EINVAL;
+    return -1;
+  }
 
-      tlog(c->rdpSocket, LL_DEBUG | LL_RAW, "sack bits:\n%s\n", bitmask,
-           startSeqnr);
+  if (rdpConnCheckWritable(c) == -1)
+    return -1;
 
-      tlog(c->rdpSocket, LL_DEBUG, "startSeqnr: %u, len: %d", startSeqnr, len);
-#endif
+  struct rdpStream *st = rdpConnGetStream(c, streamId, 1);
+  if (!st) {
+    errno = ENOBUFS;
+    return -1;
+  }
 
-      assert(0);
-      continue;
-    }
+  if (c->sendHighWater)
+    len = min(len, c->sendHighWater - c->queuedBytes);
 
-    assert((curSeqnr & c->outbuf.mask) !=
-           ((c->seqnr - c->queue) & c->outbuf.mask));
+  rdpSocketTick(c->rdpSocket);
 
-    ackPacket(c, curSeqnr);
+  const unsigned char *data = (const unsigned char *)buf;
+  const size_t maxPacketPayloadSize = getMaxPacketPayloadSize();
+  const size_t packetHeaderSize = getPacketHeaderSize();
+  size_t sent = 0;
 
-    continue;
-  } while (--offset >= 0);
+  struct packetWrap *pw = NULL;
+  if (c->queue > 0) {
+    pw = (struct packetWrap *)rbufferGet(&c->outbuf, c->seqnr - 1);
+  }
 
-  return 0;
+  if (pw && !pw->transmissions && pw->payload < maxPacketPayloadSize &&
+      ((struct packet *)pw->data)->reserve == EXT_STREAM) {
+    const uint8_t *ext = pw->data + packetHeaderSize;
+    struct streamExt se;
+    memcpy(&se, ext + 2, sizeof(se));
+
+    if (ext[0] == EXT_NONE && se.id == streamId) {
+      size_t n = min(len, maxPacketPayloadSize - pw->payload);
+
+      pw = (struct packetWrap *)rdpRealloc(pw, (getPacketWrapSize() - 1) +
+                                                packetHeaderSize +
+                                                pw->payload + n);
+      assert(pw);
+      rbufferPut(&c->outbuf, c->seqnr - 1, pw);
+
+      memcpy(pw->data + packetHeaderSize + pw->payload, data, n);
+      pw->payload += n;
+      c->queuedBytes += n;
+      sent += n;
+    }
+  }
+
+  struct streamExt se;
+  struct packetExt ext = {EXT_STREAM, sizeof(se), &se};
+  const size_t streamPayloadSize =
+      maxPacketPayloadSize - getExtsSize(&ext, 1);
+
+  // Reserve a slot for ST_FIN.
+  while (sent < len && c->queue < RDP_QUEUE_SIZE_MAX - 1) {
+    size_t n = min(len - sent, streamPayloadSize);
+
+    se.id = streamId;
+    se.seqnr = st->sendSeqnr++;
+    buildExtPacket(c, &ext, 1, data + sent, n);
+
+    sent += n;
+  }
+
+  rdpConnFlushWrites(c);
+
+  if (sent == 0 && len > 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return sent;
 }
 
-// buf and len are similar to read().
-// The corresponding rdpConn is returned by parameter c(connection).
-// Result type is returned by parameter events.
-//
-// CS_CONNECTED_FULL -> CS_CONNECTED can happen in this function only.
-ssize_t rdpReadPoll(rdpSocket *s, void *buf, size_t len, rdpConn **conn,
-                    int *events) {
-  if (!events) {
+// The range is mapped shared, data lands in the page cache and is written back
+// by the kernel. See struct rdpSink for where held packets go.
+int rdpConnSetSink(rdpConn *c, int fd, off_t offset, size_t len) {
+  if (!c || c->splice || (fd >= 0 && (offset < 0 || len == 0))) {
+    errno = EINVAL;
     return -1;
   }
-  // This is the default events returns;
-  *events = RDP_CONTINUE;
 
-  if (!conn) {
-    *events = RDP_ERROR;
+  rdpConnSinkClose(c, 1);
+
+  if (fd < 0)
+    return 0;
+
+  // Writing past the end of the file raises SIGBUS.
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return -1;
+  if ((uint64_t)st.st_size < (uint64_t)offset + len) {
+    errno = EINVAL;
     return -1;
   }
-  *conn = NULL;
 
-  if (!s) {
-    *events = RDP_ERROR;
+  struct rdpSink *sk = rdpMalloc(sizeof(struct rdpSink));
+  if (!sk) {
+    errno = ENOMEM;
     return -1;
   }
 
-  if (!buf) {
-    *events = RDP_ERROR;
+  // mmap() wants a page aligned offset.
+  size_t skip = offset % sysconf(_SC_PAGESIZE);
+  sk->mapLen = skip + len;
+  sk->map = mmap(NULL, sk->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 offset - (off_t)skip);
+  if (sk->map == MAP_FAILED) {
+    int err = errno;
+    rdpFree(sk);
+    errno = err;
     return -1;
   }
 
-  if (len <= 0) {
-    *events = RDP_ERROR;
+  sk->base = sk->map + skip;
+  sk->len = len;
+  sk->pos = 0;
+  sk->reported = 0;
+  sk->held = 0;
+  sk->top = 0;
+  c->sink = sk;
+  c->sinkProgress = 0;
+
+  return 0;
+}
+
+size_t rdpConnGetSinkProgress(rdpConn *c) {
+  assert(c);
+
+  return c->sinkProgress;
+}
+
+uint16_t rdpConnGetStreamId(rdpConn *c) {
+  assert(c);
+
+  return c->lastStreamId;
+}
+
+// Whether a datagram of len fits the budget of this RTT. Datagrams are never
+// acked, so rather than the flight window they get a window's worth per RTT,
+// at least one of them.
+static inline int rdpConnDatagramRoom(rdpConn *c, size_t len) {
+  uint64_t now = c->rdpSocket->ustime;
+  uint32_t rtt = c->rtt ? c->rtt : c->nextRetransmitTimeout;
+
+  if (now >= c->datagramEpoch + rtt) {
+    c->datagramEpoch = now;
+    c->datagramBytes = 0;
+  }
+
+  return !c->datagramBytes ||
+         c->datagramBytes + len <= min(c->flightWindowLimit, c->recvWindowPeer);
+}
+
+// Send buf in a single ST_DATAGRAM right away, from buf itself. It never
+// enters outbuf, so the reliable queue doesn't hold it up, only its own
+// budget does.
+ssize_t rdpSendDatagram(rdpConn *c, const void *buf, size_t len) {
+  if (!c || !buf || !len) {
+    errno = EINVAL;
     return -1;
   }
 
-  struct sockaddr_storage addr;
-  socklen_t addrlen = sizeof(addr);
-  ssize_t read;
-  ssize_t rawRead;
-  uint inbufPrefix;
+  if (len > getMaxPacketPayloadSize()) {
+    errno = EMSGSIZE;
+    return -1;
+  }
 
-  dictEntry *e;
+  switch (c->state) {
+  case CS_CONNECTED:
+  case CS_CONNECTED_FULL:
+    break;
+  case CS_SYN_SENT:
+    errno = EAGAIN;
+    return -1;
+  case CS_HALF_CLOSED:
+    errno = EPIPE;
+    return -1;
+  case CS_RESET:
+    errno = ECONNRESET;
+    return -1;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
 
-  // Check every connection, see if there is any data we can send to user
-  // based on the connection acknr. Drain it if there is.
-  while (e = dictIteratorNext(s->connsIter)) {
-    *conn = (rdpConn *)dictKeyGet(e);
+  if (c->groupMember) {
+    errno = EINVAL;
+    return -1;
+  }
 
-    if ((*conn)->state != CS_CONNECTED && (*conn)->state != CS_CONNECTED_FULL) {
-      continue;
-    }
+  rdpSocketTick(c->rdpSocket);
 
-    // receivedFin and eofseqnr are related fields.
-    if (!(*conn)->receivedFinCompleted && (*conn)->receivedFin &&
-        (*conn)->eofseqnr == (*conn)->acknr) {
-      // Received all packets the other end sent.
-      (*conn)->receivedFinCompleted = 1;
+  if (!rdpConnDatagramRoom(c, len)) {
+    errno = EAGAIN;
+    return -1;
+  }
 
-      assert((*conn)->outOfOrderCnt == 0);
+  struct packet p;
+  memset(&p, 0, sizeof(p));
+  packetSetVersion(&p, 1);
+  packetSetType(&p, ST_DATAGRAM);
+  p.reserve = EXT_NONE;
+  p.connId = c->sendId;
+  p.window = c->recvWindowSelf;
+  p.seqnr = c->seqnr;
+  p.acknr = c->acknr;
+
+  struct iovec iov[2] = {{&p, sizeof(p)}, {(void *)buf, len}};
+  struct msghdr msg = {0};
+
+  msg.msg_name = &c->addr;
+  msg.msg_namelen = c->addrlen;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  tlog(c->rdpSocket, LL_RAW | LL_DEBUG, "G");
+
+  sendPrepare(c, &p);
+  if (sendmsg(c->rdpSocket->fd, &msg, 0) == -1)
+    return -1;
 
-      tlog(s, LL_DEBUG, "receivedFinCompleted, sendAck");
+  c->datagramBytes += len;
 
-      sendAck(*conn);
+  return len;
+}
 
-      if (dictIteratorRewind(s->connsIter) != 0) {
-        assert(0);
-      }
+// Queue the whole message or nothing, one EXT_MESSAGE packet per fragment.
+ssize_t rdpSendMsg(rdpConn *c, const void *buf, size_t len) {
+  if (!c || !buf || !len) {
+    errno = EINVAL;
+    return -1;
+  }
 
-      *events = RDP_DATA;
+  if (len > RDP_MESSAGE_SIZE_MAX) {
+    errno = EMSGSIZE;
+    return -1;
+  }
 
-      // EOF
-      return 0;
-    }
+  if (rdpConnCheckWritable(c) == -1)
+    return -1;
 
-    if ((*conn)->outOfOrderCnt == 0)
-      continue;
+  uint8_t flags = MSG_FRAGMENT;
+  struct packetExt ext = {EXT_MESSAGE, 1, &flags};
+  const size_t fragmentSize = getMaxPacketPayloadSize() - getExtsSize(&ext, 1);
+  const size_t fragments = (len + fragmentSize - 1) / fragmentSize;
 
-    // We have some out of order packet in buffer, send the right next packet
-    // if there is.
-    uint8_t *packetWithPrefix =
-        (uint8_t *)rbufferGet(&(*conn)->inbuf, (*conn)->acknr + 1);
-    if (packetWithPrefix == NULL) {
-      // Don't have buffer to send.
-      continue;
-    }
+  // Reserve a slot for ST_FIN.
+  if (c->queue + fragments > RDP_QUEUE_SIZE_MAX - 1) {
+    errno = EAGAIN;
+    return -1;
+  }
 
-    // Get the payload size of the packet to be returned to user.
-    inbufPrefix = *(uint *)packetWithPrefix;
-    if (inbufPrefix > 0) {
-      if (inbufPrefix > len) {
-        *events = RDP_ERROR;
-        tlog(s, LL_NOTICE, "user supplied len is not enough.");
+  rdpSocketTick(c->rdpSocket);
 
-        if (dictIteratorRewind(s->connsIter) != 0) {
-          assert(0);
-        }
+  const unsigned char *data = (const unsigned char *)buf;
+  for (size_t i = 0; i < fragments; i++) {
+    flags = MSG_FRAGMENT;
+    if (i == 0)
+      flags |= MSG_FIRST;
+    if (i == fragments - 1)
+      flags |= MSG_LAST;
 
-        return -1;
-      }
+    buildExtPacket(c, &ext, 1, data + i * fragmentSize,
+                   min(len - i * fragmentSize, fragmentSize));
+  }
 
-      memcpy(buf, packetWithPrefix + sizeof(uint), inbufPrefix);
+  rdpConnFlushWrites(c);
 
-      *events = RDP_DATA;
-    }
+  return len;
+}
 
-    free(packetWithPrefix);
-    (*conn)->acknr++;
-    rbufferPut(&(*conn)->inbuf, (*conn)->acknr, NULL);
+// Queue buf as a message on the rdpCall() stream of the call id, led by a
+// callHeader. Packets not acked by deadline are given up, see rdpWriteTtl().
+static inline int sendCallMsg(rdpConn *c, uint32_t id, uint8_t kind,
+                              const void *buf, size_t len, uint64_t deadline) {
+  struct rdpStream *st =
+      rdpConnGetStream(c, RDP_STREAM_ID_RESERVED + id % RDP_RPC_LANES, 1);
+  if (!st) {
+    errno = ENOBUFS;
+    return -1;
+  }
 
-    // acknr proceeded, should notify the other end.
-    (*conn)->needSendAck = 1;
+  struct streamExt se;
+  uint8_t flags;
+  struct packetExt exts[2] = {{EXT_STREAM, sizeof(se), &se},
+                              {EXT_MESSAGE, 1, &flags}};
+  struct callHeader h = {id, kind};
+  const size_t total = sizeof(h) + len;
+  const size_t fragmentSize = getMaxPacketPayloadSize() - getExtsSize(exts, 2);
+  const size_t fragments = (total + fragmentSize - 1) / fragmentSize;
 
-    (*conn)->outOfOrderCnt--;
+  // Reserve a slot for ST_FIN.
+  if (c->queue + fragments > RDP_QUEUE_SIZE_MAX - 1) {
+    errno = EAGAIN;
+    return -1;
+  }
 
-    // Might still have out of order packets in input buffer.
-    assert((*conn)->outOfOrderCnt >= 0);
+  unsigned char *data = (unsigned char *)rdpMalloc(total);
+  assert(data);
+  memcpy(data, &h, sizeof(h));
+  memcpy(data + sizeof(h), buf, len);
 
-    if (dictIteratorRewind(s->connsIter) != 0) {
-      assert(0);
+  for (size_t i = 0; i < fragments; i++) {
+    se.id = st->id;
+    se.seqnr = st->sendSeqnr++;
+    flags = MSG_FRAGMENT;
+    if (i == 0)
+      flags |= MSG_FIRST;
+    if (i == fragments - 1)
+      flags |= MSG_LAST;
+
+    struct packetWrap *pw =
+        buildExtPacket(c, exts, 2, data + i * fragmentSize,
+                       min(total - i * fragmentSize, fragmentSize));
+    if (deadline) {
+      pw->deadline = deadline;
+      c->expiringCnt++;
     }
+  }
+
+  rdpFree(data);
+
+  rdpConnFlushWrites(c);
 
-    return inbufPrefix > 0 ? inbufPrefix : -1;
+  return 0;
+}
+
+int rdpCall(rdpConn *c, const void *req, size_t len, void *cookie,
+            uint32_t timeout) {
+  if (!c || !req || !len) {
+    errno = EINVAL;
+    return -1;
   }
-  if (dictIteratorRewind(s->connsIter) != 0) {
-    assert(0);
+
+  if (len > RDP_MESSAGE_SIZE_MAX - sizeof(struct callHeader)) {
+    errno = EMSGSIZE;
+    return -1;
   }
-  *conn = NULL;
 
-  // Read from socket only after drained ordered buffer in queue.
-  rawRead = recvfrom(s->fd, buf, len, 0, (struct sockaddr *)&addr, &addrlen);
-  if (rawRead == -1) {
-    if (errno == EAGAIN) {
-      *events = RDP_AGAIN;
+  if (rdpConnCheckWritable(c) == -1)
+    return -1;
 
-      rdpContextAck(s);
-    } else {
-      *events = RDP_ERROR;
+  rdpSocketTick(c->rdpSocket);
 
-      tlog(s, LL_DEBUG, "recvfrom error");
-    }
+  uint64_t deadline = timeout ? c->rdpSocket->mstime + timeout : 0;
+  uint32_t id = c->nextCallId++;
 
+  if (sendCallMsg(c, id, CALL_REQUEST, req, len, deadline) == -1)
     return -1;
+
+  if (!c->calls) {
+    c->calls = dictCreate(&pendingCallDictType);
+    assert(c->calls);
+
+    c->callsIter = dictIteratorCreate(c->calls);
+    assert(c->callsIter);
   }
 
-  if (rawRead < getPacketHeaderSize()) {
+  struct pendingCall *pc = (struct pendingCall *)rdpMalloc(sizeof(*pc));
+  assert(pc);
+  pc->id = id;
+  pc->cookie = cookie;
+  pc->deadline = deadline;
+
+  int n = dictAdd(c->calls, pc, NULL);
+  assert(n == 0);
+
+  if (deadline && (c->callDeadline == 0 || deadline < c->callDeadline))
+    c->callDeadline = deadline;
+
+  return 0;
+}
+
+int rdpReply(rdpConn *c, uint32_t callId, const void *buf, size_t len) {
+  if (!c || !buf || !len) {
+    errno = EINVAL;
     return -1;
   }
 
-  const struct packet *p = (struct packet *)buf;
-  const uint8_t version = packetGetVersion(p);
-  if (version != 1) {
+  if (len > RDP_MESSAGE_SIZE_MAX - sizeof(struct callHeader)) {
+    errno = EMSGSIZE;
     return -1;
   }
 
-  const uint16_t connId = p->connId;
-  const uint8_t type = packetGetType(p);
-  const uint16_t pseqnr = p->seqnr;
-  const uint16_t packnr = p->acknr;
+  if (rdpConnCheckWritable(c) == -1)
+    return -1;
 
-  s->mstime = mstime();
+  rdpSocketTick(c->rdpSocket);
 
-  tlog(s, LL_RAW | LL_DEBUG, "%s", packetStateAbbrNamesLower[type]);
+  return sendCallMsg(c, callId, CALL_REPLY, buf, len, 0);
+}
 
-  if (type == ST_SYN) {
-    *conn = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr, addrlen,
-                                   connId + 1);
-    if (*conn) {
-      if ((*conn)->state != CS_SYN_RECV) {
-        return -1;
-      }
-    } else {
-      if (dictFilled(s->conns) > RDP_MAX_CONNS_PER_RDPSOCKET) {
-        *events = RDP_ERROR;
-        return -1;
-      }
+uint32_t rdpConnGetCallId(rdpConn *c) {
+  assert(c);
 
-      *conn = rdpConnCreate(s);
-      rdpConnInit(*conn, (const struct sockaddr *)&addr, addrlen, 0, connId,
-                  connId + 1, connId);
-      connStateSwitch((*conn), CS_SYN_RECV);
+  return c->lastCallId;
+}
 
-      (*conn)->acknr = pseqnr;
-    }
+void *rdpConnGetCookie(rdpConn *c) {
+  assert(c);
 
-    (*conn)->lastReceivePacketTime = (*conn)->rdpSocket->mstime;
-    (*conn)->retransmitTimeout = (*conn)->nextRetransmitTimeout;
-    (*conn)->retransmitTicker =
-        (*conn)->rdpSocket->mstime + (*conn)->retransmitTimeout;
+  return c->lastCookie;
+}
 
-    sendAck(*conn);
+int rdpConnCork(rdpConn *c) {
+  if (!c) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  c->corked = 1;
+
+  return 0;
+}
 
+// Send what's been held, flight window allowing.
+int rdpConnUncork(rdpConn *c) {
+  if (!c) {
+    errno = EINVAL;
     return -1;
-  } else if (type == ST_STATE || type == ST_DATA || type == ST_FIN ||
-             type == ST_RESET) {
-    *conn = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr, addrlen,
-                                   connId);
+  }
 
-    if (!*conn) {
-      if (type != ST_RESET) {
-        // Unindentified packet, send back a ST_RESET packet with the original
-        // connection id, aka, the sender's sendId.
+  c->corked = 0;
 
-        tlog(s, LL_RAW | LL_DEBUG, "R");
+  if (c->state != CS_CONNECTED && c->state != CS_CONNECTED_FULL)
+    return 0;
 
-        sendReset(s->fd, (const struct sockaddr *)&addr, addrlen, connId);
-      } else {
-        // Got a ST_RESET, it's connection id should equal our sendId.
-        // sendId is either 1 more than recvId, otherwise 1 less.
-        if (((*conn = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr,
-                                             addrlen, connId + 1)) &&
-             ((*conn)->sendId == connId)) ||
-            ((*conn = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr,
-                                             addrlen, connId - 1)) &&
-             ((*conn)->sendId == connId))) {
-          switch ((*conn)->state) {
+  rdpSocketTick(c->rdpSocket);
+
+  rdpConnFlushWrites(c);
+
+  return 0;
+}
+
+// Change rdpConn state accordingly, the actual free is done by
+// rdpConnDestroy() in rdpIntervalAction() later.
+int rdpConnClose(rdpConn *c) {
+  if (!c) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  switch (c->state) {
+  case CS_UNINITIALIZED:
+  // Haven't return the connection the user, can't be called here.
+  case CS_SYN_RECV:
+  // Haven't return the connection the user, can't be called here.
+  case CS_DESTROY:
+  // todo after received ST_RESET, call this function.
+  case CS_FIN_SENT:
+    // Already called this function.
+    tlog(c->rdpSocket, LL_DEBUG, "not expected conn state. errInfo: %s",
+         connStateNames[c->state]);
+    errno = EINVAL;
+    return -1;
+  case CS_CONNECTED:
+  case CS_CONNECTED_FULL:
+    // Nothing to tell the sender, it doesn't know about members.
+    if (c->groupMember) {
+      connStateSwitch(c, CS_DESTROY);
+      return 0;
+    }
+
+    // Passive close sends ST_FIN as well, the other end might have only shut
+    // down writing and wait for it.
+    rdpSocketTick(c->rdpSocket);
+
+    // One slot is reserved for ST_FIN, see rdpWriteVec().
+    assert(c->queue < RDP_QUEUE_SIZE_MAX);
+    buildSendPacket(c, 0, ST_FIN, NULL, 0, 0);
+    rdpConnFlushPackets(c);
+
+    connStateSwitch(c, CS_FIN_SENT);
+
+    return 0;
+  case CS_HALF_CLOSED:
+    // ST_FIN sent by rdpConnShutdown() is acked, and so is the other end's.
+    if (c->queue == 0 && c->receivedFin) {
+      connStateSwitch(c, CS_DESTROY);
+
+      tlog(c->rdpSocket, LL_DEBUG,
+           "change state to CS_DESTROY, invoked rdpConnClose() on "
+           "CS_HALF_CLOSED.");
+
+      return 0;
+    }
+
+    if (c->queue == 0)
+      c->finAckedTime = c->rdpSocket->mstime;
+    connStateSwitch(c, CS_FIN_SENT);
+
+    return 0;
+  case CS_SYN_SENT:
+    connStateSwitch(c, CS_DESTROY);
+    tlog(c->rdpSocket, LL_DEBUG,
+         "change state to CS_DESTROY, invoked rdpConnClose() on CS_SYN_SENT.");
+    return 0;
+  case CS_RESET:
+    connStateSwitch(c, CS_DESTROY);
+    return 0;
+  default:
+    dprintf(2, "state: %s", c->state);
+    assert(0);
+  }
+
+  return 0;
+}
+
+int rdpConnShutdown(rdpConn *c, int how) {
+  if (!c || how != SHUT_WR) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (c->state != CS_CONNECTED && c->state != CS_CONNECTED_FULL) {
+    tlog(c->rdpSocket, LL_DEBUG, "not expected conn state: %s",
+         connStateNames[c->state]);
+    errno = EINVAL;
+    return -1;
+  }
+
+  rdpSocketTick(c->rdpSocket);
+
+  // One slot is reserved for ST_FIN, see rdpWriteVec().
+  assert(c->queue < RDP_QUEUE_SIZE_MAX);
+  buildSendPacket(c, 0, ST_FIN, NULL, 0, 0);
+  rdpConnFlushPackets(c);
+
+  connStateSwitch(c, CS_HALF_CLOSED);
+
+  return 0;
+}
+
+static inline int selectiveAck(rdpConn *c, uint32_t startSeqnr,
+                               const uint8_t *mask, uint8_t len) {
+  int offset = len * 8 - 1;
+
+  do {
+    uint16_t curSeqnr = startSeqnr + offset;
+
+    if (((c->seqnr - curSeqnr - 1) & RDP_ACK_NR_MASK) >=
+        (uint16_t)(c->queue - 1))
+      continue;
+
+    int b = mask[offset >> 3] & (1 << (offset & 7));
+    if (!b)
+      continue;
+
+    struct packetWrap *pw =
+        (struct packetWrap *)rbufferGet(&c->outbuf, curSeqnr);
+    if (!pw) {
+      continue;
+    }
+
+    if (pw->transmissions == 0) {
+
+#ifdef RDP_DEBUG
+      char bitmask[4096] = {0};
+      int counter = offset;
+      for (int i = 0; i <= offset; ++i) {
+        uint8_t b = counter >= 0 && mask[counter >> 3] & (1 << (counter & 7));
+        bitmask[i] = b ? '1' : '0';
+        --counter;
+      }
+
+      tlog(c->rdpSocket, LL_DEBUG | LL_RAW, "sack bits:\n%s\n", bitmask,
+           startSeqnr);
+
+      tlog(c->rdpSocket, LL_DEBUG, "startSeqnr: %u, len: %d", startSeqnr, len);
+#endif
+
+      assert(0);
+      continue;
+    }
+
+    assert((curSeqnr & c->outbuf.mask) !=
+           ((c->seqnr - c->queue) & c->outbuf.mask));
+
+    ackPacket(c, curSeqnr);
+
+    continue;
+  } while (--offset >= 0);
+
+  return 0;
+}
+
+// Append a message fragment to the connection's reassembly buffer.
+static inline void msgAssemblyAppend(struct msgAssembly *m, uint8_t msgFlags,
+                                     const uint8_t *data, size_t payload) {
+  if (msgFlags & MSG_FIRST) {
+    m->len = 0;
+    m->active = 1;
+  }
+
+  // Fragments of a message whose head we never got are dropped.
+  if (!m->active)
+    return;
+
+  if (m->len + payload > RDP_MESSAGE_SIZE_MAX) {
+    m->active = 0;
+    return;
+  }
+
+  if (m->len + payload > m->cap) {
+    size_t cap = max(m->cap, 4096);
+    while (cap < m->len + payload)
+      cap *= 2;
+
+    m->buf = (unsigned char *)rdpRealloc(m->buf, cap);
+    assert(m->buf);
+    m->cap = cap;
+  }
+
+  memcpy(m->buf + m->len, data, payload);
+  m->len += payload;
+}
+
+// buf can't hold what's next, so it's dropped rather than retried forever.
+static inline ssize_t deliverTooBig(int *events) {
+  *events |= RDP_CONN_ERROR;
+  errno = EMSGSIZE;
+
+  return 0;
+}
+
+// Hand the right next packet to the user. data might point into buf.
+// Message fragments are held in m until MSG_LAST arrives, then the whole
+// message is returned at once; a message in a single packet never leaves buf.
+// Fragments can't be gathered in buf itself, packets of other connections are
+// received into it in between.
+// Return the bytes placed in buf. The packet is consumed either way, one or a
+// message too big for buf is dropped, see deliverTooBig().
+static inline ssize_t deliverPayload(struct msgAssembly *m, uint8_t msgFlags,
+                                     const uint8_t *data, size_t payload,
+                                     void *buf, size_t len, int *events) {
+  if (!(msgFlags & MSG_LAST)) {
+    if (msgFlags) {
+      msgAssemblyAppend(m, msgFlags, data, payload);
+      return 0;
+    }
+
+    if (payload > len)
+      return deliverTooBig(events);
+
+    memmove(buf, data, payload);
+    if (payload > 0)
+      *events |= RDP_DATA;
+
+    return payload;
+  }
+
+  if (msgFlags & MSG_FIRST)
+    m->active = 0;
+  else if (!m->active)
+    return 0;
+
+  size_t prefix = m->active ? m->len : 0;
+  if (prefix + payload > len) {
+    m->active = 0;
+    m->len = 0;
+    return deliverTooBig(events);
+  }
+
+  memmove((unsigned char *)buf + prefix, data, payload);
+  if (prefix)
+    memcpy(buf, m->buf, prefix);
+
+  m->active = 0;
+  m->len = 0;
+
+  *events |= RDP_DATA | RDP_MESSAGE;
+
+  return prefix + payload;
+}
+
+// Strip the callHeader off a message got on a rdpCall() stream. Replies to
+// calls no longer pending, timed out for instance, are dropped.
+static inline ssize_t deliverCall(rdpConn *c, void *buf, size_t n,
+                                  int *events) {
+  struct callHeader h;
+  int isMessage = *events & RDP_MESSAGE;
+
+  *events &= ~(RDP_DATA | RDP_MESSAGE);
+
+  if (!isMessage || n <= sizeof(h))
+    return 0;
+
+  memcpy(&h, buf, sizeof(h));
+
+  if (h.kind == CALL_REPLY) {
+    struct pendingCall comparedValue;
+    dictEntry *e = NULL;
+
+    comparedValue.id = h.id;
+    if (c->calls)
+      e = dictFind(c->calls, &comparedValue);
+    if (!e)
+      return 0;
+
+    c->lastCookie = ((struct pendingCall *)dictKeyGet(e))->cookie;
+    dictEntryDelete(c->calls, &comparedValue, 0);
+
+    *events |= RDP_DATA | RDP_REPLY;
+  } else if (h.kind == CALL_REQUEST) {
+    c->lastCallId = h.id;
+
+    *events |= RDP_DATA | RDP_CALL;
+  } else {
+    return 0;
+  }
+
+  n -= sizeof(h);
+  memmove(buf, (unsigned char *)buf + sizeof(h), n);
+
+  return n;
+}
+
+// Take out a pending call passed its deadline, and find the next deadline.
+// Return 1 if one is taken out, its cookie is left in lastCookie, otherwise 0.
+static inline int rdpConnExpireCall(rdpConn *c, uint64_t now) {
+  struct pendingCall *expired = NULL;
+  uint64_t next = 0;
+  dictEntry *e;
+
+  while (e = dictIteratorNext(c->callsIter)) {
+    struct pendingCall *pc = (struct pendingCall *)dictKeyGet(e);
+
+    if (pc->deadline == 0)
+      continue;
+
+    if (!expired && pc->deadline <= now) {
+      expired = pc;
+      continue;
+    }
+
+    if (next == 0 || pc->deadline < next)
+      next = pc->deadline;
+  }
+  if (dictIteratorRewind(c->callsIter) != 0) {
+    assert(0);
+  }
+
+  c->callDeadline = next;
+
+  if (!expired)
+    return 0;
+
+  c->lastCookie = expired->cookie;
+  dictEntryDelete(c->calls, expired, 0);
+
+  return 1;
+}
+
+// Hand a packet of st to the user, see deliverPayload(). The stream jumps
+// ahead if packets before seqnr were given up by the other end.
+static inline ssize_t deliverStreamPayload(rdpConn *c, struct rdpStream *st,
+                                           uint16_t seqnr, uint8_t msgFlags,
+                                           const uint8_t *data, size_t payload,
+                                           void *buf, size_t len,
+                                           int *events) {
+  if (seqnr != st->recvSeqnr)
+    st->msg.active = 0;
+
+  ssize_t n = deliverPayload(&st->msg, msgFlags, data, payload, buf, len,
+                             events);
+
+  rbufferPut(&st->held, seqnr, NULL);
+  st->recvSeqnr = seqnr + 1;
+
+  if (n > 0 && st->id >= RDP_STREAM_ID_RESERVED) {
+    n = deliverCall(c, buf, n, events);
+  } else if (n > 0) {
+    *events |= RDP_STREAM;
+    c->lastStreamId = st->id;
+  }
+
+  if (rbufferGet(&st->held, st->recvSeqnr))
+    c->streamPending = 1;
+
+  return n;
+}
+
+// Find a held packet its stream is waiting for.
+static inline struct inPacket *rdpConnNextHeld(rdpConn *c,
+                                               struct rdpStream **st) {
+  struct inPacket *ip = NULL;
+  dictEntry *e;
+
+  while (e = dictIteratorNext(c->streamsIter)) {
+    *st = (struct rdpStream *)dictKeyGet(e);
+
+    ip = (struct inPacket *)rbufferGet(&(*st)->held, (*st)->recvSeqnr);
+    if (ip)
+      break;
+  }
+  if (dictIteratorRewind(c->streamsIter) != 0) {
+    assert(0);
+  }
+
+  return ip;
+}
+
+// Hand the packet at the head of inbuf to the user, in connection order.
+static inline ssize_t deliverInPacket(rdpConn *c, struct inPacket *ip,
+                                      void *buf, size_t len, int *events) {
+  if (ip->delivered)
+    return 0;
+
+  if (ip->streamId) {
+    struct rdpStream *st = rdpConnGetStream(c, ip->streamId, 0);
+    assert(st);
+
+    return deliverStreamPayload(c, st, ip->streamSeqnr, ip->msgFlags, ip->data,
+                                ip->payload, buf, len, events);
+  }
+
+  return deliverPayload(&c->msg, ip->msgFlags, ip->data, ip->payload, buf, len,
+                        events);
+}
+
+// The other end gave up packets up to seqnr, see EXT_FORWARD_ACK.
+static inline void rdpConnSkipTo(rdpConn *c, uint16_t seqnr) {
+  uint16_t distance = seqnr - c->acknr;
+
+  // Stale, or far beyond anything the other end could have sent.
+  if (distance == 0 || distance >= RDP_QUEUE_SIZE_MAX)
+    return;
+
+  if (c->skipPending && sixteenAfter(seqnr, c->skipnr))
+    return;
+
+  c->skipnr = seqnr;
+  c->skipPending = 1;
+}
+
+// Move acknr past the holes given up by the other end, stopping at the first
+// packet we have in inbuf.
+static inline void rdpConnSkipHoles(rdpConn *c) {
+  while (c->skipPending && c->acknr != c->skipnr &&
+         rbufferGet(&c->inbuf, c->acknr + 1) == NULL) {
+    if (c->sink)
+      rdpConnSinkPass(c, 0);
+
+    c->acknr++;
+
+    // A message missing a fragment can't be completed.
+    c->msg.active = 0;
+
+    c->needSendAck = 1;
+
+    // Print every skipped hole as "~".
+    tlog(c->rdpSocket, LL_RAW | LL_DEBUG, "~");
+  }
+
+  if (c->skipPending && !sixteenAfter(c->acknr, c->skipnr))
+    c->skipPending = 0;
+}
+
+// Resend to the group what a member asked for by a NAK. A packet resent within
+// RDP_GROUP_NAK_BACKOFF already answers NAKs of other members for it.
+static inline void rdpConnGroupRepair(rdpConn *c, uint16_t acknr,
+                                      uint16_t highest,
+                                      const struct packetExts *exts) {
+  uint16_t head = c->seqnr - c->queue;
+  int released = 0;
+
+  if (sixteenAfter(c->seqnr - 1, highest))
+    highest = c->seqnr - 1;
+
+  for (uint16_t i = acknr + 1; !sixteenAfter(highest, i); i++) {
+    // acknr + 1 is missing for sure, the rest as the mask says.
+    if (i != (uint16_t)(acknr + 1)) {
+      uint16_t bit = i - acknr - 2;
+
+      if (bit >= exts->sackLen * 8)
+        break;
+      if (exts->sackMask[bit / 8] & (1 << (bit % 8)))
+        continue;
+    }
+
+    if (sixteenAfter(i, head)) {
+      released = 1;
+      continue;
+    }
+
+    struct packetWrap *pw = rbufferGet(&c->outbuf, i);
+    if (pw == NULL || pw->transmissions == 0 ||
+        c->rdpSocket->ustime < pw->sentTime + RDP_GROUP_NAK_BACKOFF * 1000)
+      continue;
+
+    pw->needResend = 1;
+    sendPacketWrap(c, pw);
+  }
+
+  // Gone already, the member should stop waiting for them.
+  if (released)
+    sendForwardAck(c, head - 1);
+}
+
+// Whether data c receives goes to its splice instead of the user. Only while
+// the splice is connected, it's dropped if the splice can't queue it.
+static inline int rdpConnRelaying(rdpConn *c) {
+  return c->splice && (c->splice->state == CS_CONNECTED ||
+                       c->splice->state == CS_CONNECTED_FULL);
+}
+
+// Stream packet of c relayed instead of delivered, the stream moves on the same.
+static inline void rdpConnSpliceStream(rdpConn *c, uint16_t id,
+                                       uint16_t seqnr) {
+  struct rdpStream *st = rdpConnGetStream(c, id, 1);
+
+  if (st) {
+    rbufferPut(&st->held, seqnr, NULL);
+    st->recvSeqnr = seqnr + 1;
+  }
+}
+
+// Queue pw, a packet received as it is, on c. Only the header is rewritten.
+// Return -1 if c can't queue it now.
+static inline int rdpConnSpliceForward(rdpConn *c, struct packetWrap *pw,
+                                       size_t payload) {
+  // Reserve a slot for ST_FIN.
+  if (c->queue >= RDP_QUEUE_SIZE_MAX - 1)
+    return -1;
+
+  rdpSocketTick(c->rdpSocket);
+  if (c->splice)
+    rdpConnSpliceWindow(c);
+
+  pw->payload = payload;
+  pw->deadline = 0;
+  pw->transmissions = 0;
+  pw->needResend = 0;
+  pw->abandoned = 0;
+  pw->map = NULL;
+
+  struct packet *p = (struct packet *)pw->data;
+  p->connId = c->sendId;
+  p->window = c->recvWindowSelf;
+  p->acknr = c->acknr;
+  p->seqnr = c->seqnr;
+
+  rbufferEnsureSize(&c->outbuf, c->seqnr, c->queue);
+  rbufferPut(&c->outbuf, c->seqnr, pw);
+  c->seqnr++;
+  c->queue++;
+  c->queuedBytes += pw->payload;
+
+  rdpConnFlushWrites(c);
+
+  return 0;
+}
+
+// Like rdpConnSpliceForward(), for a packet held out of order. Its payload was
+// copied out of the packet, so it's framed again.
+static inline int rdpConnSpliceHeld(rdpConn *c, const struct inPacket *ip) {
+  if (c->queue >= RDP_QUEUE_SIZE_MAX - 1)
+    return -1;
+
+  if (ip->payload == 0)
+    return 0;
+
+  rdpSocketTick(c->rdpSocket);
+  if (c->splice)
+    rdpConnSpliceWindow(c);
+
+  struct streamExt se = {ip->streamId, ip->streamSeqnr};
+  struct packetExt exts[2];
+  size_t extCnt = 0;
+
+  if (ip->msgFlags)
+    exts[extCnt++] = (struct packetExt){EXT_MESSAGE, 1, &ip->msgFlags};
+  if (ip->streamId)
+    exts[extCnt++] = (struct packetExt){EXT_STREAM, sizeof(se), &se};
+
+  if (extCnt) {
+    buildExtPacket(c, exts, extCnt, ip->data, ip->payload);
+  } else {
+    struct rdpVec vec = {ip->data, ip->payload};
+    buildSendPacket(c, ip->payload, ST_DATA, &vec, 1, 0);
+  }
+
+  rdpConnFlushWrites(c);
+
+  return 0;
+}
+
+int rdpConnSplice(rdpConn *c, rdpConn *peer) {
+  if (!c || c == peer || c->groupSender || c->groupMember) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!peer) {
+    rdpConnUnsplice(c);
+    return 0;
+  }
+
+  if (c->splice || peer->splice || peer->groupSender || peer->groupMember ||
+      c->sink || peer->sink) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  c->splice = peer;
+  peer->splice = c;
+  c->rdpSocket->splices++;
+  peer->rdpSocket->splices++;
+
+  // Advertise the coupled windows.
+  c->needSendAck = peer->needSendAck = 1;
+
+  return 0;
+}
+
+static int submit(rdpSocket *s, rdpConn *c, const void *buf, size_t len,
+                  uint8_t reply, uint32_t callId) {
+  struct submission *sub = rdpMalloc(sizeof(*sub) + len);
+  if (!sub) {
+    errno = ENOMEM;
+    return -1;
+  }
+  sub->next = NULL;
+  sub->c = c;
+  memcpy(&sub->addr, &c->addr, c->addrlen);
+  sub->addrlen = c->addrlen;
+  sub->recvId = c->recvId;
+  sub->serial = c->serial;
+  sub->len = len;
+  sub->off = 0;
+  sub->reply = reply;
+  sub->callId = callId;
+  if (len)
+    memcpy(sub->data, buf, len);
+
+  if (handoffPush(&s->submits, sub) == -1) {
+    rdpFree(sub);
+    return -1;
+  }
+
+  return 0;
+}
+
+int rdpSocketSubmit(rdpSocket *s, rdpConn *c, const void *buf, size_t len) {
+  if (!s || !c || (len && !buf)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (buf && !len)
+    return 0;
+
+  return submit(s, c, buf, len, 0, 0);
+}
+
+int rdpConnSubmit(rdpConn *c, const void *buf, size_t len) {
+  if (!c) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return rdpSocketSubmit(c->rdpSocket, c, buf, len);
+}
+
+int rdpConnSubmitReply(rdpConn *c, uint32_t callId, const void *buf,
+                       size_t len) {
+  if (!c || !buf || !len) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return submit(c->rdpSocket, c, buf, len, 1, callId);
+}
+
+// Write queued submissions in order, corked so that small ones share packets.
+// What doesn't fit stays queued for the next rdpReadPoll().
+static void rdpConnFlushSubmissions(rdpConn *c) {
+  uint8_t corked = c->corked;
+  struct submission *sub;
+
+  c->corked = 1;
+  while ((sub = c->submitHead)) {
+    if (!sub->len) {
+      c->submitHead = sub->next;
+      rdpFree(sub);
+
+      c->corked = corked;
+      rdpConnUncork(c);
+      rdpConnClose(c);
+      return;
+    }
+
+    ssize_t n;
+    if (sub->reply)
+      n = rdpReply(c, sub->callId, sub->data, sub->len) == -1 ? -1 : sub->len;
+    else
+      n = rdpWrite(c, sub->data + sub->off, sub->len - sub->off);
+    if (n == -1 && errno == EAGAIN)
+      break;
+
+    if (n != -1) {
+      sub->off += n;
+      if (sub->off < sub->len)
+        break;
+    } else {
+      tlog(c->rdpSocket, LL_DEBUG, "submission dropped: %s", strerror(errno));
+    }
+
+    c->submitHead = sub->next;
+    rdpFree(sub);
+  }
+
+  c->corked = corked;
+  if (!corked)
+    rdpConnUncork(c);
+}
+
+// Queue the submissions taken from the ring on their connections, then write
+// as much as the connections take. Those of connections destroyed since are
+// dropped, sub->c is only compared.
+static void rdpSocketDrainSubmissions(rdpSocket *s) {
+  struct submission *sub;
+
+  handoffRearm(&s->submits);
+
+  while ((sub = handoffPop(&s->submits))) {
+    rdpConn *c = findRdpConnInRdpSocket(s, (struct sockaddr *)&sub->addr,
+                                        sub->addrlen, sub->recvId);
+    if (c != sub->c || c->serial != sub->serial || c->state == CS_DESTROY) {
+      tlog(s, LL_DEBUG, "submission dropped: connection destroyed");
+      rdpFree(sub);
+      continue;
+    }
+
+    if (c->submitHead) {
+      c->submitTail->next = sub;
+    } else {
+      c->submitHead = sub;
+      c->submitNext = s->submitConns;
+      s->submitConns = c;
+    }
+    c->submitTail = sub;
+  }
+
+  rdpConn **pc = &s->submitConns;
+  while (*pc) {
+    rdpConn *c = *pc;
+
+    rdpConnFlushSubmissions(c);
+
+    if (c->submitHead) {
+      pc = &c->submitNext;
+    } else {
+      *pc = c->submitNext;
+      c->submitNext = NULL;
+    }
+  }
+}
+
+static struct completion *completionCreate(rdpConn *c, const void *buf,
+                                           size_t len, int events) {
+  struct completion *cp = rdpMalloc(sizeof(*cp) + len);
+  if (!cp) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  cp->next = NULL;
+  cp->c = c;
+  cp->events = events;
+  memset(&cp->info, 0, sizeof(cp->info));
+  cp->len = len;
+  if (len)
+    memcpy(cp->data, buf, len);
+
+  return cp;
+}
+
+static ssize_t completionReap(struct handoff *h, void *buf, size_t len,
+                              rdpConn **c, int *events, rdpEventInfo *info) {
+  handoffRearm(h);
+
+  struct completion *cp = handoffPeek(h);
+  if (!cp) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (cp->len > len) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  handoffPop(h);
+
+  ssize_t n = cp->len;
+  if (n)
+    memcpy(buf, cp->data, n);
+  *c = cp->c;
+  *events = cp->events;
+  if (info)
+    *info = cp->info;
+  rdpFree(cp);
+
+  return n;
+}
+
+int rdpSocketComplete(rdpSocket *s, rdpConn *c, const void *buf, size_t len,
+                      int events) {
+  if (!s || (len && !buf)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct completion *cp = completionCreate(c, buf, len, events);
+  if (!cp)
+    return -1;
+
+  if (handoffPush(&s->completions, cp) == -1) {
+    rdpFree(cp);
+    return -1;
+  }
+
+  return 0;
+}
+
+ssize_t rdpSocketReap(rdpSocket *s, void *buf, size_t len, rdpConn **c,
+                      int *events) {
+  if (!s || !c || !events || (len && !buf)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return completionReap(&s->completions, buf, len, c, events, NULL);
+}
+
+int rdpConnReadyFd(rdpConn *c) {
+  if (!c) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!c->ready) {
+    struct handoff *h = rdpMalloc(sizeof(*h));
+    if (!h) {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    if (handoffInit(h, RDP_READY_RING_SIZE) == -1) {
+      rdpFree(h);
+      return -1;
+    }
+    c->ready = h;
+  }
+
+  return c->ready->efd;
+}
+
+ssize_t rdpConnReap(rdpConn *c, void *buf, size_t len, int *events,
+                    rdpEventInfo *info) {
+  rdpConn *from;
+
+  if (!c || !c->ready || !events || (len && !buf)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ssize_t n = completionReap(c->ready, buf, len, &from, events, info);
+  int err = errno;
+
+  // Room taken before the backlog is checked, pairs with rdpConnHandReady().
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&c->readyBacklog, memory_order_relaxed))
+    handoffNotify(&c->rdpSocket->submits);
+
+  errno = err;
+  return n;
+}
+
+// Hand what ready has room for over, oldest first.
+static void rdpConnFlushReady(rdpConn *c) {
+  struct completion *cp;
+
+  // cp is the worker's once pushed.
+  while ((cp = c->readyHead)) {
+    struct completion *next = cp->next;
+    if (handoffPush(c->ready, cp) == -1)
+      break;
+    c->readyHead = next;
+  }
+}
+
+// Hand an event of c to its worker. Queued behind those waiting, if any, so
+// that they keep their order.
+static int rdpConnHandReady(rdpConn *c, const void *buf, size_t len,
+                            int events) {
+  struct completion *cp = completionCreate(c, buf, len, events);
+  if (!cp)
+    return -1;
+  cp->info.streamId = c->lastStreamId;
+  cp->info.callId = c->lastCallId;
+  cp->info.cookie = c->lastCookie;
+
+  if (!c->readyHead && handoffPush(c->ready, cp) == 0)
+    return 0;
+
+  if (c->readyHead) {
+    c->readyTail->next = cp;
+    c->readyTail = cp;
+    return 0;
+  }
+  c->readyHead = c->readyTail = cp;
+
+  // The worker wakes us up once it took some, unless it already did before
+  // seeing the flag.
+  atomic_store_explicit(&c->readyBacklog, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  rdpConnFlushReady(c);
+
+  if (c->readyHead) {
+    c->readyNext = c->rdpSocket->readyConns;
+    c->rdpSocket->readyConns = c;
+  } else {
+    atomic_store_explicit(&c->readyBacklog, 0, memory_order_relaxed);
+  }
+
+  return 0;
+}
+
+// Retry the events waiting for room, the workers woke us up by submits.
+static void rdpSocketFlushReady(rdpSocket *s) {
+  rdpConn **pc = &s->readyConns;
+
+  while (*pc) {
+    rdpConn *c = *pc;
+
+    rdpConnFlushReady(c);
+
+    if (c->readyHead) {
+      pc = &c->readyNext;
+    } else {
+      *pc = c->readyNext;
+      c->readyNext = NULL;
+      atomic_store_explicit(&c->readyBacklog, 0, memory_order_relaxed);
+    }
+  }
+}
+
+// Events a connection with rdpConnReadyFd() hands to its worker.
+#define RDP_READY_EVENTS (RDP_DATA | RDP_POLLOUT | RDP_CONN_ERROR)
+
+// buf and len are similar to read().
+// The corresponding rdpConn is returned by parameter c(connection).
+// Result type is returned by parameter events.
+//
+// CS_CONNECTED_FULL -> CS_CONNECTED can happen in this function only.
+static ssize_t readPoll(rdpSocket *s, void *buf, size_t len, rdpConn **conn,
+                        int *events) {
+  if (!events) {
+    return -1;
+  }
+  // This is the default events returns;
+  *events = RDP_CONTINUE;
+
+  if (!conn) {
+    *events = RDP_ERROR;
+    return -1;
+  }
+  *conn = NULL;
+
+  if (!s) {
+    *events = RDP_ERROR;
+    return -1;
+  }
+
+  if (!buf) {
+    *events = RDP_ERROR;
+    return -1;
+  }
+
+  if (len <= 0) {
+    *events = RDP_ERROR;
+    return -1;
+  }
+
+  rdpSocketDrainSubmissions(s);
+  rdpSocketFlushReady(s);
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  ssize_t read;
+  ssize_t rawRead;
+  ssize_t delivered;
+
+  dictEntry *e;
+  int ticked = 0; // Call deadlines are checked against a single clock read.
+
+  // Check every connection, see if there is any data we can send to user
+  // based on the connection acknr. Drain it if there is.
+  while (e = dictIteratorNext(s->connsIter)) {
+    *conn = (rdpConn *)dictKeyGet(e);
+
+    if ((*conn)->state != CS_CONNECTED &&
+        (*conn)->state != CS_CONNECTED_FULL &&
+        (*conn)->state != CS_HALF_CLOSED) {
+      continue;
+    }
+
+    // Taken over from another process, see rdpSocketImport().
+    if ((*conn)->resumed) {
+      (*conn)->resumed = 0;
+
+      if (dictIteratorRewind(s->connsIter) != 0) {
+        assert(0);
+      }
+
+      *events = RDP_ACCEPT;
+
+      return -1;
+    }
+
+    // receivedFin and eofseqnr are related fields.
+    if (!(*conn)->receivedFinCompleted && (*conn)->receivedFin &&
+        (*conn)->eofseqnr == (*conn)->acknr) {
+      // Received all packets the other end sent.
+      (*conn)->receivedFinCompleted = 1;
+
+      assert((*conn)->outOfOrderCnt == 0);
+
+      tlog(s, LL_DEBUG, "receivedFinCompleted, sendAck");
+
+      sendAck(*conn);
+
+      // Pass the end of file on, the splice's other end reads it after the
+      // data relayed.
+      if (rdpConnRelaying(*conn))
+        rdpConnShutdown((*conn)->splice, SHUT_WR);
+
+      if (dictIteratorRewind(s->connsIter) != 0) {
+        assert(0);
+      }
+
+      *events = RDP_DATA;
+
+      // EOF
+      return 0;
+    }
+
+    // A call didn't get its reply in time.
+    if ((*conn)->callDeadline && !ticked) {
+      rdpSocketTick(s);
+      ticked = 1;
+    }
+    if ((*conn)->callDeadline && s->mstime >= (*conn)->callDeadline &&
+        rdpConnExpireCall(*conn, s->mstime)) {
+      if (dictIteratorRewind(s->connsIter) != 0) {
+        assert(0);
+      }
+
+      *events = RDP_CALL_TIMEOUT;
+
+      return -1;
+    }
+
+    if ((*conn)->outOfOrderCnt == 0 && !(*conn)->skipPending)
+      continue;
+
+    // Relayed streams move on in connection order.
+    if ((*conn)->streamPending && !rdpConnRelaying(*conn)) {
+      struct rdpStream *st;
+      struct inPacket *ip = rdpConnNextHeld(*conn, &st);
+
+      if (ip) {
+        delivered = deliverStreamPayload(*conn, st, ip->streamSeqnr,
+                                         ip->msgFlags, ip->data, ip->payload,
+                                         buf, len, events);
+        // The slot in inbuf is kept until acknr gets there.
+        ip->delivered = 1;
+
+        if (dictIteratorRewind(s->connsIter) != 0) {
+          assert(0);
+        }
+
+        return delivered > 0 ? delivered : -1;
+      }
+
+      (*conn)->streamPending = 0;
+    }
+
+    // We have some out of order packet in buffer, send the right next packet
+    // if there is.
+    struct inPacket *ip =
+        (struct inPacket *)rbufferGet(&(*conn)->inbuf, (*conn)->acknr + 1);
+    if (ip == NULL) {
+      if (!(*conn)->skipPending) {
+        // Don't have buffer to send.
+        continue;
+      }
+
+      rdpConnSkipHoles(*conn);
+
+      if (dictIteratorRewind(s->connsIter) != 0) {
+        assert(0);
+      }
+
+      return -1;
+    }
+
+    int slot = isSinkSlot(*conn, ip);
+    ssize_t sunk = -1;
+
+    if (slot) {
+      sunk = ip->payload;
+    } else if ((*conn)->sink) {
+      sunk = rdpConnSinkWrite(*conn,
+                              !ip->streamId && !ip->msgFlags && !ip->delivered,
+                              ip->data, ip->payload, events);
+    }
+
+    if (sunk >= 0) {
+      delivered = 0;
+    } else if (rdpConnRelaying(*conn)) {
+      // Waits in inbuf while the splice is backed up.
+      if (!ip->delivered && rdpConnSpliceHeld((*conn)->splice, ip) == -1)
+        continue;
+
+      if (ip->streamId)
+        rdpConnSpliceStream(*conn, ip->streamId, ip->streamSeqnr);
+
+      delivered = 0;
+    } else {
+      // Get the payload size of the packet to be returned to user.
+      delivered = deliverInPacket(*conn, ip, buf, len, events);
+    }
+
+    if ((*conn)->sink && rdpConnSinkPass(*conn, sunk > 0 ? sunk : 0))
+      *events |= RDP_SINK;
+
+    if (!slot)
+      rdpFree(ip);
+    (*conn)->acknr++;
+    rbufferPut(&(*conn)->inbuf, (*conn)->acknr, NULL);
+    rdpConnSkipHoles(*conn);
+
+    // acknr proceeded, should notify the other end.
+    (*conn)->needSendAck = 1;
+
+    (*conn)->outOfOrderCnt--;
+
+    // Might still have out of order packets in input buffer.
+    assert((*conn)->outOfOrderCnt >= 0);
+
+    if (dictIteratorRewind(s->connsIter) != 0) {
+      assert(0);
+    }
+
+    return delivered > 0 ? delivered : -1;
+  }
+  if (dictIteratorRewind(s->connsIter) != 0) {
+    assert(0);
+  }
+  *conn = NULL;
+
+  // With splices, packets are received into a packetWrap, one relayed in order
+  // is queued on the splice as it is. See rdpConnSpliceForward().
+  unsigned char *raw = buf;
+  size_t rawLen = len;
+  if (s->splices) {
+    if (!s->spare) {
+      s->spare = rdpMalloc((getPacketWrapSize() - 1) + getUdpMtu());
+      assert(s->spare);
+    }
+
+    raw = s->spare->data;
+    rawLen = getUdpMtu();
+  }
+
+  // Read from socket only after drained ordered buffer in queue.
+  rawRead = recvfrom(s->fd, raw, rawLen, 0, (struct sockaddr *)&addr, &addrlen);
+  if (rawRead == -1) {
+    if (errno == EAGAIN) {
+      *events = RDP_AGAIN;
+
+      rdpContextAck(s);
+    } else {
+      *events = RDP_ERROR;
+
+      tlog(s, LL_DEBUG, "recvfrom error");
+    }
+
+    return -1;
+  }
+
+  if (rawRead < getPacketHeaderSize()) {
+    return -1;
+  }
+
+  const struct packet *p = (struct packet *)raw;
+  const uint8_t version = packetGetVersion(p);
+  if (version != 1) {
+    return -1;
+  }
+
+  const uint16_t connId = p->connId;
+  uint8_t type = packetGetType(p);
+  const uint16_t pseqnr = p->seqnr;
+  const uint16_t packnr = p->acknr;
+
+  rdpSocketTick(s);
+
+  tlog(s, LL_RAW | LL_DEBUG, "%s", packetStateAbbrNamesLower[type]);
+
+  if (type == ST_NAK) {
+    struct packetExts exts;
+    if (!parseExtensions(p, raw + rawRead, &exts)) {
+      tlog(s, LL_DEBUG, "malformed extensions.");
+      return -1;
+    }
+
+    // To the sender from any member, its conn is keyed by the group address.
+    // Members of the same sender missing the same packets hold back theirs.
+    while (e = dictIteratorNext(s->connsIter)) {
+      rdpConn *c = (rdpConn *)dictKeyGet(e);
+
+      if (c->groupSender && c->recvId == connId &&
+          (c->state == CS_CONNECTED || c->state == CS_HALF_CLOSED ||
+           c->state == CS_FIN_SENT)) {
+        rdpConnGroupRepair(c, packnr, pseqnr, &exts);
+      } else if (c->groupMember && c->sendId == connId &&
+                 c->acknr == packnr && c->groupTicker) {
+        c->groupTicker = s->mstime + RDP_GROUP_NAK_INTERVAL;
+      }
+    }
+    if (dictIteratorRewind(s->connsIter) != 0) {
+      assert(0);
+    }
+
+    return -1;
+  }
+
+  // Group packets are handled as ST_DATA and ST_STATE of the member conn,
+  // created on the first one.
+  if (type == ST_GROUP || type == ST_GROUP_STATE) {
+    rdpConn *c = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr,
+                                        addrlen, connId);
+    if (!c) {
+      if (!s->groupLen || dictFilled(s->conns) > RDP_MAX_CONNS_PER_RDPSOCKET)
+        return -1;
+
+      // Joins the sequence where it is, earlier packets aren't asked for.
+      c = rdpConnCreate(s);
+      rdpConnInit(c, (const struct sockaddr *)&addr, addrlen, 0, connId,
+                  connId, connId - 1);
+      c->groupMember = 1;
+      c->seqnr = packnr + 1;
+      c->acknr = pseqnr - 1;
+      c->groupHighest = c->acknr;
+      connStateSwitch(c, CS_CONNECTED);
+
+      *events = RDP_ACCEPT;
+    }
+
+    if (!c->groupMember)
+      return -1;
+
+    // ST_GROUP_STATE carries the next seqnr.
+    uint16_t highest = type == ST_GROUP ? pseqnr : pseqnr - 1;
+    if (sixteenAfter(c->groupHighest, highest))
+      c->groupHighest = highest;
+
+    // Something might be missing, NAK it soon unless it turns up.
+    if (!c->groupTicker && sixteenAfter(c->acknr + 1, highest)) {
+      c->groupTicker = s->mstime + rand() % (RDP_GROUP_NAK_BACKOFF + 1);
+      rdpSocketWakeAt(s, c->groupTicker * 1000);
+    }
+
+    type = type == ST_GROUP ? ST_DATA : ST_STATE;
+    packetSetType((struct packet *)p, type);
+  }
+
+  if (type == ST_SYN) {
+    struct packetExts exts;
+    const uint8_t *payloadEnd = raw + rawRead;
+    const uint8_t *payloadStart = parseExtensions(p, payloadEnd, &exts);
+    if (!payloadStart) {
+      tlog(s, LL_DEBUG, "malformed extensions.");
+      return -1;
+    }
+    ssize_t payload = payloadEnd - payloadStart;
+
+    *conn = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr, addrlen,
+                                   connId + 1);
+    if (*conn) {
+      if ((*conn)->state == CS_CONNECTED ||
+          (*conn)->state == CS_CONNECTED_FULL) {
+        // Our ack got lost. Payload of a syn carrying data is delivered
+        // already.
+        sendAck(*conn);
+
+        return -1;
+      }
+
+      if ((*conn)->state != CS_SYN_RECV) {
+        return -1;
+      }
+    } else {
+      if (dictFilled(s->conns) > RDP_MAX_CONNS_PER_RDPSOCKET) {
+        *events = RDP_ERROR;
+        return -1;
+      }
+
+      if (payload > len) {
+        *events = RDP_ERROR;
+        tlog(s, LL_DEBUG, "syn payload exceeded supplied buf length.");
+        return -1;
+      }
+
+      *conn = rdpConnCreate(s);
+      rdpConnInit(*conn, (const struct sockaddr *)&addr, addrlen, 0, connId,
+                  connId + 1, connId);
+      connStateSwitch((*conn), CS_SYN_RECV);
+
+      (*conn)->acknr = pseqnr;
+      (*conn)->ticketTicker = s->mstime + RDP_TICKET_INTERVAL;
+
+      if (exts.ticket) {
+        struct ticket t;
+        memcpy(&t, exts.ticket, sizeof(t));
+
+        // Forged or stale tickets are ignored, the path is learnt again.
+        if (t.mac == ticketMac(s, &t) && !ticketExpired(&t))
+          rdpConnApplyTicket(*conn, &t);
+      }
+    }
+
+    (*conn)->lastReceivePacketTime = (*conn)->rdpSocket->mstime;
+    (*conn)->retransmitTimeout = (*conn)->nextRetransmitTimeout;
+    (*conn)->retransmitTicker =
+        (*conn)->rdpSocket->ustime + (*conn)->retransmitTimeout;
+
+    sendAck(*conn);
+
+    if (payload > 0 && (*conn)->state == CS_SYN_RECV) {
+      // 0-RTT, the syn itself proves the other end wants to talk.
+      connStateSwitch(*conn, CS_CONNECTED);
+      *events = RDP_ACCEPT | RDP_DATA;
+
+      memmove(buf, payloadStart, payload);
+      return payload;
+    }
+
+    return -1;
+  } else if (type == ST_STATE || type == ST_DATA || type == ST_FIN ||
+             type == ST_RESET || type == ST_DATAGRAM) {
+    *conn = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr, addrlen,
+                                   connId);
+
+    if (!*conn) {
+      if (type != ST_RESET) {
+        // Unindentified packet, send back a ST_RESET packet with the original
+        // connection id, aka, the sender's sendId.
+
+        tlog(s, LL_RAW | LL_DEBUG, "R");
+
+        sendReset(s->fd, (const struct sockaddr *)&addr, addrlen, connId);
+      } else {
+        // Got a ST_RESET, it's connection id should equal our sendId.
+        // sendId is either 1 more than recvId, otherwise 1 less.
+        if (((*conn = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr,
+                                             addrlen, connId + 1)) &&
+             ((*conn)->sendId == connId)) ||
+            ((*conn = findRdpConnInRdpSocket(s, (const struct sockaddr *)&addr,
+                                             addrlen, connId - 1)) &&
+             ((*conn)->sendId == connId))) {
+          switch ((*conn)->state) {
           case CS_UNINITIALIZED:
             // Haven't reached outside world. Corrupted packet maybe.
           case CS_SYN_RECV:
@@ -1706,563 +4809,2032 @@ ssize_t rdpReadPoll(rdpSocket *s, void *buf, size_t len, rdpConn **conn,
           case CS_SYN_SENT:
           case CS_CONNECTED_FULL:
           case CS_CONNECTED:
+          case CS_HALF_CLOSED:
             // User have got this connection handle, should be notified to do
             // some sweep jobs.
 
-            connStateSwitch((*conn), CS_RESET);
-            *events = RDP_CONN_ERROR;
-            break;
-          case CS_RESET:
-          case CS_DESTROY:
-            break;
-          default:
-            assert(0);
-          }
-        } else {
-          // state is CS_DESTROY or CS_RESET already, don't need to report to
-          // user. Silently ignore unknown packets.
+            connStateSwitch((*conn), CS_RESET);
+            *events = RDP_CONN_ERROR;
+            break;
+          case CS_RESET:
+          case CS_DESTROY:
+            break;
+          default:
+            assert(0);
+          }
+        } else {
+          // state is CS_DESTROY or CS_RESET already, don't need to report to
+          // user. Silently ignore unknown packets.
+        }
+      }
+
+      return -1;
+    }
+
+    rdpConn *c = *conn;
+
+    if (c->state == CS_RESET) {
+      // Packet's connection id shouldn't match this connection. Packet must
+      // be corrupted.
+      tlog(s, LL_DEBUG, "received %s, already in CS_RESET, connId: %d",
+           packetStateNames[type], connId);
+
+      return -1;
+    }
+
+    if (c->state == CS_DESTROY) {
+      tlog(s, LL_DEBUG, "received %s, already in CS_DESTROY, connId: %d",
+           packetStateNames[type], connId);
+
+      return -1;
+    }
+
+    if (c->queue == 0)
+      assert(c->flightWindow == 0 && c->queuedBytes == 0);
+    assert(c->queue == 0 || rbufferGet(&c->outbuf, c->seqnr - c->queue));
+
+    // Ignore packets with invalid acknr.
+    if ((sixteenAfter(c->seqnr - 1, packnr) ||
+         sixteenAfter(packnr, c->seqnr - 1 - c->queue -
+                                  c->tunables.ackBehindAllowed))) {
+      tlog(c->rdpSocket, LL_DEBUG, "wrong acknr: %d, packet type: %d",
+           c->seqnr - 1 - c->queue - packnr, type);
+      return -1;
+    }
+
+    struct packetExts exts;
+    const uint8_t *payloadEnd = raw + rawRead;
+    const uint8_t *payloadStart = parseExtensions(p, payloadEnd, &exts);
+    if (!payloadStart) {
+      tlog(c->rdpSocket, LL_DEBUG, "malformed extensions.");
+      return -1;
+    }
+    ssize_t payload = payloadEnd - payloadStart;
+
+    // ST_DATAGRAM's seqnr is out of sequence, only its acknr counts.
+    if (c->state == CS_SYN_SENT && type != ST_DATAGRAM) {
+      c->acknr = (pseqnr - 1) & RDP_SEQ_NR_MASK;
+    }
+
+    // The distance between the latest packet we have supplied back to user and
+    // current packet minus 1. 0 means the right next packet we need.
+    const uint seqCnt = (pseqnr - c->acknr - 1) & RDP_SEQ_NR_MASK;
+
+    if (seqCnt >= RDP_QUEUE_SIZE_MAX && type != ST_DATAGRAM) {
+      // Packet can't be placed in our input buffer.
+      if (seqCnt >= (RDP_SEQ_NR_MASK + 1) - RDP_QUEUE_SIZE_MAX) {
+        // This is a outdated duplicated packet.
+        c->needSendAck = 1;
+
+        c->outOfDateSum++;
+
+        // Print every outdated duplicated packets as "#".
+        tlog(c->rdpSocket, LL_RAW | LL_DEBUG, "#");
+      } else {
+        // SeqCnt is far beyond our buffer size which is unexcepted.
+        tlog(c->rdpSocket, LL_DEBUG, "packet wrong seqnr: %d.", seqCnt);
+      }
+
+      return -1;
+    }
+
+    c->lastReceivePacketTime = c->rdpSocket->mstime;
+
+    uint16_t ackCnt = (packnr - (c->seqnr - c->queue) + 1) & RDP_ACK_NR_MASK;
+
+    if (ackCnt > c->queue) {
+      ackCnt = 0;
+    }
+
+    c->recvWindowPeer = p->window;
+
+    // Connection handshake.
+    if (type == ST_DATA && c->state == CS_SYN_RECV) {
+      connStateSwitch(c, CS_CONNECTED);
+      *events = RDP_ACCEPT;
+    }
+
+    // Accepted on a syn carrying data, the other end might talk first.
+    if ((type == ST_STATE || type == ST_DATA) && c->state == CS_SYN_SENT) {
+      // Outgoing connection completion.
+      connStateSwitch(c, CS_CONNECTED);
+      *events = RDP_CONNECTED;
+    }
+
+    if (c->state == CS_FIN_SENT && c->queue == ackCnt) {
+      if (c->receivedFin) {
+        // Passive close completion.
+        connStateSwitch(c, CS_DESTROY);
+
+        tlog(c->rdpSocket, LL_DEBUG,
+             "change state to CS_DESTROY, passive close completion.");
+      } else {
+        // Active close, the other end's ST_FIN is still to be acked.
+        c->finAckedTime = c->rdpSocket->mstime;
+      }
+    }
+
+    for (int i = 0; i < ackCnt; ++i) {
+      ackPacket(c, c->seqnr - c->queue);
+      c->queue--;
+    }
+
+    while (c->queue > 0 && !rbufferGet(&c->outbuf, c->seqnr - c->queue)) {
+      // todo error
+      assert(!exts.sackMask);
+
+      c->queue--;
+    }
+
+    if (c->queue > 0 && exts.sackMask) {
+      selectiveAck(c, packnr + 2, exts.sackMask, exts.sackLen);
+    }
+
+    if (c->queue == 0)
+      assert(c->flightWindow == 0 && c->queuedBytes == 0);
+    assert(c->queue == 0 || rbufferGet(&c->outbuf, c->seqnr - c->queue));
+
+    if (c->state == CS_CONNECTED_FULL && rdpConnSendDrained(c)) {
+      connStateSwitch(c, CS_CONNECTED);
+
+      *events |= RDP_POLLOUT;
+
+      // Tell the other end of the splice it can send again.
+      if (c->splice)
+        c->splice->needSendAck = 1;
+    }
+
+    // All in flight data acked, no reason to hold back the trailing packet.
+    if (c->flushTicker && c->flightWindow == 0 && !c->corked &&
+        (c->state == CS_CONNECTED || c->state == CS_CONNECTED_FULL)) {
+      rdpConnFlushPackets(c);
+    }
+
+    if (exts.ticket && !c->ticketTicker) {
+      memcpy(&c->ticket, exts.ticket, sizeof(c->ticket));
+      c->hasTicket = 1;
+    }
+
+    rdpConnIssueTicket(c);
+
+    if (exts.hasForwardAck &&
+        (c->state == CS_CONNECTED || c->state == CS_CONNECTED_FULL ||
+         c->state == CS_HALF_CLOSED)) {
+      rdpConnSkipTo(c, exts.forwardAcknr);
+
+      // Might have nothing buffered to drain, answer it now.
+      c->needSendAck = 1;
+    }
+
+    if (type == ST_STATE) {
+      return -1;
+    }
+
+    if (type == ST_DATAGRAM) {
+      if (c->state != CS_CONNECTED && c->state != CS_CONNECTED_FULL &&
+          c->state != CS_HALF_CLOSED) {
+        return -1;
+      }
+
+      if (payload > len) {
+        *events = RDP_ERROR;
+
+        tlog(c->rdpSocket, LL_DEBUG, "datagram exceeded supplied buf length.");
+
+        return -1;
+      }
+
+      // Never held back by missing ST_DATA packets.
+      memmove(buf, payloadStart, payload);
+      *events |= RDP_DATAGRAM;
+
+      return payload;
+    }
+
+    if (c->state != CS_CONNECTED && c->state != CS_CONNECTED_FULL &&
+        c->state != CS_HALF_CLOSED && c->state != CS_FIN_SENT) {
+      tlog(c->rdpSocket, LL_DEBUG, "connection not connected. state: %s",
+           connStateNames[c->state]);
+      return -1;
+    }
+
+    if (type == ST_FIN) {
+      if (c->state == CS_FIN_SENT) {
+        // Both ends closed, ack it so the other end needn't wait for it.
+        // Nothing is delivered anymore, held packets are freed with inbuf.
+        c->acknr = pseqnr;
+        c->outOfOrderCnt = 0;
+        sendAck(c);
+
+        connStateSwitch(c, CS_DESTROY);
+
+        return -1;
+      }
+
+      if (!c->receivedFin) {
+        // Passive close received.
+        c->receivedFin = 1;
+        c->eofseqnr = pseqnr;
+      }
+    }
+
+    if (c->state != CS_CONNECTED && c->state != CS_CONNECTED_FULL &&
+        c->state != CS_HALF_CLOSED) {
+      return -1;
+    }
+
+    if (seqCnt == 0 && type == ST_DATA && rdpConnRelaying(c)) {
+      size_t relayed = rawRead - getPacketHeaderSize();
+      assert(raw != buf);
+
+      // Dropped while the splice is backed up, the other end retransmits it.
+      if (rdpConnSpliceForward(c->splice, s->spare, relayed) == -1) {
+        tlog(c->rdpSocket, LL_DEBUG, "splice backed up, packet dropped.");
+        return -1;
+      }
+      s->spare = NULL;
+
+      if (exts.streamId)
+        rdpConnSpliceStream(c, exts.streamId, exts.streamSeqnr);
+
+      c->acknr++;
+      rdpConnSkipHoles(c);
+      c->needSendAck = 1;
+
+      // Print every packet relayed as ">".
+      tlog(c->rdpSocket, LL_RAW | LL_DEBUG, ">");
+
+      return -1;
+    }
+
+    if (seqCnt == 0) {
+      ssize_t sunk = -1;
+
+      if (c->sink)
+        sunk = rdpConnSinkWrite(c, !exts.streamId && !exts.msgFlags,
+                                payloadStart, payload, events);
+
+      // This packet is the right next packet expected. Return it to user
+      // directly.
+      if (sunk >= 0) {
+        delivered = 0;
+      } else if (exts.streamId) {
+        struct rdpStream *st = rdpConnGetStream(c, exts.streamId, 1);
+        if (!st) {
+          tlog(c->rdpSocket, LL_DEBUG, "too many streams.");
+          return -1;
+        }
+
+        delivered =
+            deliverStreamPayload(c, st, exts.streamSeqnr, exts.msgFlags,
+                                 payloadStart, payload, buf, len, events);
+      } else {
+        delivered = deliverPayload(&c->msg, exts.msgFlags, payloadStart,
+                                   payload, buf, len, events);
+      }
+
+      if (c->sink && rdpConnSinkPass(c, sunk > 0 ? sunk : 0))
+        *events |= RDP_SINK;
+
+      // Record where the user have got of data.
+      c->acknr++;
+      rdpConnSkipHoles(c);
+
+      // acknr have updated, notify the other end.
+      c->needSendAck = 1;
+
+      // Print every the right next packet as a ".".
+      tlog(c->rdpSocket, LL_RAW | LL_DEBUG, ".");
+
+      // Current packet might have filled the out of order hole.
+      // Invoke rdpReadPoll() again to try reading them.
+      return delivered == 0 ? -1 : delivered;
+    } else {
+      // seqCnt != 0, this is an out of order packet.
+
+      if (c->receivedFin && pseqnr > c->eofseqnr) {
+
+        tlog(c->rdpSocket, LL_DEBUG, "seqnr bigger than eof packet.");
+        return -1;
+      }
+
+      rbufferEnsureSize(&c->inbuf, pseqnr + 1, seqCnt + 1);
+
+      if (rbufferGet(&c->inbuf, pseqnr) != NULL) {
+
+        // Print every duplicated out of order packet as "+".
+        tlog(c->rdpSocket, LL_DEBUG | LL_RAW, "+");
+
+        c->needSendAck = 1;
+
+        c->outOfOrderDuplicatedSum++;
+
+        return -1;
+      }
+
+      struct rdpStream *st = NULL;
+      int early = 0;
+      unsigned char *sinkAt = NULL;
+      delivered = 0;
+
+      if (c->sink && !exts.streamId && !exts.msgFlags && payload > 0)
+        sinkAt = rdpConnSinkPlace(c, seqCnt, payload);
+
+      if (sinkAt) {
+        // Goes right where it belongs, inbuf only keeps its slot.
+        memcpy(sinkAt, payloadStart, payload);
+      } else if (exts.streamId) {
+        st = rdpConnGetStream(c, exts.streamId, 1);
+        if (!st) {
+          tlog(c->rdpSocket, LL_DEBUG, "too many streams.");
+          return -1;
+        }
+
+        // Its stream is waiting for it, no need to wait for the connection.
+        // Relayed in connection order instead.
+        if (exts.streamSeqnr == st->recvSeqnr && !rdpConnRelaying(c)) {
+          delivered =
+              deliverStreamPayload(c, st, exts.streamSeqnr, exts.msgFlags,
+                                   payloadStart, payload, buf, len, events);
+          payload = 0;
+          early = 1;
+        } else if (sixteenAfter(exts.streamSeqnr, st->recvSeqnr)) {
+          // Stale within its stream.
+          payload = 0;
+          early = 1;
+          st = NULL;
+        }
+      } else if (c->unordered && !exts.msgFlags && payload > 0 &&
+                 !rdpConnRelaying(c) && !c->sink) {
+        // Unordered mode, nothing to wait for. Messages are still assembled in
+        // order, and the sink is filled in order.
+        delivered = deliverPayload(&c->msg, 0, payloadStart, payload, buf, len,
+                                   events);
+        payload = 0;
+        early = 1;
+      }
+
+      struct inPacket *ip;
+      if (sinkAt) {
+        ip = rdpConnSinkHold(c, pseqnr, payload);
+      } else {
+        ip = (struct inPacket *)rdpMalloc(offsetof(struct inPacket, data) +
+                                          payload);
+        assert(ip);
+        ip->payload = (uint32_t)payload;
+        ip->streamId = exts.streamId;
+        ip->streamSeqnr = exts.streamSeqnr;
+        ip->msgFlags = exts.msgFlags;
+        ip->delivered = early;
+        memcpy(ip->data, payloadStart, payload);
+      }
+
+      assert((pseqnr & c->inbuf.mask) != ((c->acknr + 1) & c->inbuf.mask));
+
+      rbufferPut(&c->inbuf, pseqnr, ip);
+
+      if (st && !ip->delivered) {
+        uint16_t distance = exts.streamSeqnr - st->recvSeqnr;
+
+        rbufferEnsureSize(&st->held, exts.streamSeqnr + 1, distance + 1);
+        rbufferPut(&st->held, exts.streamSeqnr, ip);
+      }
+
+      // Print every unique out of order packet as "-".
+      tlog(c->rdpSocket, LL_DEBUG | LL_RAW, "-");
+
+      c->needSendAck = 1;
+
+      c->outOfOrderCnt++;
+
+      c->outOfOrderSum++;
+
+      return delivered > 0 ? delivered : -1;
+    }
+
+    assert(0);
+  } else {
+    // Unknown packet type. Corrupted packet.
+  }
+
+  return -1;
+}
+
+// The events of connections with a worker go to it rather than the caller.
+ssize_t rdpReadPoll(rdpSocket *s, void *buf, size_t len, rdpConn **conn,
+                    int *events) {
+  for (;;) {
+    ssize_t n = readPoll(s, buf, len, conn, events);
+
+    if (!events || !conn || !*conn || !(*conn)->ready ||
+        !(*events & RDP_READY_EVENTS))
+      return n;
+
+    if (rdpConnHandReady(*conn, buf, n > 0 ? n : 0, *events) == -1)
+      return n;
+  }
+}
+
+void *rdpConnGetUserData(rdpConn *c) { return c->userData; }
+
+int rdpConnSetUserData(rdpConn *c, void *userData) {
+  assert(c);
+  if (!c)
+    return -1;
+
+  c->userData = userData;
+
+  return 0;
+}
+
+int rdpSocketGetProp(rdpSocket *s, int opt) {
+  assert(s);
+  if (!s)
+    return -1;
+
+  switch (opt) {
+  case RDP_PROP_FD:
+    return s->fd;
+  case RDP_PROP_SNDBUF:
+    return s->sendBufferSize;
+  case RDP_PROP_RCVBUF:
+    return s->recvBufferSize;
+  case RDP_PROP_SUBMIT_FD:
+    return s->submits.efd;
+  case RDP_PROP_COMPLETION_FD:
+    return s->completions.efd;
+  }
+  return -1;
+}
+
+int rdpSocketSetProp(rdpSocket *s, int opt, int val) {
+  if (!s)
+    return -1;
+
+  switch (opt) {
+  case RDP_PROP_FD:
+    s->fd = val;
+    return 0;
+
+  case RDP_PROP_SNDBUF:
+    s->sendBufferSize = val;
+    return 0;
+
+  case RDP_PROP_RCVBUF:
+    s->recvBufferSize = val;
+    return 0;
+  }
+  return -1;
+}
+
+ssize_t rdpConnGetTicket(rdpConn *c, void *buf, size_t len) {
+  if (!c || !buf || len < sizeof(struct ticket)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!c->hasTicket) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  memcpy(buf, &c->ticket, sizeof(struct ticket));
+
+  return sizeof(struct ticket);
+}
+
+int rdpConnSetTicket(rdpConn *c, const void *ticket, size_t len) {
+  if (!c || !ticket || len != sizeof(struct ticket) ||
+      c->state != CS_UNINITIALIZED) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct ticket t;
+  memcpy(&t, ticket, sizeof(t));
+  if (ticketExpired(&t)) {
+    errno = ESTALE;
+    return -1;
+  }
+
+  c->ticket = t;
+  c->hasTicket = 1;
+
+  return 0;
+}
+
+int rdpSocketSetTicketKey(rdpSocket *s, const void *key, size_t len) {
+  if (!s || !key || len != sizeof(s->ticketKey)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memcpy(s->ticketKey, key, len);
+
+  return 0;
+}
+
+int rdpConnGetProp(rdpConn *c, int opt) {
+  assert(c);
+  if (!c)
+    return -1;
+
+  switch (opt) {
+  case RDP_CONN_PROP_UNORDERED:
+    return c->unordered;
+  case RDP_CONN_PROP_CORK_DELAY:
+    return c->corkDelay;
+  case RDP_CONN_PROP_COALESCE:
+    return c->coalesceDelay;
+  case RDP_CONN_PROP_SNDLOWAT:
+    return c->sendLowWater;
+  case RDP_CONN_PROP_SNDHIWAT:
+    return c->sendHighWater;
+  }
+  return -1;
+}
+
+int rdpConnSetProp(rdpConn *c, int opt, int val) {
+  if (!c)
+    return -1;
+
+  switch (opt) {
+  case RDP_CONN_PROP_UNORDERED:
+    c->unordered = val ? 1 : 0;
+    return 0;
+  case RDP_CONN_PROP_CORK_DELAY:
+    if (val < 0)
+      return -1;
+    c->corkDelay = val;
+    return 0;
+  case RDP_CONN_PROP_COALESCE:
+    if (val < 0)
+      return -1;
+    c->coalesceDelay = val;
+    return 0;
+  case RDP_CONN_PROP_SNDLOWAT:
+    if (val < 0 || (c->sendHighWater && (uint32_t)val > c->sendHighWater))
+      return -1;
+    c->sendLowWater = val;
+    return 0;
+  case RDP_CONN_PROP_SNDHIWAT:
+    if (val < 0 || (val && (uint32_t)val < c->sendLowWater))
+      return -1;
+    c->sendHighWater = val;
+    return 0;
+  }
+  return -1;
+}
+
+int rdpTunablesProfile(rdpTunables *t, int profile) {
+  if (!t || profile < 0 ||
+      (size_t)profile >= sizeof(profiles) / sizeof(profiles[0])) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *t = profiles[profile];
+
+  return 0;
+}
+
+int rdpSocketGetTunables(rdpSocket *s, rdpTunables *t) {
+  if (!s || !t) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *t = s->tunables;
+
+  return 0;
+}
+
+int rdpSocketSetTunables(rdpSocket *s, const rdpTunables *t) {
+  if (!s || !t || !tunablesValid(t)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  s->tunables = *t;
+
+  return 0;
+}
+
+int rdpConnGetTunables(rdpConn *c, rdpTunables *t) {
+  if (!c || !t) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *t = c->tunables;
+
+  return 0;
+}
+
+int rdpConnSetTunables(rdpConn *c, const rdpTunables *t) {
+  if (!c || !t || !tunablesValid(t)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  c->tunables = *t;
+
+  // The RTT measured so far stays, zero until then.
+  c->nextRetransmitTimeout =
+      boundedRetransmitTimeout(c, c->rtt ? c->rtt + c->rttVar * 4 : 0);
+
+  return 0;
+}
+
+// Use ack packet as keep alive probe.
+static inline void rdpConnKeepAlive(rdpConn *c) {
+  c->acknr--;
+
+  tlog(c->rdpSocket, LL_DEBUG, "rdpConnKeepAlive");
+
+  sendAck(c);
+
+  c->acknr++;
+}
+
+static inline int resizeWindow(rdpConn *c) {
+  // Shrink when no packets sent have acked, until the window can fit only one
+  // packet.
+  if (c->ackedBytesSinceResizeWindow == 0 &&
+      c->sentBytesSinceResizeWindow > 0) {
+    c->flightWindowLimit =
+        limitedWindow(c, c->flightWindow / c->tunables.windowShrinkFactor);
+  } else if (c->ackedBytesSinceResizeWindow > 0) {
+    c->flightWindowLimit =
+        limitedWindow(c, c->flightWindowLimit * c->tunables.windowExpandFactor);
+  } else {
+    // Stay the same.
+  }
+
+  c->ackedBytesSinceResizeWindow = c->sentBytesSinceResizeWindow = 0;
+
+  return 0;
+}
+
+// Only update after the end of a retransmit event.
+static inline int updateRetransmitTimeout(rdpConn *c) {
+  uint32_t lastSendTimeToNow = 0;
+
+  assert(c->queue == 0 || rbufferGet(&c->outbuf, c->seqnr - c->queue));
+
+  // Retrieve the oldest packet in flight in output buffer. Abandoned ones and
+  // those waiting to be resent don't time out anymore.
+  for (uint16_t i = c->seqnr - c->queue; i != c->seqnr; i++) {
+    struct packetWrap *pw = (struct packetWrap *)rbufferGet(&c->outbuf, i);
+
+    if (!pw || !pw->transmissions || pw->abandoned || pw->needResend)
+      continue;
+
+    assert(pw->sentTime);
+
+    lastSendTimeToNow = c->rdpSocket->ustime - pw->sentTime;
+    break;
+  }
+
+  // Update retransmitTimeout.
+  c->retransmitTimeout = c->nextRetransmitTimeout - lastSendTimeToNow;
+
+  if (c->retransmitTimeout < 0)
+    c->retransmitTimeout = 0;
+
+  // retransmitTicker of connection can only be updated here.
+  c->retransmitTicker = c->rdpSocket->ustime + c->retransmitTimeout;
+
+  return 0;
+}
+
+// Give up packets passed their deadline. They stay in outbuf until the other
+// end acks them, see rdpConnForwardAck().
+static inline void abandonExpiredPackets(rdpConn *c) {
+  for (uint16_t i = c->seqnr - c->queue; i != c->seqnr && c->expiringCnt;
+       i++) {
+    struct packetWrap *pw = rbufferGet(&c->outbuf, i);
+    if (pw == NULL || pw->abandoned || pw->deadline == 0 ||
+        c->rdpSocket->mstime < pw->deadline)
+      continue;
+
+    // Fresh and to be resent packets didn't contribute to flightWindow.
+    if (pw->transmissions > 0 && !pw->needResend)
+      c->flightWindow -= pw->payload;
+
+    pw->needResend = 0;
+    pw->abandoned = 1;
+  }
+}
+
+// Move the other end's acknr past abandoned packets at the head of outbuf.
+// Packets already selectively acked in between are kept by the other end.
+static inline void rdpConnForwardAck(rdpConn *c) {
+  uint16_t head = c->seqnr - c->queue;
+  uint16_t i = head;
+
+  for (; i != c->seqnr; i++) {
+    struct packetWrap *pw = rbufferGet(&c->outbuf, i);
+    if (pw && !pw->abandoned)
+      break;
+  }
+
+  if (i != head)
+    sendForwardAck(c, i - 1);
+}
+
+// Release packets kept past RDP_GROUP_RETAIN or their deadline, and send the
+// heartbeat telling members the sequence sent and the oldest one kept.
+static inline void rdpConnGroupSenderCheck(rdpConn *c) {
+  uint64_t now = c->rdpSocket->mstime;
+
+  while (c->queue > 0) {
+    struct packetWrap *pw = rbufferGet(&c->outbuf, c->seqnr - c->queue);
+
+    if (pw->transmissions == 0 ||
+        (now < pw->sentTime / 1000 + RDP_GROUP_RETAIN &&
+         (pw->deadline == 0 || now < pw->deadline)))
+      break;
+
+    if (pw->deadline)
+      c->expiringCnt--;
+
+    rbufferPut(&c->outbuf, c->seqnr - c->queue, NULL);
+    c->queuedBytes -= pw->payload;
+    packetWrapFree(pw);
+    c->queue--;
+  }
+
+  // Closed and nothing kept for repairs anymore.
+  if (c->state == CS_FIN_SENT && c->queue == 0) {
+    connStateSwitch(c, CS_DESTROY);
+    return;
+  }
+
+  if (c->flushTicker && c->rdpSocket->ustime >= c->flushTicker)
+    rdpConnFlushPackets(c);
+
+  if (now >= c->groupTicker) {
+    sendForwardAck(c, c->seqnr - c->queue - 1);
+    c->groupTicker = now + RDP_GROUP_HEARTBEAT;
+  }
+}
+
+// NAK the packets missing, after a random backoff the first time so a NAK of
+// another member can come first and suppress it.
+static inline void rdpConnGroupMemberCheck(rdpConn *c) {
+  uint64_t now = c->rdpSocket->mstime;
+  uint16_t span = c->groupHighest - c->acknr;
+
+  if (!sixteenAfter(c->acknr, c->groupHighest) || span <= c->outOfOrderCnt) {
+    c->groupTicker = 0;
+    return;
+  }
+
+  if (!c->groupTicker) {
+    c->groupTicker = now + rand() % (RDP_GROUP_NAK_BACKOFF + 1);
+  } else if (now >= c->groupTicker) {
+    sendNak(c);
+    c->groupTicker = now + RDP_GROUP_NAK_INTERVAL;
+  }
+}
+
+// Flush packets and send acks.
+static inline int rdpConnCheck(rdpConn *c) {
+  assert(c->queue == 0 || rbufferGet(&c->outbuf, c->seqnr - c->queue));
+
+  switch (c->state) {
+  case CS_SYN_SENT:
+  case CS_SYN_RECV:
+  case CS_CONNECTED_FULL:
+  case CS_CONNECTED:
+  case CS_HALF_CLOSED:
+  case CS_FIN_SENT: {
+    if (c->groupSender) {
+      rdpConnGroupSenderCheck(c);
+      break;
+    }
+
+    if (c->groupMember) {
+      rdpConnGroupMemberCheck(c);
+      break;
+    }
+
+    // It's time for the connection timeout check.
+    if (c->rdpSocket->ustime >= c->retransmitTicker) {
+
+      // FIN wait timeout, for the ack or the other end's ST_FIN. Keep alives
+      // of an end not closing don't hold it up.
+      if (c->state == CS_FIN_SENT &&
+          (c->rdpSocket->mstime >=
+               c->lastReceivePacketTime + RDP_WAIT_FIN_SENT ||
+           (c->finAckedTime &&
+            c->rdpSocket->mstime >= c->finAckedTime + RDP_WAIT_FIN_SENT))) {
+        connStateSwitch(c, CS_DESTROY);
+
+        return 0;
+      }
+
+      // RECV wait state timeout.
+      if (c->state == CS_SYN_RECV &&
+          c->rdpSocket->mstime >=
+              c->lastReceivePacketTime + RDP_WAIT_SYN_RECV) {
+        connStateSwitch(c, CS_DESTROY);
+
+        return 0;
+      }
+
+      if (c->queue > 0) {
+        if (c->rdpSocket->mstime >=
+            c->lastResizeWindowTime + c->tunables.resizeWindowInterval)
+          resizeWindow(c);
+
+        // Packet retransmit.
+        for (uint16_t i = c->seqnr - c->queue; i != c->seqnr; i++) {
+          struct packetWrap *pw = rbufferGet(&c->outbuf, i);
+
+          // Stale packets reached retransmit timeout will be resent.
+          if (pw == NULL || pw->transmissions == 0 || pw->needResend == 1 ||
+              pw->abandoned ||
+              c->rdpSocket->ustime < pw->sentTime + c->retransmitTimeout)
+            continue;
+
+          // Stale packets need to resend.
+          pw->needResend = 1;
+
+          c->flightWindow -= pw->payload;
+        }
+
+        // Retransmitting.
+        if (rdpConnFlushPackets(c) == -1) {
+          // Connection is full of packets, can't retransmit now.
+          tlog(c->rdpSocket, LL_DEBUG | LL_RAW, "!");
         }
       }
 
-      return -1;
+      // Update after retransmit.
+      updateRetransmitTimeout(c);
     }
 
-    rdpConn *c = *conn;
+    if (c->expiringCnt) {
+      abandonExpiredPackets(c);
+      rdpConnForwardAck(c);
+    }
 
-    if (c->state == CS_RESET) {
-      // Packet's connection id shouldn't match this connection. Packet must
-      // be corrupted.
-      tlog(s, LL_DEBUG, "received %s, already in CS_RESET, connId: %d",
-           packetStateNames[type], connId);
+    rdpConnIssueTicket(c);
+
+    // Held trailing packet waited long enough.
+    if (c->flushTicker && c->rdpSocket->ustime >= c->flushTicker) {
+      rdpConnFlushPackets(c);
+    }
+
+    if (c->state == CS_CONNECTED || c->state == CS_CONNECTED_FULL ||
+        c->state == CS_HALF_CLOSED) {
+      if (c->rdpSocket->mstime >=
+          c->lastSendPacketTime + c->tunables.keepAliveInterval) {
+
+        rdpConnKeepAlive(c);
+      }
+    }
+
+    break;
+  }
+  case CS_RESET:
+    tlog(c->rdpSocket, LL_DEBUG, "CS_RESET, need user invoke rdpConnClose()");
+  case CS_UNINITIALIZED:
+  case CS_DESTROY:
+    break;
+  default:
+    assert(0);
+  }
+
+  // nextCheckTimeout should be the smallest timeout value needed for next
+  // retransmit action, not bigger than the default value. Retransmits are
+  // batched RDP_SOCKET_CHECK_TIMEOUT_MIN apart, but for fast paths with packets
+  // in flight only RDP_RETRANSMIT_TIMEOUT_FLOOR apart.
+  uint64_t timeout = c->retransmitTicker > c->rdpSocket->ustime
+                         ? c->retransmitTicker - c->rdpSocket->ustime
+                         : 0;
+  if (!c->tunables.retransmitTimeoutMinRtts || c->queue == 0)
+    timeout = max(RDP_SOCKET_CHECK_TIMEOUT_MIN * 1000, timeout);
+  else
+    timeout = max(RDP_RETRANSMIT_TIMEOUT_FLOOR, timeout);
+
+  c->rdpSocket->nextCheckTimeout =
+      min(RDP_SOCKET_CHECK_TIMEOUT_MAX * 1000,
+          min(c->rdpSocket->nextCheckTimeout, timeout));
+
+  // Not bounded by RDP_SOCKET_CHECK_TIMEOUT_MIN, the user asked for it.
+  if (c->flushTicker)
+    rdpSocketWakeAt(c->rdpSocket, c->flushTicker);
+
+  if (c->groupTicker && c->state != CS_DESTROY)
+    rdpSocketWakeAt(c->rdpSocket, c->groupTicker * 1000);
+
+  // Once passed, it's up to rdpReadPoll() to report it.
+  if (c->callDeadline > c->rdpSocket->mstime)
+    rdpSocketWakeAt(c->rdpSocket, c->callDeadline * 1000);
+}
+
+// Should be invoked periodically, before program go into epoll_wait() sleep.
+// Return a timeout next time this function should be invoked again, in
+// milliseconds.
+int rdpSocketIntervalAction(rdpSocket *s) {
+  int64_t timeout = rdpSocketIntervalActionUs(s);
+  if (timeout == -1)
+    return -1;
+
+  // Rounded up, waking up early would only spin.
+  return (timeout + 999) / 1000;
+}
+
+int64_t rdpSocketIntervalActionUs(rdpSocket *s) {
+  if (!s)
+    return -1;
+
+  rdpSocketTick(s);
+
+  if (s->ustime < s->lastCheck + s->nextCheckTimeout) {
+    return s->nextCheckTimeout - (s->ustime - s->lastCheck);
+  }
+
+  s->lastCheck = s->ustime;
+  s->nextCheckTimeout = RDP_SOCKET_CHECK_TIMEOUT_DEFAULT * 1000;
+
+  dictEntry *e;
+  rdpConn *c;
+  while (e = dictIteratorNext(s->connsIter)) {
+    c = (rdpConn *)dictKeyGet(e);
+
+    rdpConnCheck(c);
+
+    if (c->state == CS_DESTROY) {
+      rdpConnDestroy(c);
+    }
+  }
+  if (dictIteratorRewind(s->connsIter) != 0) {
+    assert(0);
+  }
+
+  return s->nextCheckTimeout;
+}
+
+rdpConn *rdpNetConnect(rdpSocket *s, const char *host, const char *service) {
+  rdpConn *c;
+  struct addrinfo hints;
+  struct addrinfo *result, *rp;
+  int connectRes, flags, conn, optval;
+
+  // Get address.
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_canonname = NULL;
+  hints.ai_addr = NULL;
+  hints.ai_next = NULL;
+  hints.ai_socktype = SOCK_DGRAM;
+  // AF_UNSPEC allows IPv4 or IPv6
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = AI_PASSIVE;
+
+  int res = getaddrinfo(host, service, &hints, &result);
+  if (res != 0) {
+    errno = ENOSYS;
+
+#ifdef RDP_DEBUG
+    write(STDOUT_FILENO, gai_strerror(res), strlen(gai_strerror(res)));
+#endif
+
+    return NULL;
+  }
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    c = rdpConnCreate(s);
+    if (c == NULL) {
+      tlog(s, LL_DEBUG, "rdpConnCreate");
+      return NULL;
+    }
+
+    connectRes = rdpConnect(c, result->ai_addr, result->ai_addrlen);
+    if (connectRes == -1) {
+      rdpConnClose(c);
+      continue;
+    }
+    break;
+  }
+
+  freeaddrinfo(result);
+
+  return (rp == NULL) ? NULL : c;
+}
+
+int rdpConnGetAddr(rdpConn *c, struct sockaddr *addr, socklen_t *addrlen) {
+  if (!c) {
+    return -1;
+  }
 
-      return -1;
-    }
+  *addr = *(struct sockaddr *)&c->addr;
 
-    if (c->state == CS_DESTROY) {
-      tlog(s, LL_DEBUG, "received %s, already in CS_DESTROY, connId: %d",
-           packetStateNames[type], connId);
+  *addrlen = c->addrlen;
 
-      return -1;
-    }
+  return 0;
+}
 
-    if (c->queue == 0)
-      assert(c->flightWindow == 0);
-    assert(c->queue == 0 || rbufferGet(&c->outbuf, c->seqnr - c->queue));
+// Open a conn sending to the multicast group "group:service", from s. Members
+// get its data from sockets created by rdpGroupSocketCreate(), one rdpConn per
+// sender reported by RDP_ACCEPT, and NAK what they miss.
+rdpConn *rdpGroupOpen(rdpSocket *s, const char *group, const char *service) {
+  struct addrinfo hints;
+  struct addrinfo *result;
 
-    // Ignore packets with invalid acknr.
-    if ((sixteenAfter(c->seqnr - 1, packnr) ||
-         sixteenAfter(packnr, c->seqnr - 1 - c->queue -
-                                  RDP_ACK_NR_RECV_BEHIND_ALLOWED))) {
-      tlog(c->rdpSocket, LL_DEBUG, "wrong acknr: %d, packet type: %d",
-           c->seqnr - 1 - c->queue - packnr, type);
-      return -1;
-    }
+  if (!s || !group || !service) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-    const uint8_t *sackMask = NULL;
-    uint8_t extension = p->reserve;
-    const uint8_t *payloadStart = (const uint8_t *)p + getPacketHeaderSize();
-    const uint8_t *payloadEnd = buf + rawRead;
-    ssize_t payload = payloadEnd - payloadStart;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_family = AF_UNSPEC;
 
-    if (extension != 0) {
-      do {
-        payloadStart += 2;
+  if (getaddrinfo(group, service, &hints, &result) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-        assert((payloadEnd - payloadStart) >= payloadStart[-1]);
+  rdpConn *c = rdpConnCreate(s);
+  if (c == NULL) {
+    freeaddrinfo(result);
+    return NULL;
+  }
 
-        switch (extension) {
-        case 1:
-          sackMask = payloadStart;
-          break;
-        default:
-          tlog(c->rdpSocket, LL_DEBUG, "unknown reserved bits.");
-          break;
-        }
-        extension = payloadStart[-2];
-        payloadStart += payloadStart[-1];
-      } while (extension);
-    }
+  rdpSocketTick(s);
+  rdpConnInit(c, result->ai_addr, result->ai_addrlen, 1, 0, 0, 1);
+  freeaddrinfo(result);
 
-    if (c->state == CS_SYN_SENT) {
-      c->acknr = (pseqnr - 1) & RDP_SEQ_NR_MASK;
-    }
+  c->groupSender = 1;
+  connStateSwitch(c, CS_CONNECTED);
 
-    // The distance between the latest packet we have supplied back to user and
-    // current packet minus 1. 0 means the right next packet we need.
-    const uint seqCnt = (pseqnr - c->acknr - 1) & RDP_SEQ_NR_MASK;
+  // Announce the sender right away.
+  c->groupTicker = s->mstime;
+  rdpSocketWakeAt(s, c->groupTicker * 1000);
 
-    if (seqCnt >= RDP_QUEUE_SIZE_MAX) {
-      // Packet can't be placed in our input buffer.
-      if (seqCnt >= (RDP_SEQ_NR_MASK + 1) - RDP_QUEUE_SIZE_MAX) {
-        // This is a outdated duplicated packet.
-        c->needSendAck = 1;
+  return c;
+}
 
-        c->outOfDateSum++;
+// Create a rdpSocket receiving from the multicast group "group:service". It's
+// bound to the wildcard address, shared with other members on the host.
+rdpSocket *rdpGroupSocketCreate(int version, const char *group,
+                                const char *service) {
+  struct addrinfo hints;
+  struct addrinfo *result;
 
-        // Print every outdated duplicated packets as "#".
-        tlog(c->rdpSocket, LL_RAW | LL_DEBUG, "#");
-      } else {
-        // SeqCnt is far beyond our buffer size which is unexcepted.
-        tlog(c->rdpSocket, LL_DEBUG, "packet wrong seqnr: %d.", seqCnt);
-      }
+  if (!group || !service) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-      return -1;
-    }
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_family = AF_UNSPEC;
 
-    c->lastReceivePacketTime = c->rdpSocket->mstime;
+  if (getaddrinfo(group, service, &hints, &result) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-    uint16_t ackCnt = (packnr - (c->seqnr - c->queue) + 1) & RDP_ACK_NR_MASK;
+  int family = result->ai_family;
+  rdpSocket *s = socketCreate(version, family == AF_INET6 ? "::" : "0.0.0.0",
+                              service, 1);
+  if (s == NULL) {
+    freeaddrinfo(result);
+    return NULL;
+  }
 
-    if (ackCnt > c->queue) {
-      ackCnt = 0;
-    }
+  memcpy(&s->group, result->ai_addr, result->ai_addrlen);
+  s->groupLen = result->ai_addrlen;
+  freeaddrinfo(result);
 
-    c->recvWindowPeer = p->window;
+  int n;
+  if (family == AF_INET6) {
+    struct ipv6_mreq mreq;
+    mreq.ipv6mr_multiaddr = ((struct sockaddr_in6 *)&s->group)->sin6_addr;
+    mreq.ipv6mr_interface = 0;
+    n = setsockopt(s->fd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq));
+  } else {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = ((struct sockaddr_in *)&s->group)->sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    n = setsockopt(s->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+  }
 
-    // Connection handshake.
-    if (type == ST_DATA && c->state == CS_SYN_RECV) {
-      connStateSwitch(c, CS_CONNECTED);
-      *events = RDP_ACCEPT;
-    }
+  if (n == -1) {
+    int err = errno;
+    rdpSocketDestroy(s);
+    errno = err;
+    return NULL;
+  }
 
-    if (type == ST_STATE && c->state == CS_SYN_SENT) {
-      // Outgoing connection completion.
-      connStateSwitch(c, CS_CONNECTED);
-      *events = RDP_CONNECTED;
-    }
+  return s;
+}
 
-    if (c->state == CS_FIN_SENT && c->queue == ackCnt) {
-      // Active close completion.
-      connStateSwitch(c, CS_DESTROY);
+// Leads the state of rdpSocketExport(), "RDPS".
+#define STATE_MAGIC 0x53504452
+#define STATE_VERSION 5
+
+// Over the state of rdpSocketExport(). Writes past len are only counted, so
+// the size needed is known. Reads past len set err.
+struct stateCursor {
+  uint8_t *p;
+  size_t len;
+  size_t n;
+  int err;
+};
 
-      tlog(c->rdpSocket, LL_DEBUG,
-           "change state to CS_DESTROY, active close completion.");
-    }
+static inline void statePut(struct stateCursor *cur, const void *v,
+                            size_t len) {
+  if (cur->n + len <= cur->len)
+    memcpy(cur->p + cur->n, v, len);
+  cur->n += len;
+}
 
-    for (int i = 0; i < ackCnt; ++i) {
-      ackPacket(c, c->seqnr - c->queue);
-      c->queue--;
-    }
+static inline void statePut8(struct stateCursor *cur, uint8_t v) {
+  statePut(cur, &v, sizeof(v));
+}
 
-    while (c->queue > 0 && !rbufferGet(&c->outbuf, c->seqnr - c->queue)) {
-      // todo error
-      assert(!sackMask);
+static inline void statePut16(struct stateCursor *cur, uint16_t v) {
+  statePut(cur, &v, sizeof(v));
+}
 
-      c->queue--;
-    }
+static inline void statePut32(struct stateCursor *cur, uint32_t v) {
+  statePut(cur, &v, sizeof(v));
+}
 
-    if (c->queue > 0 && sackMask) {
-      selectiveAck(c, packnr + 2, sackMask, sackMask[-1]);
-    }
+static inline void statePut64(struct stateCursor *cur, uint64_t v) {
+  statePut(cur, &v, sizeof(v));
+}
 
-    if (c->queue == 0)
-      assert(c->flightWindow == 0);
-    assert(c->queue == 0 || rbufferGet(&c->outbuf, c->seqnr - c->queue));
+static inline void stateGet(struct stateCursor *cur, void *v, size_t len) {
+  if (cur->err || len > cur->len - cur->n) {
+    cur->err = 1;
+    memset(v, 0, len);
+    return;
+  }
 
-    if (c->state == CS_CONNECTED_FULL && !rdpConnFlightWindowFull(c)) {
-      connStateSwitch(c, CS_CONNECTED);
+  memcpy(v, cur->p + cur->n, len);
+  cur->n += len;
+}
 
-      *events |= RDP_POLLOUT;
-    }
+static inline uint8_t stateGet8(struct stateCursor *cur) {
+  uint8_t v;
+  stateGet(cur, &v, sizeof(v));
+  return v;
+}
 
-    if (type == ST_STATE) {
-      return -1;
-    }
+static inline uint16_t stateGet16(struct stateCursor *cur) {
+  uint16_t v;
+  stateGet(cur, &v, sizeof(v));
+  return v;
+}
 
-    if (c->state != CS_CONNECTED && c->state != CS_CONNECTED_FULL &&
-        c->state != CS_FIN_SENT) {
-      tlog(c->rdpSocket, LL_DEBUG, "connection not connected. state: %s",
-           connStateNames[c->state]);
-      return -1;
-    }
+static inline uint32_t stateGet32(struct stateCursor *cur) {
+  uint32_t v;
+  stateGet(cur, &v, sizeof(v));
+  return v;
+}
 
-    if (type == ST_FIN) {
-      if (c->state == CS_FIN_SENT) {
-        connStateSwitch(c, CS_DESTROY);
+static inline uint64_t stateGet64(struct stateCursor *cur) {
+  uint64_t v;
+  stateGet(cur, &v, sizeof(v));
+  return v;
+}
 
-        return -1;
-      }
+static inline void msgAssemblyExport(struct stateCursor *cur,
+                                     const struct msgAssembly *m) {
+  statePut8(cur, m->active);
+  statePut32(cur, m->active ? m->len : 0);
+  if (m->active)
+    statePut(cur, m->buf, m->len);
+}
 
-      if (!c->receivedFin) {
-        // Passive close received.
-        c->receivedFin = 1;
-        c->eofseqnr = pseqnr;
-      }
-    }
+static inline void msgAssemblyImport(struct stateCursor *cur,
+                                     struct msgAssembly *m) {
+  m->active = stateGet8(cur);
+  size_t len = stateGet32(cur);
 
-    if (c->state != CS_CONNECTED && c->state != CS_CONNECTED_FULL) {
-      return -1;
-    }
+  if (len > RDP_MESSAGE_SIZE_MAX || len > cur->len - cur->n) {
+    cur->err = 1;
+    return;
+  }
 
-    if (seqCnt == 0) {
-      // This packet is the right next packet expected. Return it to user
-      // directly.
-      if (payload > 0) {
+  if (len) {
+    m->buf = (unsigned char *)rdpMalloc(len);
+    assert(m->buf);
+    m->cap = len;
+    stateGet(cur, m->buf, len);
+  }
+  m->len = len;
+}
 
-        // Exceeded supplied buffer length.
-        if (payload > len) {
-          *events = RDP_ERROR;
+// Whether c is carried over by rdpSocketExport(). Conns reset or destroyed
+// are dropped, there's nothing left to resume.
+static inline int rdpConnExportable(const rdpConn *c) {
+  return c->state != CS_UNINITIALIZED && c->state != CS_RESET &&
+         c->state != CS_DESTROY;
+}
 
-          tlog(c->rdpSocket, LL_DEBUG,
-               "payloadCnt exceeded supplied buf length.");
+static void rdpConnExport(rdpConn *c, struct stateCursor *cur) {
+  const size_t packetHeaderSize = getPacketHeaderSize();
+  dictEntry *e;
 
-          return -1;
-        } else {
-          memmove(buf, payloadStart, payload);
-          *events |= RDP_DATA;
-        }
-      }
+  statePut32(cur, c->addrlen);
+  statePut(cur, &c->addr, c->addrlen);
+  statePut16(cur, c->idSeed);
+  statePut16(cur, c->recvId);
+  statePut16(cur, c->sendId);
+  statePut8(cur, c->state);
+  statePut64(cur, (uintptr_t)c->userData);
+  statePut(cur, &c->tunables, sizeof(c->tunables));
+
+  statePut16(cur, c->seqnr);
+  statePut16(cur, c->queue);
+  statePut16(cur, c->acknr);
+  statePut16(cur, c->eofseqnr);
+  statePut16(cur, c->skipnr);
+  statePut16(cur, c->outOfOrderCnt);
+  statePut16(cur, c->expiringCnt);
+  statePut8(cur, c->skipPending | c->streamPending << 1 | c->unordered << 2 |
+                     c->corked << 3 | c->hasTicket << 4 |
+                     c->receivedFin << 5 | c->receivedFinCompleted << 6);
+
+  statePut32(cur, c->rtt);
+  statePut32(cur, c->rttVar);
+  statePut32(cur, c->minRtt);
+  statePut32(cur, c->nextRetransmitTimeout);
+  statePut32(cur, c->retransmitTimeout);
+  statePut64(cur, c->retransmitTicker);
+  statePut32(cur, c->flightWindow);
+  statePut32(cur, c->flightWindowLimit);
+  statePut32(cur, c->recvWindowPeer);
+  statePut32(cur, c->recvWindowSelf);
+  statePut32(cur, c->lastResizeWindowTime);
+  statePut32(cur, c->sentBytesSinceResizeWindow);
+  statePut32(cur, c->ackedBytesSinceResizeWindow);
+  statePut64(cur, c->lastReceivePacketTime);
+  statePut64(cur, c->lastSendPacketTime);
+  statePut64(cur, c->finAckedTime);
+  statePut32(cur, c->corkDelay);
+  statePut32(cur, c->coalesceDelay);
+  statePut32(cur, c->sendLowWater);
+  statePut32(cur, c->sendHighWater);
+  statePut64(cur, c->flushTicker);
+  statePut64(cur, c->ticketTicker);
+  statePut(cur, &c->ticket, sizeof(c->ticket));
+  statePut32(cur, c->nextCallId);
+  statePut64(cur, c->callDeadline);
+  msgAssemblyExport(cur, &c->msg);
+
+  statePut32(cur, c->streams ? dictFilled(c->streams) : 0);
+  while (c->streams && (e = dictIteratorNext(c->streamsIter))) {
+    struct rdpStream *st = (struct rdpStream *)dictKeyGet(e);
+
+    statePut16(cur, st->id);
+    statePut16(cur, st->sendSeqnr);
+    statePut16(cur, st->recvSeqnr);
+    msgAssemblyExport(cur, &st->msg);
+  }
+  if (c->streams && dictIteratorRewind(c->streamsIter) != 0) {
+    assert(0);
+  }
 
-      // Record where the user have got of data.
-      c->acknr++;
+  statePut32(cur, c->calls ? dictFilled(c->calls) : 0);
+  while (c->calls && (e = dictIteratorNext(c->callsIter))) {
+    struct pendingCall *pc = (struct pendingCall *)dictKeyGet(e);
 
-      // acknr have updated, notify the other end.
-      c->needSendAck = 1;
+    statePut32(cur, pc->id);
+    statePut64(cur, (uintptr_t)pc->cookie);
+    statePut64(cur, pc->deadline);
+  }
+  if (c->calls && dictIteratorRewind(c->callsIter) != 0) {
+    assert(0);
+  }
 
-      // Print every the right next packet as a ".".
-      tlog(c->rdpSocket, LL_RAW | LL_DEBUG, ".");
+  // Unacked packets, payload of rdpSendFile() is copied in.
+  for (uint16_t i = c->seqnr - c->queue; i != c->seqnr; i++) {
+    struct packetWrap *pw = rbufferGet(&c->outbuf, i);
 
-      // Current packet might have filled the out of order hole.
-      // Invoke rdpReadPoll() again to try reading them.
-      return payload == 0 ? -1 : payload;
-    } else {
-      // seqCnt != 0, this is an out of order packet.
+    statePut8(cur, pw != NULL);
+    if (!pw)
+      continue;
 
-      if (c->receivedFin && pseqnr > c->eofseqnr) {
+    statePut64(cur, pw->sentTime);
+    statePut64(cur, pw->deadline);
+    statePut32(cur, pw->transmissions);
+    statePut8(cur, pw->needResend | pw->abandoned << 1);
+    statePut32(cur, pw->payload);
+    statePut(cur, pw->data, packetHeaderSize);
+    statePut(cur, pw->map ? pw->ref : pw->data + packetHeaderSize,
+             pw->payload);
+  }
 
-        tlog(c->rdpSocket, LL_DEBUG, "seqnr bigger than eof packet.");
-        return -1;
-      }
+  // Out of order packets, each led by 1, then 0.
+  for (size_t i = 0; c->inbuf.elements && i <= c->inbuf.mask; i++) {
+    uint16_t seqnr = c->acknr + 1 + i;
+    struct inPacket *ip = rbufferGet(&c->inbuf, seqnr);
+    if (!ip)
+      continue;
 
-      rbufferEnsureSize(&c->inbuf, pseqnr + 1, seqCnt + 1);
+    statePut8(cur, 1);
+    statePut16(cur, seqnr);
+    statePut32(cur, ip->payload);
+    statePut16(cur, ip->streamId);
+    statePut16(cur, ip->streamSeqnr);
+    statePut8(cur, ip->msgFlags);
+    statePut8(cur, ip->delivered);
+    statePut(cur, ip->data, ip->payload);
+  }
+  statePut8(cur, 0);
+}
 
-      if (rbufferGet(&c->inbuf, pseqnr) != NULL) {
+// Rebuild a conn of rdpConnExport() in s. Return -1 if the state is malformed,
+// the conn might be registered in s by then, it's freed along with s.
+static int rdpConnImport(rdpSocket *s, struct stateCursor *cur) {
+  const size_t packetHeaderSize = getPacketHeaderSize();
+  const size_t maxPacketPayloadSize = getMaxPacketPayloadSize();
+  struct sockaddr_storage addr;
 
-        // Print every duplicated out of order packet as "+".
-        tlog(c->rdpSocket, LL_DEBUG | LL_RAW, "+");
+  socklen_t addrlen = stateGet32(cur);
+  if (addrlen == 0 || addrlen > sizeof(addr))
+    return -1;
+  stateGet(cur, &addr, addrlen);
+  uint16_t idSeed = stateGet16(cur);
+  uint16_t recvId = stateGet16(cur);
+  uint16_t sendId = stateGet16(cur);
+  uint8_t state = stateGet8(cur);
+
+  if (cur->err || state == CS_UNINITIALIZED || state >= CS_RESET ||
+      findRdpConnInRdpSocket(s, (struct sockaddr *)&addr, addrlen, recvId))
+    return -1;
 
-        c->needSendAck = 1;
+  rdpConn *c = rdpConnCreate(s);
+  assert(c);
+  rdpConnInit(c, (struct sockaddr *)&addr, addrlen, 0, idSeed, recvId, sendId);
+  c->state = state;
+  c->userData = (void *)(uintptr_t)stateGet64(cur);
+  stateGet(cur, &c->tunables, sizeof(c->tunables));
+  if (!tunablesValid(&c->tunables))
+    return -1;
 
-        c->outOfOrderDuplicatedSum++;
+  // Packets of outbuf are put back from seqnr - queue on.
+  uint16_t seqnr = stateGet16(cur);
+  uint16_t queue = stateGet16(cur);
+  if (queue >= RDP_QUEUE_SIZE_MAX)
+    return -1;
+  c->seqnr = seqnr - queue;
+
+  c->acknr = stateGet16(cur);
+  c->eofseqnr = stateGet16(cur);
+  c->skipnr = stateGet16(cur);
+  c->outOfOrderCnt = stateGet16(cur);
+  c->expiringCnt = stateGet16(cur);
+  uint8_t flags = stateGet8(cur);
+  c->skipPending = flags & 1;
+  c->streamPending = flags >> 1 & 1;
+  c->unordered = flags >> 2 & 1;
+  c->corked = flags >> 3 & 1;
+  c->hasTicket = flags >> 4 & 1;
+  c->receivedFin = flags >> 5 & 1;
+  c->receivedFinCompleted = flags >> 6 & 1;
+
+  c->rtt = stateGet32(cur);
+  c->rttVar = stateGet32(cur);
+  c->minRtt = stateGet32(cur);
+  c->nextRetransmitTimeout = stateGet32(cur);
+  c->retransmitTimeout = stateGet32(cur);
+  c->retransmitTicker = stateGet64(cur);
+  c->flightWindow = stateGet32(cur);
+  c->flightWindowLimit = stateGet32(cur);
+  c->recvWindowPeer = stateGet32(cur);
+  c->recvWindowSelf = stateGet32(cur);
+  c->lastResizeWindowTime = stateGet32(cur);
+  c->sentBytesSinceResizeWindow = stateGet32(cur);
+  c->ackedBytesSinceResizeWindow = stateGet32(cur);
+  c->lastReceivePacketTime = stateGet64(cur);
+  c->lastSendPacketTime = stateGet64(cur);
+  c->finAckedTime = stateGet64(cur);
+  c->corkDelay = stateGet32(cur);
+  c->coalesceDelay = stateGet32(cur);
+  c->sendLowWater = stateGet32(cur);
+  c->sendHighWater = stateGet32(cur);
+  c->flushTicker = stateGet64(cur);
+  c->ticketTicker = stateGet64(cur);
+  stateGet(cur, &c->ticket, sizeof(c->ticket));
+  c->nextCallId = stateGet32(cur);
+  c->callDeadline = stateGet64(cur);
+  msgAssemblyImport(cur, &c->msg);
+
+  uint32_t streams = stateGet32(cur);
+  if (streams > RDP_MAX_STREAMS_PER_CONN)
+    return -1;
+  for (uint32_t i = 0; i < streams && !cur->err; i++) {
+    struct rdpStream *st = rdpConnGetStream(c, stateGet16(cur), 1);
+    if (!st)
+      return -1;
 
-        return -1;
-      }
+    st->sendSeqnr = stateGet16(cur);
+    st->recvSeqnr = stateGet16(cur);
+    msgAssemblyImport(cur, &st->msg);
+  }
 
-      uint8_t *packetWithPrefix = (uint8_t *)malloc(payload + sizeof(uint));
-      assert(packetWithPrefix);
-      *(uint *)packetWithPrefix = (uint)payload;
-      memcpy(packetWithPrefix + sizeof(uint), payloadStart, payload);
+  uint32_t calls = stateGet32(cur);
+  for (uint32_t i = 0; i < calls && !cur->err; i++) {
+    if (!c->calls) {
+      c->calls = dictCreate(&pendingCallDictType);
+      assert(c->calls);
 
-      assert((pseqnr & c->inbuf.mask) != ((c->acknr + 1) & c->inbuf.mask));
+      c->callsIter = dictIteratorCreate(c->calls);
+      assert(c->callsIter);
+    }
 
-      rbufferPut(&c->inbuf, pseqnr, packetWithPrefix);
+    struct pendingCall *pc = (struct pendingCall *)rdpMalloc(sizeof(*pc));
+    assert(pc);
+    pc->id = stateGet32(cur);
+    pc->cookie = (void *)(uintptr_t)stateGet64(cur);
+    pc->deadline = stateGet64(cur);
 
-      // Print every unique out of order packet as "-".
-      tlog(c->rdpSocket, LL_DEBUG | LL_RAW, "-");
+    if (dictAdd(c->calls, pc, NULL) != 0) {
+      rdpFree(pc);
+      return -1;
+    }
+  }
 
-      c->needSendAck = 1;
+  for (uint16_t i = 0; i < queue && !cur->err; i++) {
+    rbufferEnsureSize(&c->outbuf, c->seqnr, c->queue);
+    if (!stateGet8(cur)) {
+      c->seqnr++;
+      c->queue++;
+      continue;
+    }
 
-      c->outOfOrderCnt++;
+    uint64_t sentTime = stateGet64(cur);
+    uint64_t deadline = stateGet64(cur);
+    uint32_t transmissions = stateGet32(cur);
+    uint8_t resend = stateGet8(cur);
+    size_t payload = stateGet32(cur);
+    if (payload > maxPacketPayloadSize)
+      return -1;
 
-      c->outOfOrderSum++;
+    struct packetWrap *pw = (struct packetWrap *)rdpMalloc(
+        (getPacketWrapSize() - 1) + packetHeaderSize + payload);
+    assert(pw);
+    pw->sentTime = sentTime;
+    pw->deadline = deadline;
+    pw->transmissions = transmissions;
+    pw->needResend = resend & 1;
+    pw->abandoned = resend >> 1 & 1;
+    pw->payload = payload;
+    pw->map = NULL;
+    stateGet(cur, pw->data, packetHeaderSize + payload);
+
+    rbufferPut(&c->outbuf, c->seqnr, pw);
+    c->seqnr++;
+    c->queue++;
+    c->queuedBytes += payload;
+  }
+
+  while (!cur->err && stateGet8(cur)) {
+    uint16_t pseqnr = stateGet16(cur);
+    uint16_t seqCnt = pseqnr - c->acknr - 1;
+    size_t payload = stateGet32(cur);
+    if (seqCnt >= RDP_QUEUE_SIZE_MAX || payload > maxPacketPayloadSize)
+      return -1;
 
+    struct inPacket *ip = (struct inPacket *)rdpMalloc(
+        offsetof(struct inPacket, data) + payload);
+    assert(ip);
+    ip->payload = payload;
+    ip->streamId = stateGet16(cur);
+    ip->streamSeqnr = stateGet16(cur);
+    ip->msgFlags = stateGet8(cur);
+    ip->delivered = stateGet8(cur);
+    stateGet(cur, ip->data, payload);
+
+    rbufferEnsureSize(&c->inbuf, pseqnr + 1, seqCnt + 1);
+    if (rbufferGet(&c->inbuf, pseqnr)) {
+      rdpFree(ip);
       return -1;
     }
+    rbufferPut(&c->inbuf, pseqnr, ip);
 
-    assert(0);
-  } else {
-    // Unknown packet type. Corrupted packet.
+    if (ip->streamId && !ip->delivered) {
+      struct rdpStream *st = rdpConnGetStream(c, ip->streamId, 1);
+      if (!st)
+        return -1;
+
+      uint16_t distance = ip->streamSeqnr - st->recvSeqnr;
+      rbufferEnsureSize(&st->held, ip->streamSeqnr + 1, distance + 1);
+      rbufferPut(&st->held, ip->streamSeqnr, ip);
+    }
   }
 
-  return -1;
+  if (cur->err || c->seqnr != seqnr)
+    return -1;
+
+  // Tell the other end where we are right away, the user learns of the conn
+  // by RDP_ACCEPT.
+  c->needSendAck = 1;
+  c->resumed = state == CS_CONNECTED || state == CS_CONNECTED_FULL ||
+               state == CS_HALF_CLOSED;
+
+  return 0;
 }
 
-void *rdpConnGetUserData(rdpConn *c) { return c->userData; }
+// Sockets of groups, splices, sinks, and writes rdpSocketSubmit() couldn't
+// queue yet are left out, see rdp.h.
+ssize_t rdpSocketExport(rdpSocket *s, void *buf, size_t len) {
+  if (!s || (len && !buf)) {
+    errno = EINVAL;
+    return -1;
+  }
 
-int rdpConnSetUserData(rdpConn *c, void *userData) {
-  assert(c);
-  if (!c)
+  rdpSocketDrainSubmissions(s);
+
+  uint32_t conns = 0;
+  int busy = s->groupLen || s->splices || s->submitConns;
+  dictEntry *e;
+
+  while (e = dictIteratorNext(s->connsIter)) {
+    rdpConn *c = (rdpConn *)dictKeyGet(e);
+
+    if (!rdpConnExportable(c))
+      continue;
+
+    if (c->groupSender || c->groupMember || c->sink || c->ready)
+      busy = 1;
+    conns++;
+  }
+  if (dictIteratorRewind(s->connsIter) != 0) {
+    assert(0);
+  }
+
+  if (busy) {
+    errno = EBUSY;
     return -1;
+  }
+
+  struct stateCursor cur = {(uint8_t *)buf, len, 0, 0};
 
-  c->userData = userData;
+  statePut32(&cur, STATE_MAGIC);
+  statePut32(&cur, STATE_VERSION);
+  statePut32(&cur, RDP_UDP_MTU);
+  statePut32(&cur, RDP_QUEUE_SIZE_MAX);
+  statePut(&cur, s->ticketKey, sizeof(s->ticketKey));
+  statePut32(&cur, s->sendBufferSize);
+  statePut32(&cur, s->recvBufferSize);
+  statePut(&cur, &s->tunables, sizeof(s->tunables));
+  statePut32(&cur, conns);
 
-  return 0;
+  while (e = dictIteratorNext(s->connsIter)) {
+    rdpConn *c = (rdpConn *)dictKeyGet(e);
+
+    if (rdpConnExportable(c))
+      rdpConnExport(c, &cur);
+  }
+  if (dictIteratorRewind(s->connsIter) != 0) {
+    assert(0);
+  }
+
+  return cur.n;
 }
 
-int rdpSocketGetProp(rdpSocket *s, int opt) {
-  assert(s);
-  if (!s)
-    return -1;
+rdpSocket *rdpSocketImport(int fd, const void *buf, size_t len) {
+  if (fd < 0 || !buf) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-  switch (opt) {
-  case RDP_PROP_FD:
-    return s->fd;
-  case RDP_PROP_SNDBUF:
-    return s->sendBufferSize;
-  case RDP_PROP_RCVBUF:
-    return s->recvBufferSize;
+  struct stateCursor cur = {(uint8_t *)buf, len, 0, 0};
+
+  // Both ends of a conn should be built alike, see RDP_UDP_MTU.
+  if (stateGet32(&cur) != STATE_MAGIC || stateGet32(&cur) != STATE_VERSION ||
+      stateGet32(&cur) != RDP_UDP_MTU ||
+      stateGet32(&cur) != RDP_QUEUE_SIZE_MAX) {
+    errno = EINVAL;
+    return NULL;
   }
-  return -1;
-}
 
-int rdpSocketSetProp(rdpSocket *s, int opt, int val) {
+  rdpSocket *s = socketOpen(fd);
   if (!s)
-    return -1;
+    return NULL;
 
-  switch (opt) {
-  case RDP_PROP_FD:
-    s->fd = val;
-    return 0;
+  stateGet(&cur, s->ticketKey, sizeof(s->ticketKey));
+  s->sendBufferSize = stateGet32(&cur);
+  s->recvBufferSize = stateGet32(&cur);
+  stateGet(&cur, &s->tunables, sizeof(s->tunables));
+  if (!tunablesValid(&s->tunables))
+    cur.err = 1;
+
+  uint32_t conns = stateGet32(&cur);
+  for (uint32_t i = 0; i < conns && !cur.err; i++) {
+    if (rdpConnImport(s, &cur) == -1)
+      cur.err = 1;
+  }
 
-  case RDP_PROP_SNDBUF:
-    s->sendBufferSize = val;
-    return 0;
+  if (cur.err || cur.n != len) {
+    // fd stays the caller's.
+    s->fd = -1;
+    rdpSocketDestroy(s);
 
-  case RDP_PROP_RCVBUF:
-    s->recvBufferSize = val;
-    return 0;
+    errno = EINVAL;
+    return NULL;
   }
-  return -1;
+
+  return s;
 }
 
-// Use ack packet as keep alive probe.
-static inline void rdpConnKeepAlive(rdpConn *c) {
-  c->acknr--;
+int rdpSocketHandoff(rdpSocket *s, int unixFd) {
+  ssize_t n = rdpSocketExport(s, NULL, 0);
+  if (n == -1)
+    return -1;
 
-  tlog(c->rdpSocket, LL_DEBUG, "rdpConnKeepAlive");
+  uint8_t *state = (uint8_t *)rdpMalloc(n);
+  if (!state) {
+    errno = ENOMEM;
+    return -1;
+  }
+  rdpSocketExport(s, state, n);
+
+  // The size rides with the fd, the state follows.
+  uint64_t size = n;
+  struct iovec iov = {&size, sizeof(size)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {0};
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &s->fd, sizeof(int));
+
+  int ret = sendmsg(unixFd, &msg, 0) == sizeof(size) ? 0 : -1;
+
+  for (size_t sent = 0; ret == 0 && sent < (size_t)n;) {
+    ssize_t w = write(unixFd, state + sent, n - sent);
+    if (w == -1 && errno != EINTR)
+      ret = -1;
+    else if (w > 0)
+      sent += w;
+  }
 
-  sendAck(c);
+  rdpFree(state);
 
-  c->acknr++;
+  return ret;
 }
 
-static inline int resizeWindow(rdpConn *c) {
-  // Shrink when no packets sent have acked, until the window can fit only one
-  // packet.
-  if (c->ackedBytesSinceResizeWindow == 0 &&
-      c->sentBytesSinceResizeWindow > 0) {
-    c->flightWindowLimit =
-        limitedWindow(c->flightWindow / RDP_WINDOW_SHRINK_FACTOR);
-  } else if (c->ackedBytesSinceResizeWindow > 0) {
-    c->flightWindowLimit =
-        limitedWindow(c->flightWindowLimit * RDP_WINDOW_EXPAND_FACTOR);
-  } else {
-    // Stay the same.
-  }
-
-  c->ackedBytesSinceResizeWindow = c->sentBytesSinceResizeWindow = 0;
+rdpSocket *rdpSocketTakeover(int unixFd) {
+  uint64_t size = 0;
+  struct iovec iov = {&size, sizeof(size)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {0};
+  int fd = -1;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t n = recvmsg(unixFd, &msg, MSG_WAITALL);
+  if (n == -1)
+    return NULL;
 
-  return 0;
-}
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
 
-// Only update after the end of a retransmit event.
-static inline int updateRetransmitTimeout(rdpConn *c) {
-  uint32_t lastSendTimeToNow = 0;
-  if (c->queue != 0) {
-    // Retrieve the oldest sent but not acked packet in output buffer.
-    struct packetWrap *pw =
-        (struct packetWrap *)rbufferGet(&c->outbuf, c->seqnr - c->queue);
+  if (n != sizeof(size) || fd == -1) {
+    if (fd != -1)
+      close(fd);
 
-    assert(pw);
-    assert(pw->transmissions);
-    assert(pw->sentTime);
+    errno = EPROTO;
+    return NULL;
+  }
 
-    lastSendTimeToNow = c->rdpSocket->mstime - pw->sentTime;
+  uint8_t *state = (uint8_t *)rdpMalloc(size);
+  if (!state) {
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
   }
 
-  // Update retransmitTimeout.
-  c->retransmitTimeout = c->nextRetransmitTimeout - lastSendTimeToNow;
+  for (size_t got = 0; got < size;) {
+    ssize_t r = read(unixFd, state + got, size - got);
+    if (r == 0)
+      errno = EPROTO;
+    if (r == 0 || (r == -1 && errno != EINTR)) {
+      int err = errno;
+      rdpFree(state);
+      close(fd);
+      errno = err;
+      return NULL;
+    }
+    if (r > 0)
+      got += r;
+  }
 
-  if (c->retransmitTimeout < 0)
-    c->retransmitTimeout = 0;
+  rdpSocket *s = rdpSocketImport(fd, state, size);
+  if (!s) {
+    int err = errno;
+    close(fd);
+    errno = err;
+  }
 
-  // retransmitTicker of connection can only be updated here.
-  c->retransmitTicker = c->rdpSocket->mstime + c->retransmitTimeout;
+  rdpFree(state);
 
-  return 0;
+  return s;
 }
 
-// Flush packets and send acks.
-static inline int rdpConnCheck(rdpConn *c) {
-  assert(c->queue == 0 || rbufferGet(&c->outbuf, c->seqnr - c->queue));
+#define SHARD_MSG_USER 0
+#define SHARD_MSG_CONNECT 1
 
-  switch (c->state) {
-  case CS_SYN_SENT:
-  case CS_SYN_RECV:
-  case CS_CONNECTED_FULL:
-  case CS_CONNECTED:
-  case CS_FIN_SENT: {
-    // It's time for the connection timeout check.
-    if (c->rdpSocket->mstime >= c->retransmitTicker) {
+// Sent to a shard's mailbox.
+struct shardMsg {
+  int type;
+  void *msg;      // SHARD_MSG_USER.
+  void *userData; // SHARD_MSG_CONNECT, host and service follow in data.
+  size_t serviceOff;
+  char data[1];
+};
 
-      // FIN wait timeout.
-      if (c->state == CS_FIN_SENT &&
-          c->rdpSocket->mstime >=
-              c->lastReceivePacketTime + RDP_WAIT_FIN_SENT) {
-        connStateSwitch(c, CS_DESTROY);
+struct rdpShard {
+  rdpRuntime *rt;
+  int id;
+  int cpu;
+  pthread_t thread;
+  uint8_t started : 1;
+  rdpSocket *listen; // Shares the runtime's address with the other shards.
+  rdpSocket *out;    // Own port, replies to outbound connections come back
+                     // to this shard only.
+  struct handoff mailbox;
+  _Atomic size_t load; // Connections, published by the shard's thread.
+};
 
-        return 0;
-      }
+struct rdpRuntime {
+  int shards;
+  struct rdpShard *shard;
+  rdpRuntimeHandler handler;
+  _Atomic int stopping;
+};
 
-      // RECV wait state timeout.
-      if (c->state == CS_SYN_RECV &&
-          c->rdpSocket->mstime >=
-              c->lastReceivePacketTime + RDP_WAIT_SYN_RECV) {
-        connStateSwitch(c, CS_DESTROY);
+static void shardPoll(struct rdpShard *sh, rdpSocket *s, unsigned char *buf) {
+  rdpRuntime *rt = sh->rt;
 
-        return 0;
-      }
+  for (;;) {
+    rdpConn *c;
+    int events;
+    ssize_t n = rdpReadPoll(s, buf, RDP_RUNTIME_BUFFER_SIZE, &c, &events);
 
-      if (c->queue > 0) {
-        if (c->rdpSocket->mstime >=
-            c->lastResizeWindowTime + RDP_RESIZE_WINDOW_INTERVAL_MIN)
-          resizeWindow(c);
+    if (events & (RDP_AGAIN | RDP_ERROR))
+      break;
 
-        // Packet retransmit.
-        for (uint16_t i = c->seqnr - c->queue; i != c->seqnr; i++) {
-          struct packetWrap *pw = rbufferGet(&c->outbuf, i);
+    if ((events & ~RDP_CONTINUE) && rt->handler.event)
+      rt->handler.event(rt->handler.ctx, sh->id, c, events, buf, n);
+  }
+}
 
-          // Stale packets reached retransmit timeout will be resent.
-          if (pw == NULL || pw->transmissions == 0 || pw->needResend == 1 ||
-              c->rdpSocket->mstime < pw->sentTime + c->retransmitTimeout)
-            continue;
+static void shardDrainMailbox(struct rdpShard *sh) {
+  rdpRuntime *rt = sh->rt;
+  struct shardMsg *m;
 
-          // Stale packets need to resend.
-          pw->needResend = 1;
+  handoffRearm(&sh->mailbox);
 
-          c->flightWindow -= pw->payload;
-        }
+  while ((m = handoffPop(&sh->mailbox))) {
+    if (m->type == SHARD_MSG_USER) {
+      if (rt->handler.message)
+        rt->handler.message(rt->handler.ctx, sh->id, m->msg);
+    } else {
+      rdpConn *c = rdpNetConnect(sh->out, m->data, m->data + m->serviceOff);
+      if (c)
+        rdpConnSetUserData(c, m->userData);
+      else if (rt->handler.event)
+        rt->handler.event(rt->handler.ctx, sh->id, NULL, RDP_CONN_ERROR,
+                          m->userData, -1);
+    }
 
-        // Retransmitting.
-        if (rdpConnFlushPackets(c) == -1) {
-          // Connection is full of packets, can't retransmit now.
-          tlog(c->rdpSocket, LL_DEBUG | LL_RAW, "!");
-        }
-      }
+    rdpFree(m);
+  }
+}
 
-      // Update after retransmit.
-      updateRetransmitTimeout(c);
-    }
+static void *shardRun(void *arg) {
+  struct rdpShard *sh = (struct rdpShard *)arg;
+  rdpRuntime *rt = sh->rt;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(sh->cpu, &cpus);
+  // Runs unpinned if it's not allowed.
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  unsigned char *buf = rdpMalloc(RDP_RUNTIME_BUFFER_SIZE);
+  int efd = epoll_create1(EPOLL_CLOEXEC);
+  assert(buf && efd != -1);
+
+  int fds[] = {sh->listen->fd,        sh->listen->submits.efd,
+               sh->out->fd,           sh->out->submits.efd,
+               sh->mailbox.efd};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    struct epoll_event ev = {EPOLLIN, {.fd = fds[i]}};
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, fds[i], &ev) == -1)
+      assert(0);
+  }
 
-    if (c->state == CS_CONNECTED || c->state == CS_CONNECTED_FULL) {
-      if (c->rdpSocket->mstime >=
-          c->lastSendPacketTime + RDP_KEEPALIVE_INTERVAL) {
+  while (!atomic_load(&rt->stopping)) {
+    int t1 = rdpSocketIntervalAction(sh->listen);
+    int t2 = rdpSocketIntervalAction(sh->out);
 
-        rdpConnKeepAlive(c);
-      }
-    }
+    struct epoll_event evs[8];
+    epoll_wait(efd, evs, 8, t1 < t2 ? t1 : t2);
 
-    break;
-  }
-  case CS_RESET:
-    tlog(c->rdpSocket, LL_DEBUG, "CS_RESET, need user invoke rdpConnClose()");
-  case CS_UNINITIALIZED:
-  case CS_DESTROY:
-    break;
-  default:
-    assert(0);
+    shardDrainMailbox(sh);
+    shardPoll(sh, sh->listen, buf);
+    shardPoll(sh, sh->out, buf);
+
+    atomic_store_explicit(&sh->load,
+                          dictFilled(sh->listen->conns) +
+                              dictFilled(sh->out->conns),
+                          memory_order_relaxed);
   }
 
-  assert(c->retransmitTicker - c->rdpSocket->mstime >= 0);
+  close(efd);
+  rdpFree(buf);
 
-  // nextCheckTimeout should be the smallest timeout value needed for next
-  // retransmit action, not bigger than the default value.
-  c->rdpSocket->nextCheckTimeout =
-      min(RDP_SOCKET_CHECK_TIMEOUT_MAX,
-          max(RDP_SOCKET_CHECK_TIMEOUT_MIN,
-              min(c->rdpSocket->nextCheckTimeout,
-                  c->retransmitTicker - c->rdpSocket->mstime)));
+  return NULL;
 }
 
-// Should be invoked periodically, before program go into epoll_wait() sleep.
-// Return a timeout next time this function should be invoked again, in
-// milliseconds.
-int rdpSocketIntervalAction(rdpSocket *s) {
-  if (!s)
-    return -1;
-
-  s->mstime = mstime();
+static void shardWake(struct rdpShard *sh) {
+  uint64_t one = 1;
+  if (write(sh->mailbox.efd, &one, sizeof(one)) == -1)
+    assert(errno == EAGAIN);
+}
 
-  if (s->mstime < s->lastCheck + s->nextCheckTimeout) {
-    return s->nextCheckTimeout - (s->mstime - s->lastCheck);
+int rdpRuntimeDestroy(rdpRuntime *rt) {
+  if (!rt) {
+    errno = EINVAL;
+    return -1;
   }
 
-  s->lastCheck = s->mstime;
-  s->nextCheckTimeout = RDP_SOCKET_CHECK_TIMEOUT_DEFAULT;
-
-  dictEntry *e;
-  rdpConn *c;
-  while (e = dictIteratorNext(s->connsIter)) {
-    c = (rdpConn *)dictKeyGet(e);
+  atomic_store(&rt->stopping, 1);
 
-    rdpConnCheck(c);
+  for (int i = 0; i < rt->shards; i++) {
+    struct rdpShard *sh = &rt->shard[i];
 
-    if (c->state == CS_DESTROY) {
-      rdpConnDestroy(c);
+    if (sh->started) {
+      shardWake(sh);
+      pthread_join(sh->thread, NULL);
     }
-  }
-  if (dictIteratorRewind(s->connsIter) != 0) {
-    assert(0);
+
+    if (sh->listen)
+      rdpSocketDestroy(sh->listen);
+    if (sh->out)
+      rdpSocketDestroy(sh->out);
+    if (sh->mailbox.cells)
+      handoffFree(&sh->mailbox);
   }
 
-  return s->nextCheckTimeout;
-}
+  rdpFree(rt->shard);
+  rdpFree(rt);
 
-rdpConn *rdpNetConnect(rdpSocket *s, const char *host, const char *service) {
-  rdpConn *c;
-  struct addrinfo hints;
-  struct addrinfo *result, *rp;
-  int connectRes, flags, conn, optval;
+  return 0;
+}
 
-  // Get address.
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_canonname = NULL;
-  hints.ai_addr = NULL;
-  hints.ai_next = NULL;
-  hints.ai_socktype = SOCK_DGRAM;
-  // AF_UNSPEC allows IPv4 or IPv6
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_flags = AI_PASSIVE;
+rdpRuntime *rdpRuntimeCreate(int shards, const char *node, const char *service,
+                             const rdpRuntimeHandler *h) {
+  if (!h || !node || !service) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-  int res = getaddrinfo(host, service, &hints, &result);
-  if (res != 0) {
-    errno = ENOSYS;
+  int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    cpus = 1;
+  if (shards <= 0)
+    shards = cpus;
 
-#ifdef RDP_DEBUG
-    write(STDOUT_FILENO, gai_strerror(res), strlen(gai_strerror(res)));
-#endif
+  rdpRuntime *rt = rdpCalloc(1, sizeof(*rt));
+  if (!rt)
+    return NULL;
 
+  rt->shard = rdpCalloc(shards, sizeof(*rt->shard));
+  if (!rt->shard) {
+    rdpFree(rt);
     return NULL;
   }
-
-  for (rp = result; rp != NULL; rp = rp->ai_next) {
-    c = rdpConnCreate(s);
-    if (c == NULL) {
-      tlog(s, LL_DEBUG, "rdpConnCreate");
+  rt->shards = shards;
+  rt->handler = *h;
+  atomic_init(&rt->stopping, 0);
+
+  // Sockets first, so packets arriving to the address meanwhile are held in a
+  // socket that is polled shortly.
+  for (int i = 0; i < shards; i++) {
+    struct rdpShard *sh = &rt->shard[i];
+
+    sh->rt = rt;
+    sh->id = i;
+    sh->cpu = i % cpus;
+    atomic_init(&sh->load, 0);
+    sh->listen = socketCreate(1, node, service, 1);
+    sh->out = socketCreate(1, node, "0", 0);
+    if (!sh->listen || !sh->out ||
+        handoffInit(&sh->mailbox, RDP_RUNTIME_MAILBOX_SIZE) == -1) {
+      rdpRuntimeDestroy(rt);
       return NULL;
     }
+  }
 
-    connectRes = rdpConnect(c, result->ai_addr, result->ai_addrlen);
-    if (connectRes == -1) {
-      rdpConnClose(c);
-      continue;
+  for (int i = 0; i < shards; i++) {
+    struct rdpShard *sh = &rt->shard[i];
+    int err = pthread_create(&sh->thread, NULL, shardRun, sh);
+    if (err) {
+      rdpRuntimeDestroy(rt);
+      errno = err;
+      return NULL;
     }
-    break;
+    sh->started = 1;
   }
 
-  freeaddrinfo(result);
-
-  return (rp == NULL) ? NULL : c;
+  return rt;
 }
 
-int rdpConnGetAddr(rdpConn *c, struct sockaddr *addr, socklen_t *addrlen) {
-  if (!c) {
+int rdpRuntimeShards(rdpRuntime *rt) { return rt ? rt->shards : -1; }
+
+int rdpRuntimePost(rdpRuntime *rt, int shard, void *msg) {
+  if (!rt || shard < 0 || shard >= rt->shards) {
+    errno = EINVAL;
     return -1;
   }
 
-  *addr = *(struct sockaddr *)&c->addr;
+  struct shardMsg *m = rdpMalloc(sizeof(*m));
+  if (!m) {
+    errno = ENOMEM;
+    return -1;
+  }
+  m->type = SHARD_MSG_USER;
+  m->msg = msg;
 
-  *addrlen = c->addrlen;
+  if (handoffPush(&rt->shard[shard].mailbox, m) == -1) {
+    rdpFree(m);
+    return -1;
+  }
 
   return 0;
 }
+
+int rdpRuntimeConnect(rdpRuntime *rt, const char *host, const char *service,
+                      void *userData) {
+  if (!rt || !host || !service) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // The least loaded shard. Counting the connection right away keeps a burst
+  // of connects from all landing on it before it publishes again.
+  int shard = 0;
+  size_t least = SIZE_MAX;
+  for (int i = 0; i < rt->shards; i++) {
+    size_t load =
+        atomic_load_explicit(&rt->shard[i].load, memory_order_relaxed);
+    if (load < least) {
+      least = load;
+      shard = i;
+    }
+  }
+
+  size_t hostLen = strlen(host) + 1;
+  size_t serviceLen = strlen(service) + 1;
+  struct shardMsg *m = rdpMalloc(sizeof(*m) + hostLen + serviceLen);
+  if (!m) {
+    errno = ENOMEM;
+    return -1;
+  }
+  m->type = SHARD_MSG_CONNECT;
+  m->userData = userData;
+  m->serviceOff = hostLen;
+  memcpy(m->data, host, hostLen);
+  memcpy(m->data + hostLen, service, serviceLen);
+
+  if (handoffPush(&rt->shard[shard].mailbox, m) == -1) {
+    rdpFree(m);
+    return -1;
+  }
+  atomic_fetch_add_explicit(&rt->shard[shard].load, 1, memory_order_relaxed);
+
+  return shard;
+}
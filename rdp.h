@@ -1,9 +1,15 @@
 #ifndef __RTP_H__
 #define __RTP_H__
 
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 
-// Invoke rdpSocketIntervalAction() periodically.
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Invoke rdpSocketIntervalAction() periodically, in milliseconds.
 #define RDP_SOCKET_CHECK_TIMEOUT_DEFAULT 500
 #define RDP_SOCKET_CHECK_TIMEOUT_MIN 50
 #define RDP_SOCKET_CHECK_TIMEOUT_MAX 1000
@@ -19,34 +25,356 @@
 #define RDP_CONNECTED (1 << 3)  // Actively established connection connected.
 #define RDP_DATA (1 << 4)       // Data in the buffer to be read.
 #define RDP_POLLOUT (1 << 5)    // Have spare sapce for writing.
-#define RDP_CONN_ERROR (1 << 6) // The connection failed.
+#define RDP_CONN_ERROR (1 << 6) // The connection failed, or with errno
+                                // EMSGSIZE, dropped what buf can't hold.
+#define RDP_MESSAGE (1 << 7)    // Along with RDP_DATA, a whole message sent by
+                                // rdpSendMsg() is in the buffer.
+#define RDP_DATAGRAM (1 << 8)   // A datagram sent by rdpSendDatagram() is in the
+                                // buffer.
+#define RDP_STREAM (1 << 10)    // Along with RDP_DATA, the data belongs to the
+                                // stream rdpConnGetStreamId() returns.
 #define RDP_ERROR (1 << 9)      // Invoke params error, or system call error.
+#define RDP_CALL (1 << 11)      // Along with RDP_DATA, a request sent by
+                                // rdpCall(), see rdpConnGetCallId().
+#define RDP_REPLY (1 << 12)     // Along with RDP_DATA, reply to a rdpCall(),
+                                // see rdpConnGetCookie().
+#define RDP_CALL_TIMEOUT (1 << 13) // The rdpCall() rdpConnGetCookie() returns
+                                   // got no reply in time.
+#define RDP_SINK (1 << 14) // The sink of the connection moved on, see
+                           // rdpConnGetSinkProgress().
+
+enum {
+  RDP_PROP_FD,
+  RDP_PROP_SNDBUF,
+  RDP_PROP_RCVBUF,
+  // eventfd readable after rdpSocketSubmit(), get only.
+  RDP_PROP_SUBMIT_FD,
+  // eventfd readable after rdpSocketComplete(), get only.
+  RDP_PROP_COMPLETION_FD
+};
 
-enum { RDP_PROP_FD, RDP_PROP_SNDBUF, RDP_PROP_RCVBUF };
+// Stream ids from here on are used by rdpCall().
+#define RDP_STREAM_ID_RESERVED 0xffc0
+
+// Size of a resumption ticket, see rdpConnGetTicket().
+#define RDP_TICKET_SIZE 32
+
+// Connection options, see rdpConnSetProp().
+enum {
+  // Non zero to hand received data to the user as soon as it arrives, without
+  // waiting for the packets sent before it. Data stays reliable, but
+  // rdpReadPoll() might return it out of order. Messages are still delivered
+  // whole.
+  RDP_CONN_PROP_UNORDERED,
+  // Max milliseconds data waits in a corked connection, see rdpConnCork().
+  RDP_CONN_PROP_CORK_DELAY,
+  // Non zero to hold back a packet not filled up while earlier data is in
+  // flight, for at most this many microseconds. It's sent as soon as it fills
+  // up or everything in flight is acked. Zero, the default, sends at once.
+  RDP_CONN_PROP_COALESCE,
+  // Send watermarks, in bytes queued to be sent or acked. With a high one set,
+  // writes take data up to it whatever room the flight window has, and
+  // RDP_POLLOUT comes once the queue drained down to the low one, rather than
+  // as soon as a packet fits. The low one is no more than the high one. Zero,
+  // the default high one, follows the flight window.
+  RDP_CONN_PROP_SNDLOWAT,
+  RDP_CONN_PROP_SNDHIWAT
+};
 
 typedef struct rdpConn rdpConn;
 typedef struct rdpSocket rdpSocket;
 
+// Tunables of the path a connection runs over, see rdpSocketSetTunables().
+// Timeouts are in milliseconds.
+typedef struct rdpTunables {
+  uint32_t retransmitTimeoutMin;
+  uint32_t retransmitTimeoutMax;
+  uint32_t retransmitTimeoutDefault; // Until the RTT is measured.
+  // Non zero lowers retransmitTimeoutMin to this many min RTTs, for paths of
+  // sub millisecond RTT. rdpSocketIntervalAction() then isn't held to
+  // RDP_SOCKET_CHECK_TIMEOUT_MIN for the connection, see
+  // rdpSocketIntervalActionUs().
+  uint32_t retransmitTimeoutMinRtts;
+  uint32_t keepAliveInterval;
+  uint32_t windowDefault; // Initial flight window, in bytes.
+  uint32_t windowShrinkFactor;
+  uint32_t windowExpandFactor;
+  uint32_t resizeWindowInterval;
+  // Acks this many packets behind the oldest unacked are still taken.
+  uint32_t ackBehindAllowed;
+} rdpTunables;
+
+// Built in tunables, see rdpTunablesProfile().
+enum {
+  // The build time tunables of rdp.c.
+  RDP_PROFILE_DEFAULT,
+  // Low retransmit timeouts and fast timers, for sub millisecond RTT.
+  RDP_PROFILE_DATACENTER,
+  RDP_PROFILE_WAN,
+  // Large windows and long retransmit timeouts, for RTT of a second or so.
+  RDP_PROFILE_SATELLITE,
+  // Tolerates RTT jitter and reordering, keeps NAT bindings alive.
+  RDP_PROFILE_MOBILE
+};
+
 struct rdpVec {
   const void *base;
   size_t len;
 };
 
+// Where the library gets its memory, see rdpSetAllocator().
+typedef struct rdpAllocator {
+  void *(*allocate)(void *ctx, size_t size);
+  void *(*reallocate)(void *ctx, void *ptr, size_t size);
+  void (*deallocate)(void *ctx, void *ptr);
+  void *ctx;
+} rdpAllocator;
+
+// All three functions of a are needed, NULL restores malloc(). Memory is freed
+// by the allocator that allocated it, so set it before rdpSocketCreate(). The
+// dicts of libdict aren't covered.
+int rdpSetAllocator(const rdpAllocator *a);
+
 // Current rdp version: 1.
 rdpSocket *rdpSocketCreate(int version, const char *node, const char *service);
 int rdpSocketDestroy(rdpSocket *s);
 rdpConn *rdpConnCreate(rdpSocket *s);
 int rdpConnClose(rdpConn *c);
+// Only SHUT_WR is supported. Send ST_FIN after the data written, while data
+// from the other end is still received until its end of file, RDP_DATA with
+// zero length. Writes fail with EPIPE afterwards. rdpConnClose() is still
+// needed to release the connection.
+int rdpConnShutdown(rdpConn *c, int how);
 int rdpConnect(rdpConn *c, const struct sockaddr *addr, socklen_t addrlen);
+// Like rdpConnect(), but buf, no more than one packet of payload, rides in the
+// syn. The other end gets it along with RDP_ACCEPT, a round trip earlier. A
+// syn might be replayed by the network or an attacker, and a replayed syn is
+// accepted again if the original connection is gone, so only send requests
+// that are safe to process twice this way.
+int rdpConnectData(rdpConn *c, const struct sockaddr *addr, socklen_t addrlen,
+                   const void *buf, size_t len);
 rdpConn *rdpNetConnect(rdpSocket *s, const char *host, const char *service);
 ssize_t rdpWrite(rdpConn *c, const void *buf, size_t len);
+// Like rdpWrite(), but data not acked within ttl milliseconds is given up. It's
+// not retransmitted anymore, and the other end skips it instead of waiting for
+// it, so later data isn't held back.
+ssize_t rdpWriteTtl(rdpConn *c, const void *buf, size_t len, uint32_t ttl);
+// Like rdpWrite(), but sends len bytes of fd from offset. The range is mapped
+// rather than copied, retransmissions read it again from the page cache, so
+// the connection holds just a header per packet in flight, not its data. The
+// file must stay as large until the data is acked, reading pages truncated
+// away raises SIGBUS. Writes to the range meanwhile may go out to the other
+// end. Like sendfile(), len is cut at the end of the file, an offset past it
+// fails with EINVAL. Returns bytes queued, invoke it again with the rest on
+// RDP_POLLOUT.
+ssize_t rdpSendFile(rdpConn *c, int fd, off_t offset, size_t len);
+// Write plain data c receives, written by rdpWrite(), rdpSendFile() and the
+// like, into len bytes of fd from offset instead of handing it to
+// rdpReadPoll(). Each packet is copied once, straight from the socket to where
+// it goes in the file, out of order ones too. The file should span the range
+// already. Streams, messages and calls are still delivered as usual.
+// RDP_SINK is reported every RDP_SINK_WATERMARK bytes and when the sink ends,
+// once the range is full or data doesn't fit in what's left of it. The rest is
+// delivered as usual then. fd -1 ends it right away. Sized for senders filling
+// packets like rdpSendFile() does, packets held behind a shorter one are moved
+// in the file once it arrives.
+int rdpConnSetSink(rdpConn *c, int fd, off_t offset, size_t len);
+// Bytes of the range written contiguously, they're all in the file.
+size_t rdpConnGetSinkProgress(rdpConn *c);
+// Send buf as one message, the other end gets it by a single rdpReadPoll() with
+// RDP_DATA | RDP_MESSAGE. The buffer supplied to rdpReadPoll() should be able
+// to hold the whole message, see rdpReadPoll(). A message fitting one packet
+// is handed over where it was received, one spanning several is copied twice,
+// into a reassembly buffer of the connection and from there into the
+// caller's. Fails with EAGAIN if the message can't be queued at once.
+ssize_t rdpSendMsg(rdpConn *c, const void *buf, size_t len);
+// Write to one of the streams multiplexed in the connection, streamId can't be
+// zero, nor RDP_STREAM_ID_RESERVED or above. Streams share the connection's
+// acks and windows, but each is delivered in its own order, so a lost packet
+// only holds back its own stream. Streams are opened on first use and live as
+// long as the connection, reuse their ids instead of opening new ones. Returns
+// bytes queued like rdpWrite().
+ssize_t rdpStreamWrite(rdpConn *c, uint16_t streamId, const void *buf,
+                       size_t len);
+// Stream of the data just reported by RDP_STREAM.
+uint16_t rdpConnGetStreamId(rdpConn *c);
+// Send req as a call, the other end gets it with RDP_CALL and answers it by
+// rdpReply(). Calls are independent of each other, a reply doesn't wait for
+// replies to calls made earlier. The reply is reported with RDP_REPLY. If none
+// arrives within timeout milliseconds, RDP_CALL_TIMEOUT is reported instead and
+// the request isn't retransmitted anymore. Zero timeout waits forever.
+// rdpSocketIntervalAction() wakes up for the timeout, invoke rdpReadPoll()
+// after it to get RDP_CALL_TIMEOUT.
+int rdpCall(rdpConn *c, const void *req, size_t len, void *cookie,
+            uint32_t timeout);
+int rdpReply(rdpConn *c, uint32_t callId, const void *buf, size_t len);
+// Call just reported by RDP_CALL.
+uint32_t rdpConnGetCallId(rdpConn *c);
+// Cookie of the call just reported by RDP_REPLY or RDP_CALL_TIMEOUT.
+void *rdpConnGetCookie(rdpConn *c);
+// Send buf as one unreliable datagram on an established connection. It's
+// never retransmitted, might get lost or reordered, and is reported by
+// RDP_DATAGRAM on the other end as soon as it arrives. len can't exceed one
+// packet's payload, fails with EMSGSIZE otherwise. Datagrams reaching the
+// other end before it reported RDP_ACCEPT are dropped. A window's worth is
+// sent per RTT, then it fails with EAGAIN, whatever the writes queued.
+ssize_t rdpSendDatagram(rdpConn *c, const void *buf, size_t len);
+// One to many. rdpGroupOpen() returns a connection writing to the multicast
+// group, by rdpWrite(), rdpSendMsg() or rdpStreamWrite(), without handshake.
+// Sockets joined to the group by rdpGroupSocketCreate() report every sender
+// with RDP_ACCEPT and its data like any connection's. Members aren't known to
+// the sender and never ack, they NAK what they miss and the sender resends it
+// to the whole group. Data is kept for repairs RDP_GROUP_RETAIN milliseconds,
+// or its ttl if shorter, and writes fail with EAGAIN once too much is kept.
+// Members skip data asked for too late. Closing a member conn only forgets
+// the sender, writing to it fails with EINVAL.
+rdpConn *rdpGroupOpen(rdpSocket *s, const char *group, const char *service);
+rdpSocket *rdpGroupSocketCreate(int version, const char *group,
+                                const char *service);
+// Relay what c receives to peer and what peer receives to c, instead of
+// handing it to the user. A packet received in order is queued on the other
+// as it is, only its header rewritten. Each advertises the room the other has
+// to send, so the slower side holds back the faster, and packets the other
+// can't queue are dropped for the sender to retransmit. Messages and streams
+// are relayed whole, the end of file is passed on by rdpConnShutdown() and
+// still reported. Data is delivered to the user again while the other isn't
+// connected, or after unsplicing by NULL peer. Don't write to spliced conns.
+int rdpConnSplice(rdpConn *c, rdpConn *peer);
+// Hot restart. rdpSocketHandoff() passes the UDP fd of s over unixFd, a
+// connected AF_UNIX stream socket, along with the state of its connections:
+// ids, sequence numbers, unacked and out of order packets, RTT and windows.
+// rdpSocketTakeover() in the new process gets it back as a rdpSocket going on
+// where s left off, the peers don't notice. Each connection is reported once
+// by RDP_ACCEPT on it. Invoke rdpSocketDestroy() on s right after handing it
+// off, rather than reading from it again. User data and call cookies are
+// carried over as they are, keep keys in them rather than pointers. Both
+// processes should be built with the same RDP_UDP_MTU and queue size. Sockets
+// of groups, splices or sinks fail with EBUSY.
+int rdpSocketHandoff(rdpSocket *s, int unixFd);
+rdpSocket *rdpSocketTakeover(int unixFd);
+// The same by hand. rdpSocketExport() writes the state of s to buf and
+// returns its size, or just the size if len is too small. rdpSocketImport()
+// takes over fd along with it, or fails with EINVAL leaving fd as it is.
+ssize_t rdpSocketExport(rdpSocket *s, void *buf, size_t len);
+rdpSocket *rdpSocketImport(int fd, const void *buf, size_t len);
+// buf has to hold a packet's payload, RDP_UDP_MTU at most, and the largest
+// message expected, RDP_MESSAGE_SIZE_MAX at most. A packet or message it
+// can't hold is dropped and reported by RDP_CONN_ERROR on its connection with
+// errno EMSGSIZE, the connection goes on.
 ssize_t rdpReadPoll(rdpSocket *s, void *buf, size_t len, rdpConn **c,
                     int *flag);
 int rdpSocketIntervalAction(rdpSocket *s);
+// The same in microseconds, for epoll_pwait2() or a timerfd, so retransmit
+// timeouts below a millisecond aren't rounded up.
+int64_t rdpSocketIntervalActionUs(rdpSocket *s);
+// Everything else works on a rdpSocket from the one thread owning it. Other
+// threads hand writes to it by rdpSocketSubmit(), which takes a copy of buf
+// without locking and fails with EAGAIN if too many are waiting. The owning
+// thread writes them from rdpReadPoll(), invoke it when RDP_PROP_SUBMIT_FD is
+// readable. Writes keep their order per connection, those failing other than
+// with EAGAIN are dropped. NULL buf with zero len closes c after the writes
+// before it. c has to be valid when submitting, writes still waiting once it's
+// destroyed, after rdpConnClose() or a timeout, are dropped. A custom
+// allocator should be thread safe too, see rdpSetAllocator().
+int rdpSocketSubmit(rdpSocket *s, rdpConn *c, const void *buf, size_t len);
+// rdpSocketSubmit() to the rdpSocket c belongs to.
+int rdpConnSubmit(rdpConn *c, const void *buf, size_t len);
+// rdpConnSubmit() of a rdpReply() to callId.
+int rdpConnSubmitReply(rdpConn *c, uint32_t callId, const void *buf,
+                       size_t len);
+// The other way around, the owning thread hands what rdpReadPoll() got to one
+// other thread by rdpSocketComplete(), which takes it back by rdpSocketReap()
+// when RDP_PROP_COMPLETION_FD is readable. rdpSocketReap() fails with EAGAIN
+// if nothing's left, with EMSGSIZE if buf can't hold the next one.
+int rdpSocketComplete(rdpSocket *s, rdpConn *c, const void *buf, size_t len,
+                      int events);
+ssize_t rdpSocketReap(rdpSocket *s, void *buf, size_t len, rdpConn **c,
+                      int *events);
+// Along with an event rdpConnReap() takes, what rdpConnGetStreamId(),
+// rdpConnGetCallId() and rdpConnGetCookie() returned for it.
+typedef struct rdpEventInfo {
+  uint16_t streamId;
+  uint32_t callId;
+  void *cookie;
+} rdpEventInfo;
+
+// A connection of its own for a worker thread. Once the owning thread got the
+// eventfd of c by rdpConnReadyFd(), rdpReadPoll() hands each RDP_DATA,
+// RDP_POLLOUT and RDP_CONN_ERROR of c, with a copy of buf, to c's ring instead
+// of returning it. Those the ring has no room for wait, and the worker's
+// rdpConnReap() wakes the owning thread by RDP_PROP_SUBMIT_FD to hand them
+// over. The worker waits on the fd and takes them by rdpConnReap(), which
+// fails like rdpSocketReap() and fills info, unless NULL, in place of
+// rdpConnGetStreamId() and the like. It writes by rdpConnSubmit() and
+// rdpConnSubmitReply(), and closes c by a NULL submission once it's done with
+// the fd, which is closed along with c.
+int rdpConnReadyFd(rdpConn *c);
+ssize_t rdpConnReap(rdpConn *c, void *buf, size_t len, int *events,
+                    rdpEventInfo *info);
 int rdpConnGetAddr(rdpConn *c, struct sockaddr *addr, socklen_t *addrlen);
 int rdpSocketGetProp(rdpSocket *s, int opt);
 int rdpSocketSetProp(rdpSocket *s, int opt, int val);
+// While corked, writes are gathered into full packets. A packet not filled up
+// is sent on rdpConnUncork(), or once it's waited RDP_CONN_PROP_CORK_DELAY.
+int rdpConnCork(rdpConn *c);
+int rdpConnUncork(rdpConn *c);
+int rdpConnGetProp(rdpConn *c, int opt);
+int rdpConnSetProp(rdpConn *c, int opt, int val);
+// Fill t with a RDP_PROFILE_*, to be tweaked before setting it.
+int rdpTunablesProfile(rdpTunables *t, int profile);
+// Tunables are set as a whole, or not at all and EINVAL if they don't fit
+// together. Those of a socket are taken by the connections created on it
+// afterwards, a connection can be tuned on its own at any time.
+int rdpSocketGetTunables(rdpSocket *s, rdpTunables *t);
+int rdpSocketSetTunables(rdpSocket *s, const rdpTunables *t);
+int rdpConnGetTunables(rdpConn *c, rdpTunables *t);
+int rdpConnSetTunables(rdpConn *c, const rdpTunables *t);
+// The accepting end periodically hands out a ticket with the path parameters
+// it measured, RTT and window. Save it with rdpConnGetTicket() and present it
+// with rdpConnSetTicket() before connecting again, so the new connection starts
+// from them instead of learning the path again.
+ssize_t rdpConnGetTicket(rdpConn *c, void *buf, size_t len);
+int rdpConnSetTicket(rdpConn *c, const void *ticket, size_t len);
+// Tickets are verified with a random per rdpSocket key. Set a shared key on all
+// sockets which should accept each other's tickets.
+int rdpSocketSetTicketKey(rdpSocket *s, const void *key, size_t len);
+
+typedef struct rdpRuntime rdpRuntime;
+
+// Invoked on the thread of the shard, for each event of its rdpReadPoll() and
+// each message posted to it.
+typedef struct rdpRuntimeHandler {
+  void (*event)(void *ctx, int shard, rdpConn *c, int events, void *buf,
+                ssize_t n);
+  void (*message)(void *ctx, int shard, void *msg);
+  void *ctx;
+} rdpRuntimeHandler;
+
+// Run shards threads, one per CPU if zero, each pinned to a CPU. Every shard
+// owns a rdpSocket bound to node:service with SO_REUSEPORT, the kernel spreads
+// the other ends across them, and the connections accepted there stay on the
+// shard. Shard threads are the only ones using their connections, others
+// reach them by rdpConnSubmit() and rdpRuntimePost().
+rdpRuntime *rdpRuntimeCreate(int shards, const char *node, const char *service,
+                             const rdpRuntimeHandler *h);
+// Stop and join the threads, then destroy their sockets and connections.
+int rdpRuntimeDestroy(rdpRuntime *rt);
+int rdpRuntimeShards(rdpRuntime *rt);
+// Hand msg to the message handler on shard. Fails with EAGAIN if its mailbox
+// is full, messages left at rdpRuntimeDestroy() are dropped.
+int rdpRuntimePost(rdpRuntime *rt, int shard, void *msg);
+// rdpNetConnect() from the shard with the fewest connections, which is
+// returned. The connection comes from a port of the shard's own, it's reported
+// to the event handler with userData set. If it can't be started,
+// RDP_CONN_ERROR is reported with NULL c and buf set to userData.
+int rdpRuntimeConnect(rdpRuntime *rt, const char *host, const char *service,
+                      void *userData);
+
 void *rdpConnGetUserData(rdpConn *c);
 int rdpConnSetUserData(rdpConn *c, void *userData);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // __RTP_H__
@@ -0,0 +1,307 @@
+#ifndef __RDP_HPP__
+#define __RDP_HPP__
+
+// Thin C++20 binding of rdp.h, header only.
+//
+// rdp::Socket and rdp::Conn own their handles, rdpSocketDestroy() and
+// rdpConnClose() are invoked on destruction. They hold nothing but the handle
+// and every member is an inline call of the C function, so they cost the same
+// as calling rdp.h directly. Failures are reported like rdp.h does, -1 and
+// errno, only constructors throw.
+//
+//   rdp::Socket s("127.0.0.1", "8888");
+//   std::byte buf[1024];
+//   for (;;) {
+//     rdp::ReadResult r = s.read(buf);
+//     if (r.has(rdp::Event::Again))
+//       break;
+//     if (r.has(rdp::Event::Accept))
+//       conns.emplace_back(r.conn);
+//   }
+//
+// Since the library hands out the same rdpConn for every event of a
+// connection, adopt it into an rdp::Conn once, from RDP_ACCEPT or
+// rdpNetConnect(), and find it again with rdpConnGetUserData().
+//
+// rdpSocketDestroy() frees the connections of a socket, so an rdp::Conn is
+// destroyed, or release()d, before its rdp::Socket.
+
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <system_error>
+#include <utility>
+
+#include <errno.h>
+#include <sys/types.h>
+
+#include "rdp.h"
+
+namespace rdp {
+
+// The flags of rdpReadPoll().
+enum class Event : int {
+  None = 0,
+  Continue = RDP_CONTINUE,
+  Again = RDP_AGAIN,
+  Accept = RDP_ACCEPT,
+  Connected = RDP_CONNECTED,
+  Data = RDP_DATA,
+  PollOut = RDP_POLLOUT,
+  ConnError = RDP_CONN_ERROR,
+  Message = RDP_MESSAGE,
+  Datagram = RDP_DATAGRAM,
+  Error = RDP_ERROR,
+  Stream = RDP_STREAM,
+  Call = RDP_CALL,
+  Reply = RDP_REPLY,
+  CallTimeout = RDP_CALL_TIMEOUT,
+  Sink = RDP_SINK,
+};
+
+constexpr Event operator|(Event a, Event b) {
+  return static_cast<Event>(static_cast<int>(a) | static_cast<int>(b));
+}
+constexpr Event operator&(Event a, Event b) {
+  return static_cast<Event>(static_cast<int>(a) & static_cast<int>(b));
+}
+constexpr Event &operator|=(Event &a, Event b) { return a = a | b; }
+
+struct ReadResult {
+  ssize_t n;
+  Event events;
+  rdpConn *conn;
+
+  // True if any of e is set.
+  constexpr bool has(Event e) const { return (events & e) != Event::None; }
+};
+
+class Socket;
+
+class Conn {
+public:
+  Conn() = default;
+  // Take over c, it's closed along with the Conn.
+  explicit Conn(rdpConn *c) noexcept : c_(c) {}
+  Conn(Conn &&o) noexcept : c_(std::exchange(o.c_, nullptr)) {}
+  Conn &operator=(Conn &&o) noexcept {
+    if (this != &o)
+      reset(std::exchange(o.c_, nullptr));
+    return *this;
+  }
+  Conn(const Conn &) = delete;
+  Conn &operator=(const Conn &) = delete;
+  // Before the socket of the connection, see above.
+  ~Conn() { reset(); }
+
+  int connect(const struct sockaddr *addr, socklen_t addrlen) {
+    return rdpConnect(c_, addr, addrlen);
+  }
+  int connect(const struct sockaddr *addr, socklen_t addrlen,
+              std::span<const std::byte> buf) {
+    return rdpConnectData(c_, addr, addrlen, buf.data(), buf.size());
+  }
+
+  ssize_t write(std::span<const std::byte> buf) {
+    return rdpWrite(c_, buf.data(), buf.size());
+  }
+  ssize_t writeTtl(std::span<const std::byte> buf, uint32_t ttl) {
+    return rdpWriteTtl(c_, buf.data(), buf.size(), ttl);
+  }
+  ssize_t sendFile(int fd, off_t offset, std::size_t len) {
+    return rdpSendFile(c_, fd, offset, len);
+  }
+  ssize_t sendMsg(std::span<const std::byte> buf) {
+    return rdpSendMsg(c_, buf.data(), buf.size());
+  }
+  ssize_t sendDatagram(std::span<const std::byte> buf) {
+    return rdpSendDatagram(c_, buf.data(), buf.size());
+  }
+  ssize_t streamWrite(uint16_t streamId, std::span<const std::byte> buf) {
+    return rdpStreamWrite(c_, streamId, buf.data(), buf.size());
+  }
+  int call(std::span<const std::byte> req, void *cookie, uint32_t timeout) {
+    return rdpCall(c_, req.data(), req.size(), cookie, timeout);
+  }
+  int reply(uint32_t callId, std::span<const std::byte> buf) {
+    return rdpReply(c_, callId, buf.data(), buf.size());
+  }
+
+  // See rdpConnReadyFd(), reap() from the worker thread only.
+  int readyFd() { return rdpConnReadyFd(c_); }
+  ReadResult reap(std::span<std::byte> buf, rdpEventInfo *info = nullptr) {
+    ReadResult r;
+    int events = 0;
+    r.n = rdpConnReap(c_, buf.data(), buf.size(), &events, info);
+    r.events = static_cast<Event>(events);
+    r.conn = c_;
+    return r;
+  }
+
+  int setSink(int fd, off_t offset, std::size_t len) {
+    return rdpConnSetSink(c_, fd, offset, len);
+  }
+  std::size_t sinkProgress() const { return rdpConnGetSinkProgress(c_); }
+
+  int shutdown() { return rdpConnShutdown(c_, SHUT_WR); }
+  int cork() { return rdpConnCork(c_); }
+  int uncork() { return rdpConnUncork(c_); }
+  int getProp(int opt) const { return rdpConnGetProp(c_, opt); }
+  int setProp(int opt, int val) { return rdpConnSetProp(c_, opt, val); }
+  int tunables(rdpTunables &t) const { return rdpConnGetTunables(c_, &t); }
+  int setTunables(const rdpTunables &t) { return rdpConnSetTunables(c_, &t); }
+  void *userData() const { return rdpConnGetUserData(c_); }
+  int setUserData(void *userData) { return rdpConnSetUserData(c_, userData); }
+
+  // Close the connection owned, if any, and own c instead.
+  void reset(rdpConn *c = nullptr) noexcept {
+    if (c_)
+      rdpConnClose(c_);
+    c_ = c;
+  }
+  // Give up ownership, the caller closes it.
+  rdpConn *release() noexcept { return std::exchange(c_, nullptr); }
+  rdpConn *get() const noexcept { return c_; }
+  explicit operator bool() const noexcept { return c_ != nullptr; }
+
+private:
+  rdpConn *c_ = nullptr;
+};
+
+class Socket {
+public:
+  Socket() = default;
+  explicit Socket(rdpSocket *s) noexcept : s_(s) {}
+  Socket(const char *node, const char *service, int version = 1)
+      : s_(rdpSocketCreate(version, node, service)) {
+    if (!s_)
+      throw std::system_error(errno, std::generic_category(),
+                              "rdpSocketCreate");
+  }
+  Socket(Socket &&o) noexcept : s_(std::exchange(o.s_, nullptr)) {}
+  Socket &operator=(Socket &&o) noexcept {
+    if (this != &o)
+      reset(std::exchange(o.s_, nullptr));
+    return *this;
+  }
+  Socket(const Socket &) = delete;
+  Socket &operator=(const Socket &) = delete;
+  ~Socket() { reset(); }
+
+  // See rdpReadPoll(), buf is filled in place.
+  ReadResult read(std::span<std::byte> buf) {
+    ReadResult r;
+    int events;
+    r.n = rdpReadPoll(s_, buf.data(), buf.size(), &r.conn, &events);
+    r.events = static_cast<Event>(events);
+    return r;
+  }
+
+  // Connection not connected yet, see Conn::connect().
+  Conn create() { return Conn(rdpConnCreate(s_)); }
+  Conn connect(const char *host, const char *service) {
+    return Conn(rdpNetConnect(s_, host, service));
+  }
+
+  int intervalAction() { return rdpSocketIntervalAction(s_); }
+  int64_t intervalActionUs() { return rdpSocketIntervalActionUs(s_); }
+  int fd() const { return rdpSocketGetProp(s_, RDP_PROP_FD); }
+  int getProp(int opt) const { return rdpSocketGetProp(s_, opt); }
+  int setProp(int opt, int val) { return rdpSocketSetProp(s_, opt, val); }
+  int tunables(rdpTunables &t) const { return rdpSocketGetTunables(s_, &t); }
+  int setTunables(const rdpTunables &t) {
+    return rdpSocketSetTunables(s_, &t);
+  }
+  int setTicketKey(std::span<const std::byte> key) {
+    return rdpSocketSetTicketKey(s_, key.data(), key.size());
+  }
+  // See rdpSocketHandoff(), the socket is destroyed if it succeeds.
+  int handoff(int unixFd) {
+    int ret = rdpSocketHandoff(s_, unixFd);
+    if (ret == 0)
+      reset();
+    return ret;
+  }
+
+  void reset(rdpSocket *s = nullptr) noexcept {
+    if (s_)
+      rdpSocketDestroy(s_);
+    s_ = s;
+  }
+  rdpSocket *release() noexcept { return std::exchange(s_, nullptr); }
+  rdpSocket *get() const noexcept { return s_; }
+  explicit operator bool() const noexcept { return s_ != nullptr; }
+
+private:
+  rdpSocket *s_ = nullptr;
+};
+
+static_assert(sizeof(Conn) == sizeof(rdpConn *));
+static_assert(sizeof(Socket) == sizeof(rdpSocket *));
+
+namespace detail {
+
+// A block remembers its size in front of it, memory_resource needs it back on
+// deallocation.
+constexpr std::size_t blockHeader = alignof(std::max_align_t);
+
+inline void *pmrAllocate(void *ctx, std::size_t size) {
+  auto *r = static_cast<std::pmr::memory_resource *>(ctx);
+  try {
+    auto *p = static_cast<std::byte *>(
+        r->allocate(size + blockHeader, alignof(std::max_align_t)));
+    std::memcpy(p, &size, sizeof(size));
+    return p + blockHeader;
+  } catch (...) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+}
+
+inline std::size_t pmrBlockSize(void *ptr) {
+  std::size_t size;
+  std::memcpy(&size, static_cast<std::byte *>(ptr) - blockHeader,
+              sizeof(size));
+  return size;
+}
+
+inline void pmrDeallocate(void *ctx, void *ptr) {
+  auto *r = static_cast<std::pmr::memory_resource *>(ctx);
+  r->deallocate(static_cast<std::byte *>(ptr) - blockHeader,
+                pmrBlockSize(ptr) + blockHeader, alignof(std::max_align_t));
+}
+
+inline void *pmrReallocate(void *ctx, void *ptr, std::size_t size) {
+  if (!ptr)
+    return pmrAllocate(ctx, size);
+
+  std::size_t old = pmrBlockSize(ptr);
+  if (size <= old && size >= old / 2)
+    return ptr;
+
+  void *p = pmrAllocate(ctx, size);
+  if (!p)
+    return nullptr;
+  std::memcpy(p, ptr, size < old ? size : old);
+  pmrDeallocate(ctx, ptr);
+  return p;
+}
+
+} // namespace detail
+
+// Get the library's memory from r, nullptr restores malloc(). Like
+// rdpSetAllocator(), it's process wide and r should outlive every socket.
+inline int setMemoryResource(std::pmr::memory_resource *r) {
+  if (!r)
+    return rdpSetAllocator(nullptr);
+
+  rdpAllocator a = {detail::pmrAllocate, detail::pmrReallocate,
+                    detail::pmrDeallocate, r};
+  return rdpSetAllocator(&a);
+}
+
+} // namespace rdp
+
+#endif // __RDP_HPP__
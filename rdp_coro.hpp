@@ -0,0 +1,610 @@
+#ifndef __RDP_CORO_HPP__
+#define __RDP_CORO_HPP__
+
+// C++20 coroutine layer over rdp.h, header only. It lives in rdp::coro, named
+// after the std coroutine types it builds on rather than rdp.hpp.
+//
+// An rdp::coro::socket drives its connections from poll_once() or run(),
+// coroutines awaiting on them are resumed right from packet processing.
+// Awaiters live in the coroutine frame, frames of rdp::coro::task are recycled,
+// so operations don't allocate.
+//
+//   rdp::coro::task serve(rdp::coro::socket &s) {
+//     while (rdp::coro::conn c = co_await s.accept())
+//       echo(std::move(c));
+//   }
+//
+//   rdp::coro::task echo(rdp::coro::conn c) {
+//     std::byte buf[1024];
+//     ssize_t n;
+//     while ((n = co_await c.read(buf)) > 0)
+//       if (co_await c.write(std::span(buf, n)) == -1)
+//         break;
+//   }
+//
+// A connection is awaited on by one coroutine at a time, and isn't closed while
+// another coroutine awaits on it. One outliving its socket is closed along with
+// it, and fails from then on. Coroutines awaiting when the socket is destroyed
+// are resumed by it: accept() with an empty conn, connect() with false, read()
+// and write() with -1.
+
+#include <algorithm>
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include "rdp.h"
+
+namespace rdp::coro {
+
+class socket;
+class conn;
+
+namespace detail {
+
+// Recycles coroutine frames by size class, a task started after warm up doesn't
+// allocate. Frames are kept per thread.
+class frame_pool {
+public:
+  static void *allocate(std::size_t n) {
+    std::size_t cls = size_class(n);
+    if (cls >= classes)
+      return ::operator new(n);
+
+    block *&head = lists().heads[cls];
+    if (head) {
+      block *b = head;
+      head = b->next;
+      return b;
+    }
+
+    return ::operator new((cls + 1) * granularity);
+  }
+
+  static void deallocate(void *p, std::size_t n) noexcept {
+    std::size_t cls = size_class(n);
+    if (cls >= classes) {
+      ::operator delete(p);
+      return;
+    }
+
+    block *b = static_cast<block *>(p);
+    b->next = lists().heads[cls];
+    lists().heads[cls] = b;
+  }
+
+private:
+  struct block {
+    block *next;
+  };
+
+  static constexpr std::size_t granularity = 64;
+  static constexpr std::size_t classes = 64; // Frames up to 4 KiB.
+
+  struct free_lists {
+    block *heads[classes] = {};
+
+    ~free_lists() {
+      for (block *head : heads) {
+        while (head) {
+          block *next = head->next;
+          ::operator delete(head);
+          head = next;
+        }
+      }
+    }
+  };
+
+  static std::size_t size_class(std::size_t n) {
+    return n ? (n - 1) / granularity : 0;
+  }
+
+  static free_lists &lists() {
+    thread_local free_lists l;
+    return l;
+  }
+};
+
+struct read_awaiter_base;
+struct write_awaiter_base;
+struct connect_awaiter_base;
+
+// Attached to rdpConn as its user data.
+struct conn_state {
+  rdpConn *c = nullptr;
+  read_awaiter_base *reader = nullptr;
+  write_awaiter_base *writer = nullptr;
+  connect_awaiter_base *connector = nullptr;
+  std::vector<std::byte> pending; // Arrived while nobody was reading.
+  std::size_t pendingOff = 0;
+  bool eof = false;
+  bool failed = false;
+  // Linked on the socket while a conn owns it, see socket::~socket().
+  conn_state *prev = nullptr;
+  conn_state *next = nullptr;
+};
+
+struct read_awaiter_base {
+  std::coroutine_handle<> h;
+  std::span<std::byte> buf;
+  ssize_t res = 0;
+};
+
+struct write_awaiter_base {
+  std::coroutine_handle<> h;
+  conn_state *st;
+  std::span<const std::byte> buf;
+  std::size_t done = 0;
+  ssize_t res = 0;
+
+  // Return true once finished, res is set then.
+  bool attempt() {
+    while (done < buf.size()) {
+      ssize_t n = rdpWrite(st->c, buf.data() + done, buf.size() - done);
+      if (n > 0) {
+        done += n;
+        continue;
+      }
+
+      if (n == 0 || errno == EAGAIN)
+        return false;
+
+      res = -1;
+      return true;
+    }
+
+    res = done;
+    return true;
+  }
+};
+
+struct connect_awaiter_base {
+  std::coroutine_handle<> h;
+  bool ok = false;
+};
+
+// Take what's pending into buf. Return bytes taken.
+inline std::size_t take_pending(conn_state *st, std::span<std::byte> buf) {
+  std::size_t n = std::min(buf.size(), st->pending.size() - st->pendingOff);
+  std::memcpy(buf.data(), st->pending.data() + st->pendingOff, n);
+  st->pendingOff += n;
+
+  if (st->pendingOff == st->pending.size()) {
+    st->pending.clear();
+    st->pendingOff = 0;
+  }
+
+  return n;
+}
+
+} // namespace detail
+
+// Fire and forget coroutine, started at once, its frame is freed when it
+// returns.
+struct task {
+  struct promise_type {
+    task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+
+    static void *operator new(std::size_t n) {
+      return detail::frame_pool::allocate(n);
+    }
+
+    static void operator delete(void *p, std::size_t n) noexcept {
+      detail::frame_pool::deallocate(p, n);
+    }
+  };
+};
+
+class conn {
+public:
+  explicit conn(socket &s) : s_(&s) {}
+  conn(conn &&o) noexcept : s_(o.s_), st_(std::exchange(o.st_, nullptr)) {}
+  conn &operator=(conn &&o) noexcept {
+    if (this != &o) {
+      close();
+      s_ = o.s_;
+      st_ = std::exchange(o.st_, nullptr);
+    }
+    return *this;
+  }
+  conn(const conn &) = delete;
+  conn &operator=(const conn &) = delete;
+  ~conn() { close(); }
+
+  // co_await: true once connected, false if it failed.
+  auto connect(const char *host, const char *service);
+  // co_await: bytes read into buf, 0 on end of file, -1 if the connection
+  // failed.
+  auto read(std::span<std::byte> buf);
+  // co_await: buf.size() once all of it is queued, -1 on failure.
+  auto write(std::span<const std::byte> buf);
+
+  // See rdpConnShutdown().
+  int shutdown() { return st_ ? rdpConnShutdown(st_->c, SHUT_WR) : -1; }
+  inline void close();
+
+  explicit operator bool() const { return st_ != nullptr; }
+  rdpConn *native_handle() const { return st_ ? st_->c : nullptr; }
+
+private:
+  friend class socket;
+
+  conn(socket *s, detail::conn_state *st) : s_(s), st_(st) {}
+
+  socket *s_;
+  detail::conn_state *st_ = nullptr;
+};
+
+class socket {
+public:
+  // bufSize limits the largest message or packet which can be received, a
+  // bigger one fails its conn, see rdpReadPoll().
+  socket(const char *node, const char *service, std::size_t bufSize = 65536)
+      : s_(rdpSocketCreate(1, node, service)), buf_(bufSize) {
+    if (!s_)
+      throw std::bad_alloc();
+  }
+  socket(const socket &) = delete;
+  socket &operator=(const socket &) = delete;
+  ~socket() {
+    std::vector<std::coroutine_handle<>> ready;
+
+    closing_ = true;
+    for (detail::conn_state *st : accepted_) {
+      rdpConnSetUserData(st->c, nullptr);
+      rdpConnClose(st->c);
+      delete st;
+    }
+    if (acceptor_)
+      ready.push_back(std::exchange(acceptor_, nullptr)->h);
+    // Their conns delete them, without reaching back here.
+    for (detail::conn_state *st = owned_; st; st = st->next) {
+      rdpConnSetUserData(st->c, nullptr);
+      rdpConnClose(st->c);
+      st->c = nullptr;
+      st->failed = true;
+
+      if (st->connector)
+        ready.push_back(std::exchange(st->connector, nullptr)->h);
+      if (st->reader) {
+        st->reader->res = -1;
+        ready.push_back(std::exchange(st->reader, nullptr)->h);
+      }
+      if (st->writer) {
+        st->writer->res = -1;
+        ready.push_back(finish_write(st));
+      }
+    }
+    owned_ = nullptr;
+
+    // They might free their conns, or await again and fail at once.
+    for (std::coroutine_handle<> h : ready)
+      h.resume();
+    rdpSocketDestroy(s_);
+  }
+
+  // co_await: the next connection accepted, an empty one once the socket is
+  // being destroyed.
+  auto accept();
+
+  // Wait for packets at most timeout milliseconds, process them, resuming
+  // coroutines. Return the timeout for the next invocation.
+  int poll_once(int timeout) {
+    struct pollfd p = {rdpSocketGetProp(s_, RDP_PROP_FD), POLLIN, 0};
+    ::poll(&p, 1, timeout);
+
+    drain();
+
+    // Queue space might have freed up without RDP_POLLOUT.
+    std::vector<std::coroutine_handle<>> ready;
+    for (std::size_t i = 0; i < writers_.size();) {
+      detail::conn_state *st = writers_[i];
+      if (st->writer && !st->writer->attempt()) {
+        i++;
+        continue;
+      }
+
+      if (st->writer)
+        ready.push_back(finish_write(st));
+      writers_.erase(writers_.begin() + i);
+    }
+    for (std::coroutine_handle<> h : ready)
+      h.resume();
+
+    return rdpSocketIntervalAction(s_);
+  }
+
+  void run() {
+    stopped_ = false;
+
+    int timeout = rdpSocketIntervalAction(s_);
+    while (!stopped_)
+      timeout = poll_once(timeout);
+  }
+
+  void stop() { stopped_ = true; }
+
+  rdpSocket *native_handle() const { return s_; }
+
+private:
+  friend class conn;
+
+  struct accept_awaiter {
+    socket &s;
+    std::coroutine_handle<> h;
+    detail::conn_state *st = nullptr;
+
+    bool await_ready() {
+      if (s.closing_)
+        return true;
+      if (s.accepted_.empty())
+        return false;
+
+      st = s.accepted_.front();
+      s.accepted_.erase(s.accepted_.begin());
+      return true;
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+      h = handle;
+      s.acceptor_ = this;
+    }
+    conn await_resume() {
+      if (!st)
+        return conn(s);
+      s.own(st);
+      return conn(&s, st);
+    }
+  };
+
+  void drain() {
+    for (;;) {
+      rdpConn *c = nullptr;
+      int events = 0;
+      ssize_t n = rdpReadPoll(s_, buf_.data(), buf_.size(), &c, &events);
+
+      if (events & (RDP_AGAIN | RDP_ERROR))
+        break;
+
+      if (c)
+        dispatch(c, events, n);
+    }
+  }
+
+  void own(detail::conn_state *st) {
+    st->next = owned_;
+    if (owned_)
+      owned_->prev = st;
+    owned_ = st;
+  }
+
+  void disown(detail::conn_state *st) {
+    if (st->prev)
+      st->prev->next = st->next;
+    else
+      owned_ = st->next;
+    if (st->next)
+      st->next->prev = st->prev;
+  }
+
+  std::coroutine_handle<> finish_write(detail::conn_state *st) {
+    std::coroutine_handle<> h = st->writer->h;
+    st->writer = nullptr;
+    return h;
+  }
+
+  void dispatch(rdpConn *c, int events, ssize_t n) {
+    std::coroutine_handle<> ready[4];
+    int cnt = 0;
+
+    auto *st = static_cast<detail::conn_state *>(rdpConnGetUserData(c));
+
+    if (events & RDP_ACCEPT) {
+      st = new detail::conn_state;
+      st->c = c;
+      rdpConnSetUserData(c, st);
+
+      if (acceptor_) {
+        acceptor_->st = st;
+        ready[cnt++] = acceptor_->h;
+        acceptor_ = nullptr;
+      } else {
+        accepted_.push_back(st);
+      }
+    }
+
+    // Closed by the user already.
+    if (!st)
+      return;
+
+    if ((events & RDP_CONNECTED) && st->connector) {
+      st->connector->ok = true;
+      ready[cnt++] = st->connector->h;
+      st->connector = nullptr;
+    }
+
+    if ((events & RDP_DATA) && n >= 0) {
+      std::span<const std::byte> data(buf_.data(), n);
+
+      if (n == 0)
+        st->eof = true;
+
+      if (st->reader) {
+        std::size_t k = std::min(data.size(), st->reader->buf.size());
+        std::memcpy(st->reader->buf.data(), data.data(), k);
+        data = data.subspan(k);
+
+        st->reader->res = k;
+        ready[cnt++] = st->reader->h;
+        st->reader = nullptr;
+      }
+
+      st->pending.insert(st->pending.end(), data.begin(), data.end());
+    }
+
+    if (events & RDP_CONN_ERROR) {
+      st->failed = true;
+
+      if (st->connector) {
+        ready[cnt++] = st->connector->h;
+        st->connector = nullptr;
+      }
+      if (st->reader) {
+        st->reader->res = -1;
+        ready[cnt++] = st->reader->h;
+        st->reader = nullptr;
+      }
+      if (st->writer) {
+        st->writer->res = -1;
+        ready[cnt++] = finish_write(st);
+      }
+    }
+
+    if ((events & (RDP_POLLOUT | RDP_CONNECTED)) && st->writer &&
+        st->writer->attempt()) {
+      ready[cnt++] = finish_write(st);
+    }
+
+    for (int i = 0; i < cnt; i++)
+      ready[i].resume();
+  }
+
+  rdpSocket *s_;
+  std::vector<std::byte> buf_;
+  std::vector<detail::conn_state *> accepted_; // Not awaited yet.
+  std::vector<detail::conn_state *> writers_;  // Might wait for queue space.
+  detail::conn_state *owned_ = nullptr;        // Handed to conns.
+  accept_awaiter *acceptor_ = nullptr;
+  bool stopped_ = false;
+  bool closing_ = false; // In ~socket(), nothing new is started.
+};
+
+inline auto socket::accept() { return accept_awaiter{*this, {}, nullptr}; }
+
+inline void conn::close() {
+  if (!st_)
+    return;
+
+  // Closed along with the socket already otherwise.
+  if (st_->c) {
+    rdpConnSetUserData(st_->c, nullptr);
+    rdpConnClose(st_->c);
+
+    std::erase(s_->writers_, st_);
+    s_->disown(st_);
+  }
+  delete st_;
+  st_ = nullptr;
+}
+
+inline auto conn::connect(const char *host, const char *service) {
+  struct awaiter : detail::connect_awaiter_base {
+    conn &c;
+    const char *host;
+    const char *service;
+
+    awaiter(conn &c, const char *host, const char *service)
+        : c(c), host(host), service(service) {}
+
+    bool await_ready() {
+      c.close();
+      if (c.s_->closing_)
+        return true;
+
+      rdpConn *rc = rdpNetConnect(c.s_->s_, host, service);
+      if (!rc)
+        return true;
+
+      c.st_ = new detail::conn_state;
+      c.st_->c = rc;
+      rdpConnSetUserData(rc, c.st_);
+      c.s_->own(c.st_);
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+      h = handle;
+      c.st_->connector = this;
+    }
+    bool await_resume() { return ok; }
+  };
+
+  return awaiter(*this, host, service);
+}
+
+inline auto conn::read(std::span<std::byte> buf) {
+  struct awaiter : detail::read_awaiter_base {
+    detail::conn_state *st;
+
+    bool await_ready() {
+      if (!st) {
+        res = -1;
+        return true;
+      }
+
+      if (!st->pending.empty()) {
+        res = detail::take_pending(st, buf);
+        return true;
+      }
+
+      if (st->eof || st->failed) {
+        res = st->eof ? 0 : -1;
+        return true;
+      }
+
+      return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+      h = handle;
+      st->reader = this;
+    }
+    ssize_t await_resume() { return res; }
+  };
+
+  awaiter a;
+  a.buf = buf;
+  a.st = st_;
+  return a;
+}
+
+inline auto conn::write(std::span<const std::byte> buf) {
+  struct awaiter : detail::write_awaiter_base {
+    socket *s;
+
+    bool await_ready() {
+      if (!st || st->failed) {
+        res = -1;
+        return true;
+      }
+
+      return attempt();
+    }
+    void await_suspend(std::coroutine_handle<> handle) {
+      h = handle;
+      st->writer = this;
+      s->writers_.push_back(st);
+    }
+    ssize_t await_resume() { return res; }
+  };
+
+  awaiter a;
+  a.st = st_;
+  a.buf = buf;
+  a.s = s_;
+  return a;
+}
+
+} // namespace rdp::coro
+
+#endif // __RDP_CORO_HPP__
@@ -4,13 +4,23 @@
 #define __USE_XOPEN2K
 #endif
 
+#include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <malloc.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #define NI_MAXHOST 1025 // Maximum length of host.
@@ -19,7 +29,7 @@
 
 #define EPOLL_MAX_EVENTS 16
 
-rdpSocket *ctx1, *ctx2;
+rdpSocket *ctx1, *ctx2, *ctx3;
 rdpConn *conn1, *conn2;
 
 char *rdpAddressStr(const struct sockaddr *addr, socklen_t addrlen,
@@ -114,6 +124,1019 @@ int processIn(int fd) {
   return 1;
 }
 
+// The tests below run ctx1 and ctx2 by pump() until one of them sets
+// pumpDone, and get each event by the handler they pass. ctx3 and the proxy,
+// if open, are run along.
+typedef void (*eventHandler)(rdpSocket *s, rdpConn *c, int events,
+                             uint8_t *buf, ssize_t n);
+
+uint8_t pumpBuf[64 * 1024];
+atomic_int pumpDone;
+
+int proxyFd = -1;
+void proxyForward(void);
+
+void pump(eventHandler handler, int seconds) {
+  rdpSocket *ctx[3] = {ctx1, ctx2, ctx3};
+  int ctxCnt = ctx3 ? 3 : 2;
+  struct pollfd fds[7];
+  time_t deadline = time(NULL) + seconds;
+
+  atomic_store(&pumpDone, 0);
+  while (!atomic_load(&pumpDone)) {
+    assert(time(NULL) < deadline);
+
+    int timeout = 10;
+    for (int i = 0; i < ctxCnt; i++) {
+      fds[2 * i].fd = rdpSocketGetProp(ctx[i], RDP_PROP_FD);
+      fds[2 * i + 1].fd = rdpSocketGetProp(ctx[i], RDP_PROP_SUBMIT_FD);
+      fds[2 * i].events = fds[2 * i + 1].events = POLLIN;
+
+      int t = rdpSocketIntervalAction(ctx[i]);
+      if (t < timeout)
+        timeout = t;
+    }
+    fds[2 * ctxCnt].fd = proxyFd;
+    fds[2 * ctxCnt].events = POLLIN;
+    poll(fds, 2 * ctxCnt + 1, timeout);
+
+    if (proxyFd != -1)
+      proxyForward();
+
+    for (int i = 0; i < ctxCnt; i++) {
+      for (;;) {
+        rdpConn *c;
+        int events;
+        ssize_t n = rdpReadPoll(ctx[i], pumpBuf, sizeof(pumpBuf), &c, &events);
+        if (events & RDP_AGAIN)
+          break;
+        assert(!(events & RDP_ERROR));
+        if (events & ~RDP_CONTINUE)
+          handler(ctx[i], c, events, pumpBuf, n);
+      }
+    }
+  }
+}
+
+// A message bigger than the buffer given to rdpReadPoll() is dropped and
+// reported by RDP_CONN_ERROR with EMSGSIZE, the message after it still
+// arrives on the same connection.
+#define BIG_MESSAGE (sizeof(pumpBuf) + 1)
+
+uint8_t bigMessage[BIG_MESSAGE];
+int bigDropped;
+
+void bigEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf, ssize_t n) {
+  if (s == ctx1 && (events & RDP_CONNECTED)) {
+    assert(rdpSendMsg(c, bigMessage, BIG_MESSAGE) == BIG_MESSAGE);
+    assert(rdpSendMsg(c, "after", 5) == 5);
+  }
+
+  if (s != ctx2)
+    return;
+
+  if (events & RDP_CONN_ERROR) {
+    assert(errno == EMSGSIZE && c);
+    bigDropped++;
+  }
+
+  if (events & RDP_MESSAGE) {
+    assert(bigDropped == 1);
+    assert(n == 5 && !memcmp(buf, "after", 5));
+    atomic_store(&pumpDone, 1);
+  }
+}
+
+void testBigMessage(void) {
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  assert(ctx1 && ctx2);
+  assert(rdpNetConnect(ctx1, "127.0.0.1", "8889"));
+
+  pump(bigEvent, 10);
+
+  printf("big message: %zu bytes dropped, the next one delivered\n",
+         BIG_MESSAGE);
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+}
+
+// Threads write records of their own to one connection by rdpSocketSubmit(),
+// the other end checks they come in order per thread and are followed by EOF
+// from the closing submission.
+#define SUBMIT_THREADS 4
+#define SUBMIT_RECORDS 5000
+#define SUBMIT_RECORD_SIZE 16
+
+rdpConn *submitConn;
+atomic_int submitConnected, submitFinished;
+int submitNext[SUBMIT_THREADS], submitGot, submitEof;
+char submitRecord[SUBMIT_RECORD_SIZE + 1];
+size_t submitRecordLen;
+
+void *submitWrites(void *arg) {
+  long id = (long)arg;
+  char record[SUBMIT_RECORD_SIZE + 1];
+
+  while (!atomic_load(&submitConnected))
+    sched_yield();
+
+  for (int i = 0; i < SUBMIT_RECORDS; i++) {
+    snprintf(record, sizeof(record), "T%ld:%013d", id, i);
+    while (rdpSocketSubmit(ctx1, submitConn, record, SUBMIT_RECORD_SIZE) ==
+           -1) {
+      assert(errno == EAGAIN);
+      sched_yield();
+    }
+  }
+
+  // The last thread done closes, after the writes of every thread.
+  if (atomic_fetch_add(&submitFinished, 1) == SUBMIT_THREADS - 1) {
+    while (rdpSocketSubmit(ctx1, submitConn, NULL, 0) == -1) {
+      assert(errno == EAGAIN);
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+void submitEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf,
+                 ssize_t n) {
+  if (s == ctx1 && (events & RDP_CONNECTED))
+    atomic_store(&submitConnected, 1);
+
+  if (s != ctx2 || !(events & RDP_DATA))
+    return;
+
+  if (n == 0) {
+    assert(submitGot == SUBMIT_THREADS * SUBMIT_RECORDS);
+    submitEof = 1;
+    rdpConnClose(c);
+    atomic_store(&pumpDone, 1);
+    return;
+  }
+
+  for (ssize_t i = 0; i < n; i++) {
+    submitRecord[submitRecordLen++] = buf[i];
+    if (submitRecordLen < SUBMIT_RECORD_SIZE)
+      continue;
+
+    int id, seq;
+    submitRecordLen = 0;
+    assert(sscanf(submitRecord, "T%d:%d", &id, &seq) == 2);
+    assert(id >= 0 && id < SUBMIT_THREADS && submitNext[id] == seq);
+    submitNext[id]++;
+    submitGot++;
+  }
+}
+
+void testSubmit(void) {
+  pthread_t threads[SUBMIT_THREADS];
+
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  assert(ctx1 && ctx2);
+  submitConn = rdpNetConnect(ctx1, "127.0.0.1", "8889");
+  assert(submitConn);
+
+  for (long i = 0; i < SUBMIT_THREADS; i++)
+    assert(pthread_create(&threads[i], NULL, submitWrites, (void *)i) == 0);
+  pump(submitEvent, 60);
+  for (int i = 0; i < SUBMIT_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  assert(submitEof);
+  printf("submit: %d records in order\n", submitGot);
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+}
+
+// A worker keeps submitting to the accepting end while the connecting end's
+// socket is replaced, so the writes are answered by ST_RESET. The owning
+// thread closes the connection on RDP_CONN_ERROR and destroys it with
+// submissions of the worker still in the ring, which have to be dropped.
+// Memory freed meanwhile is poisoned and kept, so touching the destroyed
+// connection fails for sure.
+rdpConn *resetConn;
+atomic_int resetStop, resetSubmitted;
+
+void *poisonAllocate(void *ctx, size_t size) { return malloc(size); }
+
+void *poisonReallocate(void *ctx, void *p, size_t size) {
+  return realloc(p, size);
+}
+
+void poisonDeallocate(void *ctx, void *p) {
+  memset(p, 0xa5, malloc_usable_size(p));
+}
+
+void *resetWrites(void *arg) {
+  while (!atomic_load(&resetStop)) {
+    if (rdpSocketSubmit(ctx2, resetConn, "reset", 5) == 0) {
+      atomic_fetch_add(&resetSubmitted, 1);
+    } else {
+      assert(errno == EAGAIN);
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+void resetEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf,
+                ssize_t n) {
+  if (s == ctx1 && (events & RDP_CONNECTED))
+    assert(rdpWrite(c, "hello", 5) == 5);
+
+  if (s == ctx2 && (events & RDP_ACCEPT)) {
+    resetConn = c;
+    atomic_store(&pumpDone, 1);
+  }
+
+  if (s == ctx2 && (events & RDP_CONN_ERROR)) {
+    assert(c == resetConn);
+    atomic_store(&pumpDone, 1);
+  }
+}
+
+void testSubmitReset(void) {
+  rdpAllocator poison = {poisonAllocate, poisonReallocate, poisonDeallocate};
+  pthread_t worker;
+
+  assert(rdpSetAllocator(&poison) == 0);
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  assert(ctx1 && ctx2);
+  assert(rdpNetConnect(ctx1, "127.0.0.1", "8889"));
+  pump(resetEvent, 10);
+
+  assert(pthread_create(&worker, NULL, resetWrites, NULL) == 0);
+  rdpSocketDestroy(ctx1);
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  assert(ctx1);
+  pump(resetEvent, 10);
+
+  // Not drained since, the ring keeps filling.
+  int submitted = atomic_load(&resetSubmitted);
+  while (atomic_load(&resetSubmitted) < submitted + 100)
+    sched_yield();
+  assert(rdpConnClose(resetConn) == 0);
+  atomic_store(&resetStop, 1);
+  pthread_join(worker, NULL);
+
+  struct pollfd pfd = {rdpSocketGetProp(ctx2, RDP_PROP_SUBMIT_FD), POLLIN};
+  assert(poll(&pfd, 1, 0) == 1);
+  usleep((RDP_SOCKET_CHECK_TIMEOUT_DEFAULT + 10) * 1000);
+  rdpSocketIntervalAction(ctx2);
+
+  rdpConn *c;
+  int events;
+  do
+    rdpReadPoll(ctx2, pumpBuf, sizeof(pumpBuf), &c, &events);
+  while (!(events & RDP_AGAIN));
+  // Nothing is left queued on the destroyed connection.
+  assert(rdpSocketExport(ctx2, NULL, 0) > 0);
+
+  printf("submit reset: %d submitted, those after the destroy dropped\n",
+         atomic_load(&resetSubmitted));
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+  rdpSetAllocator(NULL);
+}
+
+// The owning thread hands more completions than the ring holds to a reaper,
+// which checks they come back whole and in order. Each is first reaped into
+// a buffer too small for it, failing with EMSGSIZE and leaving it in place.
+#define COMPLETIONS 3000
+
+rdpConn *completionConn;
+
+void *reapCompletions(void *arg) {
+  struct pollfd pfd = {rdpSocketGetProp(ctx2, RDP_PROP_COMPLETION_FD), POLLIN};
+  char buf[64], want[64];
+  int got = 0;
+
+  while (got <= COMPLETIONS) {
+    assert(poll(&pfd, 1, 5000) == 1);
+
+    // Reap everything, the fd is readable again only after new ones.
+    for (;;) {
+      rdpConn *c;
+      int events;
+      int wantLen = got < COMPLETIONS
+                        ? snprintf(want, sizeof(want), "completion %d", got)
+                        : 0;
+
+      ssize_t n = rdpSocketReap(ctx2, buf, 4, &c, &events);
+      if (n == -1 && errno == EAGAIN)
+        break;
+      if (wantLen > 4) {
+        assert(n == -1 && errno == EMSGSIZE);
+        n = rdpSocketReap(ctx2, buf, sizeof(buf), &c, &events);
+      }
+      assert(n == wantLen && !memcmp(buf, want, n));
+      assert(c == completionConn && events == RDP_DATA);
+      got++;
+    }
+  }
+
+  rdpConn *c;
+  int events;
+  assert(rdpSocketReap(ctx2, buf, sizeof(buf), &c, &events) == -1 &&
+         errno == EAGAIN);
+  return NULL;
+}
+
+void testComplete(void) {
+  pthread_t reaper;
+  char buf[64];
+  int full = 0;
+
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  assert(ctx2);
+  completionConn = rdpConnCreate(ctx2);
+  assert(completionConn);
+
+  assert(pthread_create(&reaper, NULL, reapCompletions, NULL) == 0);
+  for (int i = 0; i <= COMPLETIONS; i++) {
+    // The last one is empty, like EOF.
+    int n = i < COMPLETIONS ? snprintf(buf, sizeof(buf), "completion %d", i)
+                            : 0;
+    while (rdpSocketComplete(ctx2, completionConn, n ? buf : NULL, n,
+                             RDP_DATA) == -1) {
+      assert(errno == EAGAIN);
+      full++;
+      sched_yield();
+    }
+  }
+  pthread_join(reaper, NULL);
+
+  printf("complete: %d reaped, ring full %d times\n", COMPLETIONS + 1, full);
+  rdpSocketDestroy(ctx2);
+}
+
+// Shards connect to their own address, each connection from the shard with
+// the fewest. The connecting end pings, the accepting end echoes, and the
+// pong is posted on to the next shard. Then the main thread writes to every
+// connecting end by rdpConnSubmit(), which is echoed as well.
+#define RUNTIME_SHARDS 4
+#define RUNTIME_CONNS 40
+
+rdpRuntime *runtime;
+rdpConn *runtimeConns[RUNTIME_CONNS];
+atomic_int runtimeSlots, runtimeConnected, runtimePongs, runtimePosts,
+    runtimeEchoes;
+
+void runtimeEvent(void *ctx, int shard, rdpConn *c, int events, void *buf,
+                  ssize_t n) {
+  assert(ctx == &runtime && c);
+
+  if (events & RDP_CONNECTED) {
+    assert(rdpConnGetUserData(c) == &runtime);
+    runtimeConns[atomic_fetch_add(&runtimeSlots, 1)] = c;
+    atomic_fetch_add(&runtimeConnected, 1);
+    assert(rdpWrite(c, "ping", 4) == 4);
+  }
+
+  if (!(events & RDP_DATA) || n <= 0)
+    return;
+
+  if (rdpConnGetUserData(c) != &runtime) {
+    assert(rdpWrite(c, buf, n) == n);
+  } else if (n == 4 && !memcmp(buf, "ping", 4)) {
+    atomic_fetch_add(&runtimePongs, 1);
+    assert(rdpRuntimePost(runtime, (shard + 1) % RUNTIME_SHARDS,
+                          (void *)(long)shard) == 0);
+  } else {
+    assert(n == 6 && !memcmp(buf, "submit", 6));
+    atomic_fetch_add(&runtimeEchoes, 1);
+  }
+}
+
+void runtimeMessage(void *ctx, int shard, void *msg) {
+  assert(ctx == &runtime);
+  assert((long)msg == (shard + RUNTIME_SHARDS - 1) % RUNTIME_SHARDS);
+  atomic_fetch_add(&runtimePosts, 1);
+}
+
+// Wait up to seconds for *n to reach want.
+int waitCount(atomic_int *n, int want, int seconds) {
+  for (int i = 0; i < seconds * 100 && atomic_load(n) < want; i++)
+    usleep(10000);
+  return atomic_load(n) == want;
+}
+
+void testRuntime(void) {
+  rdpRuntimeHandler h = {runtimeEvent, runtimeMessage, &runtime};
+  int placed[RUNTIME_SHARDS] = {0};
+
+  runtime = rdpRuntimeCreate(RUNTIME_SHARDS, "127.0.0.1", "8890", &h);
+  assert(runtime && rdpRuntimeShards(runtime) == RUNTIME_SHARDS);
+
+  for (int i = 0; i < RUNTIME_CONNS; i++) {
+    int shard = rdpRuntimeConnect(runtime, "127.0.0.1", "8890", &runtime);
+    assert(shard >= 0 && shard < RUNTIME_SHARDS);
+    placed[shard]++;
+  }
+  for (int i = 0; i < RUNTIME_SHARDS; i++)
+    assert(placed[i] > 0);
+
+  assert(waitCount(&runtimePosts, RUNTIME_CONNS, 10));
+  assert(atomic_load(&runtimeConnected) == RUNTIME_CONNS &&
+         atomic_load(&runtimePongs) == RUNTIME_CONNS);
+
+  for (int i = 0; i < RUNTIME_CONNS; i++)
+    assert(rdpConnSubmit(runtimeConns[i], "submit", 6) == 0);
+  assert(waitCount(&runtimeEchoes, RUNTIME_CONNS, 10));
+
+  printf("runtime: %d connections placed %d/%d/%d/%d\n", RUNTIME_CONNS,
+         placed[0], placed[1], placed[2], placed[3]);
+  assert(rdpRuntimeDestroy(runtime) == 0);
+}
+
+// ctx1 streams plain and stream data to ctx2 through a proxy. Once the proxy
+// dropped a data packet and passed the next ones, with acks held back, both
+// sockets are handed over: ctx1 by rdpSocketHandoff() to a rdpSocketTakeover()
+// over a socketpair, ctx2 by rdpSocketExport() and rdpSocketImport(). So
+// unacked packets, packets received out of order and stream state all move,
+// and the transfer has to complete intact from there.
+#define HANDOFF_PLAIN (2 * 1024 * 1024)
+#define HANDOFF_STREAM (1024 * 1024)
+#define HANDOFF_STREAM_ID 7
+#define HANDOFF_CHUNK 1000
+#define HANDOFF_AHEAD (256 * 1024)
+#define HANDOFF_DROP 100 // Data packet dropped.
+#define HANDOFF_AFTER 10 // Data packets passed after it.
+
+struct sockaddr_in proxyServer, proxyClient;
+int proxyData, proxyAfterDrop;
+
+rdpConn *handoffConn;
+size_t handoffSent[2], handoffGot[2]; // Plain and stream data.
+int handoffAccepts[2];
+
+// The proxy on 8892 passes packets between ctx2 and the one end talking to it,
+// unless the rule of the running test drops them. It stops reading while
+// proxyStop is set, leaving packets queued.
+int (*proxyDrop)(int fromServer, const uint8_t *packet, ssize_t n);
+int proxyStop;
+
+void proxyForward(void) {
+  uint8_t packet[65536];
+  struct sockaddr_in from;
+  socklen_t fromLen = sizeof(from);
+  ssize_t n;
+
+  while (!proxyStop &&
+         (n = recvfrom(proxyFd, packet, sizeof(packet), MSG_DONTWAIT,
+                       (struct sockaddr *)&from, &fromLen)) >= 0) {
+    int fromServer = from.sin_port == proxyServer.sin_port;
+    struct sockaddr_in *to = fromServer ? &proxyClient : &proxyServer;
+
+    fromLen = sizeof(from);
+    if (!fromServer)
+      proxyClient = from;
+
+    if (proxyDrop && proxyDrop(fromServer, packet, n))
+      continue;
+
+    sendto(proxyFd, packet, n, 0, (struct sockaddr *)to, sizeof(*to));
+  }
+}
+
+void proxyOpen(int (*drop)(int fromServer, const uint8_t *packet, ssize_t n)) {
+  struct sockaddr_in addr = {0};
+
+  addr.sin_family = proxyServer.sin_family = AF_INET;
+  addr.sin_addr.s_addr = proxyServer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(8892);
+  proxyServer.sin_port = htons(8889);
+  proxyFd = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(proxyFd != -1);
+  assert(bind(proxyFd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  proxyDrop = drop;
+  proxyStop = 0;
+}
+
+void proxyClose(void) {
+  close(proxyFd);
+  proxyFd = -1;
+  proxyDrop = NULL;
+}
+
+// Drop the HANDOFF_DROP-th data packet and the acks after it, then stop once
+// HANDOFF_AFTER more went through.
+int handoffDrop(int fromServer, const uint8_t *packet, ssize_t n) {
+  if (!fromServer && n > 500 && ++proxyData >= HANDOFF_DROP) {
+    if (proxyData == HANDOFF_DROP)
+      return 1;
+    if (++proxyAfterDrop == HANDOFF_AFTER) {
+      proxyStop = 1;
+      atomic_store(&pumpDone, 1);
+    }
+  }
+  return fromServer && proxyData >= HANDOFF_DROP;
+}
+
+uint8_t handoffByte(int stream, size_t i) {
+  return stream ? i * 13 % 253 : i * 7 % 251;
+}
+
+// Keep HANDOFF_AHEAD bytes ahead of the receiver, two plain chunks for each
+// stream one.
+void handoffWrite(void) {
+  uint8_t chunk[HANDOFF_CHUNK];
+
+  while (handoffSent[0] + handoffSent[1] <
+             handoffGot[0] + handoffGot[1] + HANDOFF_AHEAD &&
+         (handoffSent[0] < HANDOFF_PLAIN || handoffSent[1] < HANDOFF_STREAM)) {
+    int stream = handoffSent[0] == HANDOFF_PLAIN ||
+                 (handoffSent[1] < HANDOFF_STREAM &&
+                  handoffSent[1] * 2 < handoffSent[0]);
+    size_t left = (stream ? HANDOFF_STREAM : HANDOFF_PLAIN) -
+                  handoffSent[stream];
+    size_t len = left < HANDOFF_CHUNK ? left : HANDOFF_CHUNK;
+
+    for (size_t i = 0; i < len; i++)
+      chunk[i] = handoffByte(stream, handoffSent[stream] + i);
+
+    ssize_t n = stream ? rdpStreamWrite(handoffConn, HANDOFF_STREAM_ID, chunk,
+                                        len)
+                       : rdpWrite(handoffConn, chunk, len);
+    if (n == -1) {
+      assert(errno == EAGAIN);
+      return;
+    }
+    handoffSent[stream] += n;
+  }
+}
+
+void handoffEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf,
+                  ssize_t n) {
+  if (events & RDP_ACCEPT) {
+    handoffAccepts[s == ctx2]++;
+    if (s == ctx1) {
+      assert(rdpConnGetUserData(c) == &handoffConn);
+      handoffConn = c;
+    }
+  }
+
+  if (s == ctx1 && (events & (RDP_CONNECTED | RDP_POLLOUT | RDP_ACCEPT)))
+    handoffWrite();
+
+  if (s != ctx2 || !(events & RDP_DATA) || n <= 0)
+    return;
+
+  int stream = !!(events & RDP_STREAM);
+  if (stream)
+    assert(rdpConnGetStreamId(c) == HANDOFF_STREAM_ID);
+  for (ssize_t i = 0; i < n; i++)
+    assert(buf[i] == handoffByte(stream, handoffGot[stream] + i));
+  handoffGot[stream] += n;
+
+  if (handoffGot[0] == HANDOFF_PLAIN && handoffGot[1] == HANDOFF_STREAM)
+    atomic_store(&pumpDone, 1);
+  else
+    handoffWrite();
+}
+
+void *takeover(void *arg) { return rdpSocketTakeover(*(int *)arg); }
+
+rdpSocket *handOver(rdpSocket *s) {
+  int sv[2];
+  pthread_t thread;
+  void *next;
+
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  assert(pthread_create(&thread, NULL, takeover, &sv[1]) == 0);
+  assert(rdpSocketHandoff(s, sv[0]) == 0);
+  pthread_join(thread, &next);
+  assert(next);
+
+  rdpSocketDestroy(s);
+  close(sv[0]);
+  close(sv[1]);
+  return next;
+}
+
+rdpSocket *importState(rdpSocket *s) {
+  ssize_t len = rdpSocketExport(s, NULL, 0);
+  assert(len > 0);
+  void *state = malloc(len);
+  assert(rdpSocketExport(s, state, len) == len);
+
+  int fd = dup(rdpSocketGetProp(s, RDP_PROP_FD));
+  rdpSocket *next = rdpSocketImport(fd, state, len);
+  assert(next);
+
+  free(state);
+  rdpSocketDestroy(s);
+  return next;
+}
+
+void testHandoff(void) {
+  proxyOpen(handoffDrop);
+
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  assert(ctx1 && ctx2);
+  handoffConn = rdpNetConnect(ctx1, "127.0.0.1", "8892");
+  assert(handoffConn);
+  rdpConnSetUserData(handoffConn, &handoffConn);
+
+  pump(handoffEvent, 20);
+  assert(proxyAfterDrop == HANDOFF_AFTER);
+  assert(handoffGot[0] + handoffGot[1] < HANDOFF_PLAIN + HANDOFF_STREAM);
+  size_t gotBefore = handoffGot[0] + handoffGot[1];
+
+  ctx1 = handOver(ctx1);
+  ctx2 = importState(ctx2);
+  handoffAccepts[0] = handoffAccepts[1] = 0;
+  proxyDrop = NULL;
+  proxyStop = 0;
+
+  pump(handoffEvent, 60);
+  assert(handoffAccepts[0] == 1 && handoffAccepts[1] == 1);
+
+  printf("handoff: %zu of %d bytes before, all intact after\n", gotBefore,
+         HANDOFF_PLAIN + HANDOFF_STREAM);
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+  proxyClose();
+}
+
+// ctx1 writes to two streams through the proxy while corked, so writes to the
+// same stream top up its unsent packet: "one," and "two," go in the packet of
+// stream 1, "three," and "four," in the first one of stream 2 and "five," in
+// its second. The proxy drops stream 1 until stream 2 is complete, and the
+// first packet of stream 2 once, so its second is held by the stream and
+// handed over right after the resent first, with the connection still missing
+// stream 1.
+#define STREAMS_LOST 1
+#define STREAMS_OTHER 2
+
+char streamsGot[3][64];
+int streamsDropped;
+
+int streamsDrop(int fromServer, const uint8_t *packet, ssize_t n) {
+  uint16_t ext[2]; // Stream id and seqnr of struct streamExt.
+
+  // ST_DATA carrying EXT_STREAM, struct streamExt after the ext header.
+  if (fromServer || n < 18 || packet[0] >> 4 != 0 || packet[1] != 4)
+    return 0;
+  memcpy(ext, packet + 14, sizeof(ext));
+
+  if (ext[0] == STREAMS_LOST)
+    return strcmp(streamsGot[STREAMS_OTHER], "three,four,five,") != 0;
+  if (ext[1] == 0 && !streamsDropped)
+    return streamsDropped = 1;
+  return 0;
+}
+
+void streamsEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf,
+                  ssize_t n) {
+  if (s == ctx1 && (events & RDP_CONNECTED)) {
+    assert(rdpConnCork(c) == 0);
+    assert(rdpStreamWrite(c, STREAMS_LOST, "one,", 4) == 4);
+    assert(rdpStreamWrite(c, STREAMS_LOST, "two,", 4) == 4);
+    assert(rdpStreamWrite(c, STREAMS_OTHER, "three,", 6) == 6);
+    assert(rdpStreamWrite(c, STREAMS_OTHER, "four,", 5) == 5);
+    assert(rdpConnUncork(c) == 0);
+    assert(rdpStreamWrite(c, STREAMS_OTHER, "five,", 5) == 5);
+  }
+
+  if (s != ctx2 || !(events & RDP_DATA) || n <= 0)
+    return;
+
+  assert(events & RDP_STREAM);
+  uint16_t id = rdpConnGetStreamId(c);
+  assert(id == STREAMS_LOST || id == STREAMS_OTHER);
+  if (id == STREAMS_LOST) {
+    // Topped up into one packet, after all of stream 2.
+    assert(n == 8 && !memcmp(buf, "one,two,", 8));
+    assert(!strcmp(streamsGot[STREAMS_OTHER], "three,four,five,"));
+    atomic_store(&pumpDone, 1);
+  } else if (!streamsGot[STREAMS_OTHER][0]) {
+    assert(streamsDropped && n == 11 && !memcmp(buf, "three,four,", 11));
+  }
+  strncat(streamsGot[id], (char *)buf, n);
+}
+
+void testStreams(void) {
+  proxyOpen(streamsDrop);
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  assert(ctx1 && ctx2);
+  assert(rdpNetConnect(ctx1, "127.0.0.1", "8892"));
+
+  pump(streamsEvent, 10);
+
+  printf("streams: stream %d delivered while stream %d waited for a resend\n",
+         STREAMS_OTHER, STREAMS_LOST);
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+  proxyClose();
+}
+
+// ctx1 writes TTL_LOST bytes by rdpWriteTtl() and then "after" by rdpWrite()
+// through the proxy, which drops every packet of the former. Once they're past
+// their TTL, ctx1 gives them up and sends an EXT_FORWARD_ACK, ctx2 skips the
+// gap in its acknr, acks past it and delivers "after", which it held out of
+// order.
+#define TTL_LOST 3000 // Several packets.
+#define TTL_MS 50
+
+int ttlDropped, ttlForwardAcks, ttlSkipped, ttlDelivered;
+uint16_t ttlLastLost;
+
+void ttlCheckDone(void) {
+  if (ttlSkipped && ttlDelivered)
+    atomic_store(&pumpDone, 1);
+}
+
+int ttlDrop(int fromServer, const uint8_t *packet, ssize_t n) {
+  uint16_t nr;
+
+  // Acknr of ctx2, seqnr of ctx1.
+  memcpy(&nr, packet + (fromServer ? 10 : 8), sizeof(nr));
+  if (fromServer) {
+    if (ttlDropped && (int16_t)(nr - ttlLastLost) >= 0)
+      ttlSkipped = 1;
+    ttlCheckDone();
+    return 0;
+  }
+
+  // ST_STATE carrying EXT_FORWARD_ACK.
+  if (packet[0] >> 4 == 2 && packet[1] == 3)
+    ttlForwardAcks++;
+  // Plain ST_DATA of the lost data.
+  if (packet[0] >> 4 != 0 || packet[1] != 0 || n <= 12 || packet[12] != 'L')
+    return 0;
+  ttlDropped++;
+  ttlLastLost = nr;
+  return 1;
+}
+
+void ttlEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf, ssize_t n) {
+  if (s == ctx1 && (events & RDP_CONNECTED)) {
+    uint8_t lost[TTL_LOST];
+
+    memset(lost, 'L', sizeof(lost));
+    assert(rdpWriteTtl(c, lost, sizeof(lost), TTL_MS) == TTL_LOST);
+    assert(rdpWrite(c, "after", 5) == 5);
+  }
+
+  if (s != ctx2 || !(events & RDP_DATA) || n <= 0)
+    return;
+
+  assert(n == 5 && !memcmp(buf, "after", 5));
+  assert(ttlDropped >= 3 && ttlForwardAcks > 0 && !ttlDelivered);
+  ttlDelivered = 1;
+  ttlCheckDone();
+}
+
+void testTtl(void) {
+  proxyOpen(ttlDrop);
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  assert(ctx1 && ctx2);
+  assert(rdpNetConnect(ctx1, "127.0.0.1", "8892"));
+
+  pump(ttlEvent, 10);
+
+  printf("ttl: %d packets dropped past their TTL, skipped by %d forward acks\n",
+         ttlDropped, ttlForwardAcks);
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+  proxyClose();
+}
+
+// ctx1 writes a request and shuts down writing, ctx2 answers after the end of
+// file and closes, ctx1 keeps receiving the answer in CS_HALF_CLOSED and
+// closes on its end of file. Both ends let go of the connection then, which
+// isn't exported anymore.
+#define HALF_RESPONSE 20000 // Several packets.
+
+size_t halfGot;
+int halfEofs;
+
+void halfEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf,
+               ssize_t n) {
+  if (s == ctx1 && (events & RDP_CONNECTED)) {
+    assert(rdpWrite(c, "request", 7) == 7);
+    assert(rdpConnShutdown(c, SHUT_WR) == 0);
+    assert(rdpWrite(c, "more", 4) == -1 && errno == EPIPE);
+    assert(rdpConnShutdown(c, SHUT_WR) == -1 && errno == EINVAL);
+  }
+
+  if (!(events & RDP_DATA))
+    return;
+
+  if (s == ctx2 && n > 0) {
+    assert(n == 7 && !memcmp(buf, "request", 7));
+  } else if (s == ctx2) {
+    uint8_t response[HALF_RESPONSE];
+
+    for (size_t i = 0; i < sizeof(response); i++)
+      response[i] = i % 251;
+    assert(rdpWrite(c, response, sizeof(response)) == HALF_RESPONSE);
+    assert(rdpConnClose(c) == 0);
+    halfEofs++;
+  } else if (n > 0) {
+    for (ssize_t i = 0; i < n; i++)
+      assert(buf[i] == (halfGot + i) % 251);
+    halfGot += n;
+  } else {
+    assert(halfEofs == 1 && halfGot == HALF_RESPONSE);
+    assert(rdpConnClose(c) == 0);
+    halfEofs++;
+    atomic_store(&pumpDone, 1);
+  }
+}
+
+void testHalfClose(void) {
+  ssize_t idle[2];
+
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  assert(ctx1 && ctx2);
+  idle[0] = rdpSocketExport(ctx1, NULL, 0);
+  idle[1] = rdpSocketExport(ctx2, NULL, 0);
+  assert(rdpNetConnect(ctx1, "127.0.0.1", "8889"));
+
+  pump(halfEvent, 10);
+
+  // ctx2 lets go once its ST_FIN is acked.
+  time_t deadline = time(NULL) + 5;
+  while (rdpSocketExport(ctx1, NULL, 0) != idle[0] ||
+         rdpSocketExport(ctx2, NULL, 0) != idle[1]) {
+    assert(time(NULL) < deadline);
+    usleep(1000);
+    for (int i = 0; i < 2; i++) {
+      rdpConn *c;
+      int events;
+      do
+        rdpReadPoll(i ? ctx2 : ctx1, pumpBuf, sizeof(pumpBuf), &c, &events);
+      while (!(events & RDP_AGAIN));
+    }
+  }
+
+  printf("half close: %d bytes answered after the end of file\n",
+         HALF_RESPONSE);
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+}
+
+// ctx1 sends to a multicast group ctx2 and ctx3 are members of. One packet is
+// taken off ctx2's socket before it reads it, so ctx2 has to NAK it and get it
+// resent to the group, while ctx3 got it the first time. Skipped without a
+// route for the group.
+#define GROUP_ADDR "239.1.2.3"
+#define GROUP_DATA "firstlostlast"
+
+size_t groupGot[2], groupWant;
+
+void groupEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf,
+                ssize_t n) {
+  if (s == ctx1 || !(events & RDP_DATA) || n <= 0)
+    return;
+
+  size_t *got = &groupGot[s == ctx3];
+  assert(*got + n <= groupWant && !memcmp(buf, GROUP_DATA + *got, n));
+  *got += n;
+  if (groupGot[0] == groupWant && groupGot[1] == groupWant)
+    atomic_store(&pumpDone, 1);
+}
+
+void testGroup(void) {
+  uint8_t packet[2048];
+
+  ctx1 = rdpSocketCreate(1, "0.0.0.0", "8888");
+  ctx2 = rdpGroupSocketCreate(1, GROUP_ADDR, "8893");
+  ctx3 = rdpGroupSocketCreate(1, GROUP_ADDR, "8893");
+  assert(ctx1);
+  rdpConn *g = ctx2 && ctx3 ? rdpGroupOpen(ctx1, GROUP_ADDR, "8893") : NULL;
+  if (!g || rdpWrite(g, "first", 5) != 5) {
+    printf("group: skipped, no route for %s?\n", GROUP_ADDR);
+    goto out;
+  }
+  groupWant = 5;
+  pump(groupEvent, 10);
+
+  // Drop the ST_GROUP packet of "lost" at ctx2, heartbeats on the way too.
+  struct pollfd pfd = {rdpSocketGetProp(ctx2, RDP_PROP_FD), POLLIN};
+  assert(rdpWrite(g, "lost", 4) == 4);
+  do
+    assert(poll(&pfd, 1, 1000) == 1 &&
+           recv(pfd.fd, packet, sizeof(packet), 0) > 0);
+  while (packet[0] >> 4 != 6);
+  assert(rdpWrite(g, "last", 4) == 4);
+  groupWant = strlen(GROUP_DATA);
+  pump(groupEvent, 10);
+
+  printf("group: lost packet repaired for one of 2 members\n");
+out:
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+  rdpSocketDestroy(ctx3);
+  ctx3 = NULL;
+}
+
+// ctx2 splices a connection from ctx1, coming through the proxy, to one of its
+// own to ctx3. ctx1 writes once told so, right after the splice, and shuts
+// down. The proxy drops one of its data packets once, so those after it are
+// held out of order and relayed by rdpConnSpliceHeld() after the resend. ctx3
+// checks every byte and the end of file passed on.
+#define SPLICE_BYTES 200000
+#define SPLICE_DROP 20 // Data packet dropped.
+
+rdpConn *spliceBack;
+size_t spliceSent, spliceGot;
+int spliceData, spliceEof;
+
+int spliceDrop(int fromServer, const uint8_t *packet, ssize_t n) {
+  return !fromServer && n > 500 && ++spliceData == SPLICE_DROP;
+}
+
+uint8_t spliceByte(size_t i) { return i * 7 % 251; }
+
+void spliceWrite(rdpConn *c) {
+  uint8_t chunk[1000];
+
+  while (spliceSent < SPLICE_BYTES) {
+    size_t len = SPLICE_BYTES - spliceSent < sizeof(chunk)
+                     ? SPLICE_BYTES - spliceSent
+                     : sizeof(chunk);
+
+    for (size_t i = 0; i < len; i++)
+      chunk[i] = spliceByte(spliceSent + i);
+    ssize_t n = rdpWrite(c, chunk, len);
+    if (n == -1) {
+      assert(errno == EAGAIN);
+      return;
+    }
+    spliceSent += n;
+  }
+  assert(rdpConnShutdown(c, SHUT_WR) == 0);
+}
+
+void spliceEvent(rdpSocket *s, rdpConn *c, int events, uint8_t *buf,
+                 ssize_t n) {
+  if (s == ctx2 && (events & RDP_CONNECTED)) {
+    assert(c == spliceBack);
+    assert(rdpNetConnect(ctx1, "127.0.0.1", "8892"));
+  }
+
+  if (s == ctx2 && (events & RDP_ACCEPT)) {
+    assert(n == 5 && !memcmp(buf, "hello", 5));
+    assert(rdpWrite(c, "go", 2) == 2);
+    assert(rdpConnSplice(c, spliceBack) == 0);
+  }
+
+  if (s == ctx1 && (events & RDP_CONNECTED))
+    assert(rdpWrite(c, "hello", 5) == 5);
+
+  if (s == ctx1 && (events & RDP_DATA) && n > 0) {
+    assert(n == 2 && !memcmp(buf, "go", 2));
+    spliceWrite(c);
+  } else if (s == ctx1 && (events & RDP_POLLOUT) &&
+             spliceSent && spliceSent < SPLICE_BYTES) {
+    spliceWrite(c);
+  }
+
+  if (s != ctx3 || !(events & RDP_DATA))
+    return;
+
+  if (n == 0) {
+    assert(spliceGot == SPLICE_BYTES);
+    atomic_store(&pumpDone, 1);
+    return;
+  }
+  for (ssize_t i = 0; i < n; i++)
+    assert(buf[i] == spliceByte(spliceGot + i));
+  spliceGot += n;
+}
+
+void testSplice(void) {
+  proxyOpen(spliceDrop);
+  ctx1 = rdpSocketCreate(1, "127.0.0.1", "8888");
+  ctx2 = rdpSocketCreate(1, "127.0.0.1", "8889");
+  ctx3 = rdpSocketCreate(1, "127.0.0.1", "8890");
+  assert(ctx1 && ctx2 && ctx3);
+  spliceBack = rdpNetConnect(ctx2, "127.0.0.1", "8890");
+  assert(spliceBack);
+
+  pump(spliceEvent, 20);
+  assert(spliceData > SPLICE_DROP);
+
+  printf("splice: %d bytes relayed intact past a lost packet\n",
+         SPLICE_BYTES);
+  rdpSocketDestroy(ctx1);
+  rdpSocketDestroy(ctx2);
+  rdpSocketDestroy(ctx3);
+  ctx3 = NULL;
+  proxyClose();
+}
+
 int main() {
   int s;
   int efd, fd1, fd2;
@@ -187,4 +1210,16 @@ int main() {
 exit:
   rdpSocketDestroy(ctx1);
   rdpSocketDestroy(ctx2);
+
+  testBigMessage();
+  testSubmit();
+  testSubmitReset();
+  testComplete();
+  testRuntime();
+  testHandoff();
+  testStreams();
+  testTtl();
+  testHalfClose();
+  testGroup();
+  testSplice();
 }